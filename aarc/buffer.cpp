@@ -0,0 +1,150 @@
+//
+//  buffer.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "buffer.hpp"
+
+#include <catch2/catch.hpp>
+
+buffer_pool::buffer_pool(std::size_t buffer_size, std::size_t slab_size, bool hugepages)
+: _head(0)
+, _buffer_size(buffer_size)
+, _slab_size(std::max(slab_size, buffer_size))
+, _hugepages(hugepages) {
+    assert(buffer_size);
+#if defined(__linux__)
+    if (_hugepages) {
+        // explicit hugepages must be mapped in whole pages
+        std::size_t huge = 2 << 20;
+        _slab_size = (_slab_size + huge - 1) / huge * huge;
+    }
+#endif
+}
+
+buffer_pool::~buffer_pool() {
+    for (auto& s : _slabs)
+        (void) munmap(s._base, s._length);
+}
+
+void buffer_pool::_grow() {
+    std::unique_lock lock{_mutex};
+    if (atomic_load(&_head, std::memory_order_relaxed) & PTR)
+        return; // <-- another thread grew the pool, or buffers came back
+    void* p = MAP_FAILED;
+#if defined(__linux__)
+    if (_hugepages)
+        p = mmap(nullptr, _slab_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(nullptr, _slab_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (p == MAP_FAILED)
+            (void) perror(strerror(errno)), abort();
+#if defined(__linux__)
+        if (_hugepages)
+            (void) madvise(p, _slab_size, MADV_HUGEPAGE); // <-- none reserved
+#endif
+    }
+    std::size_t n = _slab_size / _buffer_size;
+    std::unique_ptr<detail::buffer_node[]> nodes{new detail::buffer_node[n]};
+    for (std::size_t i = 0; i != n; ++i) {
+        nodes[i]._pool = this;
+        nodes[i]._next = (i + 1 != n) ? &nodes[i + 1] : nullptr;
+        nodes[i]._count = 0;
+        nodes[i]._data = (char*) p + i * _buffer_size;
+        nodes[i]._capacity = _buffer_size;
+        nodes[i]._size = 0;
+    }
+    _push(&nodes[0], &nodes[n - 1]);
+    _slabs.push_back(slab{p, _slab_size, std::move(nodes)});
+}
+
+TEST_CASE("buffer", "[buffer]") {
+    
+    buffer_pool pool(4096, 16 * 4096);
+    REQUIRE(pool.capacity() == 0); // <-- slabs are mapped on demand
+    
+    {
+        buffer a = pool.acquire();
+        REQUIRE(a);
+        REQUIRE(a.size() == 0);
+        REQUIRE(a.capacity() == 4096);
+        REQUIRE(((std::uintptr_t) a.data() & 4095) == 0);
+        REQUIRE(pool.capacity() == 16);
+        
+        std::memset(a.data(), 'x', 4096);
+        a.resize(100);
+        buffer b = a; // <-- shares the same memory
+        REQUIRE(b.data() == a.data());
+        REQUIRE(b.size() == 100);
+        
+        char* p = a.data();
+        a = buffer{};
+        REQUIRE(!a);
+        REQUIRE(b.size() == 100); // <-- still held by b
+        b = buffer{};
+        
+        buffer c = pool.acquire(); // <-- last returned is first reused
+        REQUIRE(c.data() == p);
+        REQUIRE(c.size() == 0);
+    }
+    
+    {
+        // exhausting a slab maps another
+        std::vector<buffer> v;
+        std::set<char*> distinct;
+        for (int i = 0; i != 40; ++i) {
+            v.push_back(pool.acquire());
+            distinct.insert(v.back().data());
+        }
+        REQUIRE(distinct.size() == 40);
+        REQUIRE(pool.capacity() == 48);
+        REQUIRE(pool.mapped() == 3 * 16 * 4096);
+    }
+    
+    {
+        // contended acquire and release neither loses nor duplicates buffers
+        std::vector<std::thread> threads;
+        std::atomic<bool> failed{false};
+        for (int i = 0; i != 4; ++i) {
+            threads.emplace_back([&pool, &failed, i] {
+                std::vector<buffer> held;
+                for (int j = 0; j != 100'000; ++j) {
+                    if (held.size() < 8) {
+                        held.push_back(pool.acquire());
+                        std::memset(held.back().data(), i, 64);
+                    } else {
+                        for (auto& b : held)
+                            for (int k = 0; k != 64; ++k)
+                                if (b.data()[k] != i)
+                                    failed = true;
+                        held.clear();
+                    }
+                }
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        REQUIRE(!failed);
+        REQUIRE(pool.capacity() == 48); // <-- 32 in flight at most
+    }
+    
+    {
+        // hugepages fall back to ordinary pages when none are reserved
+        buffer_pool huge(64 << 10, 1 << 20, true);
+        buffer a = huge.acquire();
+        std::memset(a.data(), 0, a.capacity());
+        REQUIRE(huge.capacity() >= 16);
+    }
+    
+}
@@ -0,0 +1,220 @@
+//
+//  buffer.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef buffer_hpp
+#define buffer_hpp
+
+#include <sys/mman.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "atomic.hpp"
+#include "common.hpp"
+
+using rust::u64;
+using namespace aarc;
+
+// pooled I/O buffers
+//
+// a buffer_pool carves fixed-size buffers out of large slabs mapped with
+// mmap, and recycles them through a lock-free free list.  on Linux the slabs
+// can be backed by explicit hugepages, falling back to transparent hugepages
+// when none are reserved, so that a busy pool costs few TLB entries.  slabs
+// are never returned to the system while the pool lives
+//
+// the point is to take memory only while there is data to hold.  a reader
+// that waits with its own buffer pins that buffer for as long as the peer is
+// idle; async_read_buffer (see corrode.hpp) instead waits for readiness and
+// only then takes a buffer, so 100k idle connections cost no buffers at all,
+// and the pool grows to the number of messages actually in flight
+//
+// a buffer is a reference-counted handle.  the last copy to be destroyed
+// returns the memory to the pool, which must outlive all its buffers
+
+struct buffer_pool;
+
+namespace detail {
+    
+    // headers live apart from the slab, so buffers stay page-aligned and
+    // the whole of each buffer is usable
+    struct buffer_node {
+        buffer_pool* _pool;
+        buffer_node* _next; // <-- free list
+        u64 _count;
+        char* _data;
+        std::size_t _capacity;
+        std::size_t _size; // <-- bytes in use
+    };
+    
+} // namespace detail
+
+struct buffer {
+    
+    detail::buffer_node* _node;
+    
+    buffer()
+    : _node(nullptr) {
+    }
+    
+    explicit buffer(detail::buffer_node* p)
+    : _node(p) {
+    }
+    
+    buffer(buffer const& other)
+    : _node(other._node) {
+        if (_node)
+            atomic_fetch_add(&_node->_count, (u64) 1, std::memory_order_relaxed);
+    }
+    
+    buffer(buffer&& other)
+    : _node(std::exchange(other._node, nullptr)) {
+    }
+    
+    ~buffer();
+    
+    buffer& operator=(buffer other) {
+        std::swap(_node, other._node);
+        return *this;
+    }
+    
+    explicit operator bool() const {
+        return _node;
+    }
+    
+    char* data() const {
+        assert(_node);
+        return _node->_data;
+    }
+    
+    std::size_t size() const {
+        return _node ? _node->_size : 0;
+    }
+    
+    std::size_t capacity() const {
+        return _node ? _node->_capacity : 0;
+    }
+    
+    void resize(std::size_t n) {
+        assert(_node && (n <= _node->_capacity));
+        _node->_size = n;
+    }
+    
+    char* begin() const { return data(); }
+    char* end() const { return data() + size(); }
+    
+};
+
+struct buffer_pool {
+    
+    // the free list head is a pointer with a 16 bit tag in the unused high
+    // bits, bumped on every change so that a stale pop cannot succeed
+    static constexpr u64 PTR = 0x0000'FFFF'FFFF'FFFF;
+    static constexpr u64 TAG = 0x0001'0000'0000'0000;
+    
+    alignas(64) u64 _head;
+    
+    std::size_t _buffer_size;
+    std::size_t _slab_size;
+    bool _hugepages;
+    
+    struct slab {
+        void* _base;
+        std::size_t _length;
+        std::unique_ptr<detail::buffer_node[]> _nodes;
+    };
+    
+    mutable std::mutex _mutex; // <-- serializes growth
+    std::vector<slab> _slabs;
+    
+    explicit buffer_pool(std::size_t buffer_size = 16 << 10,
+                         std::size_t slab_size = 2 << 20,
+                         bool hugepages = false);
+    ~buffer_pool();
+    
+    buffer_pool(buffer_pool const&) = delete;
+    buffer_pool& operator=(buffer_pool const&) = delete;
+    
+    detail::buffer_node* _pop() {
+        u64 h = atomic_load(&_head, std::memory_order_acquire);
+        for (;;) {
+            auto p = (detail::buffer_node*) (h & PTR);
+            if (!p)
+                return nullptr;
+            // p may be popped and pushed back before we swing the head, but
+            // headers are never freed and the tag will then have moved on
+            u64 n = ((h & ~PTR) + TAG) | (u64) atomic_load(&p->_next, std::memory_order_relaxed);
+            if (atomic_compare_exchange_weak(&_head, &h, n, std::memory_order_acquire, std::memory_order_acquire))
+                return p;
+        }
+    }
+    
+    // push the list first ... last
+    void _push(detail::buffer_node* first, detail::buffer_node* last) {
+        u64 h = atomic_load(&_head, std::memory_order_relaxed);
+        for (;;) {
+            atomic_store(&last->_next, (detail::buffer_node*) (h & PTR), std::memory_order_relaxed);
+            u64 n = ((h & ~PTR) + TAG) | (u64) first;
+            if (atomic_compare_exchange_weak(&_head, &h, n, std::memory_order_release, std::memory_order_relaxed))
+                return;
+        }
+    }
+    
+    void _push(detail::buffer_node* p) {
+        _push(p, p);
+    }
+    
+    void _grow();
+    
+    // a buffer of size zero and capacity buffer_size()
+    buffer acquire() {
+        for (;;) {
+            if (auto p = _pop()) {
+                p->_count = 1;
+                p->_size = 0;
+                return buffer{p};
+            }
+            _grow();
+        }
+    }
+    
+    std::size_t buffer_size() const {
+        return _buffer_size;
+    }
+    
+    // bytes mapped, whether or not the buffers are in use
+    std::size_t mapped() const {
+        std::unique_lock lock{_mutex};
+        std::size_t n = 0;
+        for (auto& s : _slabs)
+            n += s._length;
+        return n;
+    }
+    
+    // buffers carved out so far
+    std::size_t capacity() const {
+        std::unique_lock lock{_mutex};
+        return _slabs.size() * (_slab_size / _buffer_size);
+    }
+    
+};
+
+inline buffer::~buffer() {
+    if (_node && (atomic_fetch_sub(&_node->_count, (u64) 1, std::memory_order_acq_rel) == 1))
+        _node->_pool->_push(_node);
+}
+
+#endif /* buffer_hpp */
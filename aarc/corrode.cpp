@@ -6,6 +6,12 @@
 //  Copyright © 2020 Antony Searle. All rights reserved.
 //
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <array>
 #include <experimental/coroutine>
 #include <future>
 #include <map>
@@ -16,6 +22,7 @@
 
 #include "atomic_wait.hpp"
 #include "corrode.hpp"
+#include "dual.hpp"
 #include <catch2/catch.hpp>
 #include "pool.hpp"
 #include "reactor.hpp"
@@ -122,3 +129,1052 @@ TEST_CASE("stress", "[await]") {
     
 }
 
+
+namespace {
+    
+    // a non-blocking socket listening on an ephemeral loopback port
+    int listen_loopback(sockaddr_in& addr) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t n = sizeof(addr);
+        if ((fd == -1)
+            || (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+            || (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0)
+            || (listen(fd, SOMAXCONN) != 0)
+            || (getsockname(fd, (sockaddr*) &addr, &n) != 0))
+            (void) perror(strerror(errno)), abort();
+        return fd;
+    }
+    
+    // both ends of a loopback TCP connection
+    void connected_pair(int& a, int& b) {
+        sockaddr_in addr;
+        int listener = listen_loopback(addr);
+        a = socket(AF_INET, SOCK_STREAM, 0);
+        if ((a == -1) || (connect(a, (sockaddr*) &addr, sizeof(addr)) != 0))
+            (void) perror(strerror(errno)), abort();
+        while ((b = accept(listener, nullptr, nullptr)) == -1)
+            if (errno != EAGAIN)
+                (void) perror(strerror(errno)), abort();
+        (void) fcntl(b, F_SETFL, 0); // <-- blocking, like a
+        close(listener);
+    }
+    
+    int socket_nonblocking() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        if ((fd == -1)
+            || (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+            || (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0))
+            (void) perror(strerror(errno)), abort();
+        return fd;
+    }
+    
+    void echo_session(int fd) {
+        char buf[4096];
+        for (;;) {
+            ssize_t n = co_await async_recv(fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            for (ssize_t m = 0; m != n; ) {
+                ssize_t k = co_await async_send(fd, buf + m, n - m);
+                if (k <= 0)
+                    break;
+                m += k;
+            }
+        }
+        close(fd);
+    }
+    
+    // serves until the listener is shut down
+    void echo_server(int listener, std::promise<void>* stopped) {
+        for (;;) {
+            int fd = co_await async_accept(listener);
+            if (fd == -1)
+                break;
+            int one = 1;
+            (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            echo_session(fd);
+        }
+        stopped->set_value();
+    }
+    
+    void echo_client(sockaddr_in addr,
+                     std::chrono::steady_clock::time_point deadline,
+                     std::vector<double>* latencies,
+                     std::atomic<int>* remaining,
+                     std::promise<void>* done) {
+        int fd = socket_nonblocking();
+        int r = co_await async_connect(fd, (sockaddr const*) &addr, sizeof(addr));
+        char buf[64] = {};
+        while ((r == 0) && (std::chrono::steady_clock::now() < deadline)) {
+            auto t0 = std::chrono::steady_clock::now();
+            for (ssize_t m = 0; (r == 0) && (m != sizeof(buf)); ) {
+                ssize_t k = co_await async_send(fd, buf + m, sizeof(buf) - m);
+                (k > 0) ? (void) (m += k) : (void) (r = -1);
+            }
+            for (ssize_t m = 0; (r == 0) && (m != sizeof(buf)); ) {
+                ssize_t k = co_await async_recv(fd, buf + m, sizeof(buf) - m);
+                (k > 0) ? (void) (m += k) : (void) (r = -1);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            latencies->push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+        close(fd);
+        if (remaining->fetch_sub(1, std::memory_order_relaxed) == 1)
+            done->set_value();
+    }
+    
+} // namespace
+
+TEST_CASE("await-socket", "[await]") {
+    
+    // with and without the completion engine
+    reactor readiness(reactor::default_backend, std::chrono::milliseconds{1}, false);
+    reactor completions;
+    
+    for (reactor const* r : { &readiness, &completions }) {
+        
+        sockaddr_in addr;
+        int listener = listen_loopback(addr);
+        
+        std::promise<int> accepted;
+        auto acceptor = [&]() -> void {
+            accepted.set_value(co_await async_accept(*r, listener));
+        };
+        acceptor();
+        
+        std::promise<std::string> received;
+        auto connector = [&]() -> void {
+            int fd = socket_nonblocking();
+            int e = co_await async_connect(*r, fd, (sockaddr const*) &addr, sizeof(addr));
+            assert(e == 0);
+            char buf[6] = "hello";
+            ssize_t n = co_await async_send(*r, fd, buf, sizeof(buf));
+            assert(n == sizeof(buf));
+            n = co_await async_recv(*r, fd, buf, sizeof(buf), MSG_WAITALL);
+            received.set_value(std::string(buf, std::max<ssize_t>(n - 1, 0)));
+            close(fd);
+        };
+        connector();
+        
+        int fd = accepted.get_future().get();
+        REQUIRE(fd >= 0);
+        REQUIRE(fcntl(fd, F_GETFL) & O_NONBLOCK);
+        auto echo = [&, fd]() -> void {
+            char buf[6];
+            ssize_t n = co_await async_recv(*r, fd, buf, sizeof(buf), MSG_WAITALL);
+            n = co_await async_send(*r, fd, buf, n);
+            close(fd);
+        };
+        echo();
+        REQUIRE(received.get_future().get() == "hello");
+        
+        // connecting to a closed port fails asynchronously
+        close(listener);
+        std::promise<int> refused;
+        auto refuser = [&]() -> void {
+            int fd = socket_nonblocking();
+            int e = co_await async_connect(*r, fd, (sockaddr const*) &addr, sizeof(addr));
+            refused.set_value((e == -1) ? errno : 0);
+            close(fd);
+        };
+        refuser();
+        REQUIRE(refused.get_future().get() == ECONNREFUSED);
+        
+        // errors from the engine are reported through errno too
+        std::promise<int> bad;
+        auto bad_reader = [&]() -> void {
+            char c;
+            ssize_t n = co_await async_recv(*r, -1, &c, 1);
+            bad.set_value((n == -1) ? errno : 0);
+        };
+        bad_reader();
+        REQUIRE(bad.get_future().get() == EBADF);
+        
+    }
+    
+}
+
+TEST_CASE("await-echo-bench", "[await][.bench]") {
+    
+    // loopback TCP echo of 64 byte requests, one outstanding per connection
+    
+    using namespace std::chrono;
+    
+    sockaddr_in addr;
+    int listener = listen_loopback(addr);
+    std::promise<void> stopped;
+    echo_server(listener, &stopped);
+    
+    for (int connections : { 1, 16, 64, 256 }) {
+        
+        std::vector<std::vector<double>> latencies(connections);
+        std::atomic<int> remaining{connections};
+        std::promise<void> done;
+        auto t0 = steady_clock::now();
+        for (auto& v : latencies)
+            echo_client(addr, t0 + seconds{1}, &v, &remaining, &done);
+        done.get_future().get();
+        auto t1 = steady_clock::now();
+        
+        std::vector<double> v;
+        for (auto& w : latencies)
+            v.insert(v.end(), w.begin(), w.end());
+        std::sort(v.begin(), v.end());
+        if (v.empty())
+            continue;
+        printf("%4d connections: %8.0f requests per second, p50 %7.1f us, p99 %7.1f us\n",
+               connections,
+               v.size() / duration<double>(t1 - t0).count(),
+               v[v.size() / 2],
+               v[v.size() * 99 / 100]);
+        
+    }
+    
+    shutdown(listener, SHUT_RDWR); // <-- wakes the acceptor
+    stopped.get_future().get();
+    close(listener);
+    
+}
+
+TEST_CASE("await-vectored", "[await]") {
+    
+    reactor readiness(reactor::default_backend, std::chrono::milliseconds{1}, false);
+    reactor completions;
+    
+    for (reactor const* r : { &readiness, &completions }) {
+        
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        REQUIRE(fcntl(p[0], F_SETFL, O_NONBLOCK) == 0);
+        REQUIRE(fcntl(p[1], F_SETFL, O_NONBLOCK) == 0);
+        
+        // header and body in one syscall
+        {
+            char header[4] = "abc";
+            char body[8] = "defghij";
+            iovec out[2] = { { header, 3 }, { body, 7 } };
+            char a[5] = {};
+            char b[6] = {};
+            iovec in[2] = { { a, 4 }, { b, 5 } };
+            std::promise<std::pair<ssize_t, ssize_t>> done;
+            auto exchange = [&]() -> void {
+                ssize_t n = co_await async_writev(*r, p[1], out, 2);
+                ssize_t m = co_await async_readv(*r, p[0], in, 2);
+                done.set_value({n, m});
+            };
+            exchange();
+            REQUIRE(done.get_future().get() == std::make_pair<ssize_t, ssize_t>(10, 9));
+            REQUIRE(std::string(a) == "abcd");
+            REQUIRE(std::string(b) == "efghi");
+            char c;
+            REQUIRE(read(p[0], &c, 1) == 1);
+            REQUIRE(c == 'j');
+        }
+        
+        // readiness that is gone by the time the waiter runs, because the
+        // pool is held busy while the byte is taken from under the reader,
+        // which must wait again rather than resume with EAGAIN
+        if (r == &readiness) {
+            char a[2] = {};
+            iovec in[1] = { { a, 1 } };
+            std::promise<ssize_t> done;
+            auto reader = [&]() -> void {
+                done.set_value(co_await async_readv(*r, p[0], in, 1));
+            };
+            reader();
+            auto& pool = pool_dual::_get();
+            std::promise<void> release;
+            std::shared_future<void> released = release.get_future().share();
+            std::atomic<std::size_t> busy{0};
+            for (std::size_t i = 0; i != pool._workers.size(); ++i)
+                pool.submit([&busy, released] {
+                    busy.fetch_add(1, std::memory_order_relaxed);
+                    released.wait();
+                });
+            while (busy.load(std::memory_order_relaxed) != pool._workers.size())
+                std::this_thread::yield();
+            char c = 'x';
+            REQUIRE(write(p[1], &c, 1) == 1);
+            std::this_thread::sleep_for(std::chrono::milliseconds{20}); // <-- the reader is woken
+            while (read(p[0], &c, 1) != 1)
+                std::this_thread::yield();
+            release.set_value();
+            std::this_thread::sleep_for(std::chrono::milliseconds{20}); // <-- and finds nothing
+            c = 'y';
+            REQUIRE(write(p[1], &c, 1) == 1);
+            REQUIRE(done.get_future().get() == 1);
+            REQUIRE(a[0] == 'y');
+        }
+        
+        // and with a deadline, which needs to know the readiness to wait for
+        {
+            char a[1];
+            iovec in[1] = { { a, 1 } };
+            std::promise<std::pair<ssize_t, int>> done;
+            auto reader = [&]() -> void {
+                ssize_t n = co_await with_timeout(async_readv(*r, p[0], in, 1), std::chrono::milliseconds{10});
+                done.set_value({n, errno});
+            };
+            reader();
+            REQUIRE(done.get_future().get() == std::make_pair<ssize_t, int>(-1, ETIMEDOUT));
+        }
+        
+        // a large write to a pipe, read in many pieces
+        {
+            std::size_t n = 1 << 20;
+            std::vector<char> out(n);
+            std::vector<char> in(n);
+            for (std::size_t i = 0; i != n; ++i)
+                out[i] = (char) i;
+            std::promise<ssize_t> written;
+            std::promise<ssize_t> read;
+            auto writer = [&]() -> void {
+                written.set_value(co_await async_write_all(*r, p[1], out.data(), n));
+            };
+            writer();
+            auto reader = [&]() -> void {
+                read.set_value(co_await async_read_exact(*r, p[0], in.data(), n));
+            };
+            reader();
+            REQUIRE(written.get_future().get() == (ssize_t) n);
+            REQUIRE(read.get_future().get() == (ssize_t) n);
+            REQUIRE(in == out);
+        }
+        
+        // end of file cuts a read short
+        {
+            char c[10];
+            REQUIRE(write(p[1], c, 3) == 3);
+            close(p[1]);
+            std::promise<ssize_t> read;
+            auto eof_reader = [&]() -> void {
+                read.set_value(co_await async_read_exact(*r, p[0], c, 10));
+            };
+            eof_reader();
+            REQUIRE(read.get_future().get() == 3);
+        }
+        
+        close(p[0]);
+        
+    }
+    
+}
+
+#if defined(__linux__)
+
+TEST_CASE("await-splice", "[await]") {
+    
+    std::string s = "the quick brown fox jumps over the lazy dog";
+    
+    int a, b;
+    connected_pair(a, b);
+    REQUIRE(fcntl(a, F_SETFL, O_NONBLOCK) == 0);
+    
+    // from a file to a socket
+    {
+        FILE* f = tmpfile();
+        REQUIRE(fwrite(s.data(), 1, s.size(), f) == s.size());
+        fflush(f);
+        off_t offset = 4;
+        std::promise<ssize_t> sent;
+        auto sender = [&]() -> void {
+            sent.set_value(co_await async_sendfile(a, fileno(f), &offset, 5));
+        };
+        sender();
+        REQUIRE(sent.get_future().get() == 5);
+        REQUIRE(offset == 9);
+        char buf[5];
+        REQUIRE(recv(b, buf, 5, MSG_WAITALL) == 5);
+        REQUIRE(std::string(buf, 5) == "quick");
+        fclose(f);
+    }
+    
+    // from a socket through a pipe to a socket, duplicating into a second
+    // pipe on the way
+    {
+        int p[2];
+        int q[2];
+        REQUIRE(pipe(p) == 0);
+        REQUIRE(pipe(q) == 0);
+        std::promise<std::tuple<ssize_t, ssize_t, ssize_t>> moved;
+        auto mover = [&]() -> void {
+            ssize_t n = co_await async_splice(b, p[1], s.size());
+            ssize_t m = co_await async_tee(p[0], q[1], n);
+            ssize_t k = co_await async_splice(p[0], a, m);
+            moved.set_value({n, m, k});
+        };
+        REQUIRE(fcntl(b, F_SETFL, O_NONBLOCK) == 0);
+        mover(); // <-- waits for data
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        REQUIRE(write(a, s.data(), s.size()) == (ssize_t) s.size());
+        auto [n, m, k] = moved.get_future().get();
+        REQUIRE(n == (ssize_t) s.size());
+        REQUIRE(m == n);
+        REQUIRE(k == n);
+        REQUIRE(fcntl(b, F_SETFL, 0) == 0);
+        std::string t(s.size(), '\0');
+        REQUIRE(recv(b, t.data(), t.size(), MSG_WAITALL) == (ssize_t) t.size());
+        REQUIRE(t == s);
+        REQUIRE(read(q[0], t.data(), t.size()) == (ssize_t) t.size());
+        REQUIRE(t == s);
+        for (int fd : { p[0], p[1], q[0], q[1] })
+            close(fd);
+    }
+    
+    close(a);
+    close(b);
+    
+}
+
+TEST_CASE("await-proxy-bench", "[await][.bench]") {
+    
+    // a proxy between two loopback TCP connections, copying through a user
+    // buffer or splicing through a pipe; a producer thread streams into the
+    // first connection and a consumer thread drains the second
+    
+    using namespace std::chrono;
+    
+    auto bench = [](bool zero_copy, std::size_t chunk) {
+        
+        int src_w, src_r, dst_w, dst_r;
+        connected_pair(src_w, src_r);
+        connected_pair(dst_w, dst_r);
+        (void) fcntl(src_r, F_SETFL, O_NONBLOCK);
+        (void) fcntl(dst_w, F_SETFL, O_NONBLOCK);
+        
+        std::size_t total = std::size_t{1} << 30;
+        std::promise<void> proxied;
+        
+        auto copy = [&]() -> void {
+            std::vector<char> buf(chunk);
+            for (;;) {
+                ssize_t n = co_await async_recv(src_r, buf.data(), buf.size());
+                if ((n <= 0) || (co_await async_write_all(dst_w, buf.data(), n) != n))
+                    break;
+            }
+            proxied.set_value();
+        };
+        
+        auto splice = [&]() -> void {
+            int p[2];
+            [[maybe_unused]] int k = pipe(p);
+            (void) fcntl(p[0], F_SETPIPE_SZ, (int) chunk);
+            for (;;) {
+                ssize_t n = co_await async_splice(src_r, p[1], chunk);
+                if (n <= 0)
+                    break;
+                while (n > 0) {
+                    ssize_t m = co_await async_splice(p[0], dst_w, n);
+                    if (m <= 0)
+                        break;
+                    n -= m;
+                }
+            }
+            close(p[0]);
+            close(p[1]);
+            proxied.set_value();
+        };
+        
+        auto t0 = steady_clock::now();
+        std::thread producer([&] {
+            std::vector<char> buf(chunk);
+            for (std::size_t n = 0; n < total; n += chunk)
+                if (send(src_w, buf.data(), chunk, 0) != (ssize_t) chunk)
+                    break;
+            shutdown(src_w, SHUT_WR); // <-- the proxy sees end of file
+        });
+        zero_copy ? splice() : copy();
+        std::size_t received = 0;
+        {
+            std::vector<char> buf(chunk);
+            ssize_t n;
+            while ((received < total) && ((n = recv(dst_r, buf.data(), chunk, 0)) > 0))
+                received += n;
+        }
+        auto t1 = steady_clock::now();
+        producer.join();
+        proxied.get_future().get();
+        
+        printf("%s, %7zu byte chunks: %6.2f GB/s\n",
+               zero_copy ? "splice" : "copy  ",
+               chunk,
+               received / duration<double, std::nano>(t1 - t0).count());
+        
+        for (int fd : { src_w, src_r, dst_w, dst_r })
+            close(fd);
+        
+    };
+    
+    for (std::size_t chunk : { 4'096, 65'536, 1'048'576 }) {
+        bench(false, chunk);
+        bench(true, chunk);
+    }
+    
+}
+
+#endif
+
+TEST_CASE("await-deadline", "[await]") {
+    
+    using namespace std::chrono;
+    
+    reactor readiness(reactor::default_backend, milliseconds{1}, false);
+    reactor completions;
+    
+    for (reactor const* r : { &readiness, &completions }) {
+        
+        int a, b;
+        connected_pair(a, b);
+        REQUIRE(fcntl(b, F_SETFL, O_NONBLOCK) == 0);
+        
+        // a stalled peer times out
+        std::promise<int> stalled;
+        auto t0 = steady_clock::now();
+        auto staller = [&]() -> void {
+            char c;
+            ssize_t n = co_await with_timeout(async_recv(*r, b, &c, 1), milliseconds{20});
+            stalled.set_value((n == -1) ? errno : 0);
+        };
+        staller();
+        REQUIRE(stalled.get_future().get() == ETIMEDOUT);
+        REQUIRE(steady_clock::now() - t0 >= milliseconds{20});
+        
+        // and leaves no waiter behind to swallow the next event
+        std::promise<ssize_t> later;
+        auto reader = [&]() -> void {
+            char c;
+            later.set_value(co_await async_recv(*r, b, &c, 1));
+        };
+        reader();
+        std::this_thread::sleep_for(milliseconds{5});
+        char c{'x'};
+        REQUIRE(send(a, &c, 1, 0) == 1);
+        REQUIRE(later.get_future().get() == 1);
+        
+        // data that arrives in time wins
+        std::promise<ssize_t> prompt;
+        auto prompter = [&]() -> void {
+            char c;
+            prompt.set_value(co_await with_timeout(async_read(*r, b, &c, 1), seconds{10}));
+        };
+        prompter();
+        std::this_thread::sleep_for(milliseconds{5});
+        REQUIRE(send(a, &c, 1, 0) == 1);
+        REQUIRE(prompt.get_future().get() == 1);
+        
+        // accept and connect can time out too
+        sockaddr_in addr;
+        int listener = listen_loopback(addr);
+        std::promise<int> unaccepted;
+        auto acceptor = [&]() -> void {
+            int fd = co_await with_deadline(async_accept(*r, listener), steady_clock::now() + milliseconds{5});
+            unaccepted.set_value((fd == -1) ? errno : 0);
+        };
+        acceptor();
+        REQUIRE(unaccepted.get_future().get() == ETIMEDOUT);
+        close(listener);
+        
+        // when data and the deadline arrive together, each operation
+        // resumes exactly once, with one or the other
+        int n = 200;
+        int received = 0;
+        for (int i = 0; i != n; ++i) {
+            std::promise<int> raced;
+            auto racer = [&]() -> void {
+                char c;
+                ssize_t k = co_await with_timeout(async_recv(*r, b, &c, 1), milliseconds{1});
+                raced.set_value((k == 1) ? 0 : errno);
+            };
+            racer();
+            std::this_thread::sleep_for(microseconds{(i % 40) * 100}); // <-- 0 to 4 ticks
+            REQUIRE(send(a, &c, 1, 0) == 1);
+            int e = raced.get_future().get();
+            REQUIRE(((e == 0) || (e == ETIMEDOUT)));
+            received += !e;
+            if (e) {
+                // collect the byte that arrived too late
+                char d;
+                while (recv(b, &d, 1, 0) != 1)
+                    std::this_thread::sleep_for(microseconds{100});
+            }
+        }
+        REQUIRE(received > 0);
+        
+        close(a);
+        close(b);
+        
+    }
+    
+}
+
+TEST_CASE("await-stream", "[await]") {
+    
+    // chunks arriving with pauses in between are all delivered, in order,
+    // until end of file
+    
+    using namespace std::chrono;
+    
+    reactor select(reactor::backend::select);
+    reactor epoll(reactor::backend::epoll, milliseconds{1}, false);
+    reactor completions;
+    
+    for (reactor const* r : { &select, &epoll, &completions }) {
+        
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        
+        std::promise<std::string> received;
+        auto consumer = [&]() -> void {
+            async_read_stream s(*r, p[0]);
+            std::string t;
+            char buf[7];
+            ssize_t n;
+            while ((n = co_await s.next(buf, sizeof(buf))) > 0)
+                t.append(buf, n);
+            received.set_value(n ? "error" : t);
+        };
+        consumer();
+        
+        std::string s;
+        for (int i = 0; i != 100; ++i) {
+            std::string m = std::to_string(i) + ",";
+            REQUIRE(write(p[1], m.data(), m.size()) == (ssize_t) m.size());
+            s += m;
+            if (i % 10 == 0)
+                std::this_thread::sleep_for(milliseconds{1});
+        }
+        close(p[1]);
+        REQUIRE(received.get_future().get() == s);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("await-stream-reuse", "[await]") {
+    
+    // streams created and destroyed on the same descriptor numbers, faster
+    // than the reactor admits and purges their edges
+    
+    reactor r(reactor::backend::epoll, std::chrono::milliseconds{1}, false);
+    
+    int p[2];
+    for (int i = 0; i != 10'000; ++i) {
+        REQUIRE(pipe(p) == 0);
+        {
+            async_read_stream s(r, p[0]);
+        }
+        close(p[1]);
+        close(p[0]);
+    }
+    
+    // and the last descriptor still works
+    REQUIRE(pipe(p) == 0);
+    std::promise<ssize_t> received;
+    auto consumer = [&]() -> void {
+        async_read_stream s(r, p[0]);
+        char buf[4];
+        received.set_value(co_await s.next(buf, sizeof(buf)));
+    };
+    consumer();
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    REQUIRE(write(p[1], "abc", 3) == 3);
+    REQUIRE(received.get_future().get() == 3);
+    close(p[1]);
+    close(p[0]);
+    
+}
+
+TEST_CASE("await-stream-bench", "[await][.bench]") {
+    
+    // many chatty connections, each receiving a small message every round,
+    // so that each consumer must wait for every message; compare the CPU
+    // time per message of re-registering for each read with a persistent
+    // stream
+    
+    using namespace std::chrono;
+    
+    reactor r(reactor::backend::epoll, milliseconds{1}, false);
+    int connections = 64;
+    int rounds = 2'000;
+    
+    auto cpu = [] {
+        timespec t;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+        return t.tv_sec * 1e9 + t.tv_nsec;
+    };
+    
+    for (bool persistent : { false, true }) {
+        
+        std::vector<std::array<int, 2>> pipes(connections);
+        std::atomic<int> remaining{connections};
+        std::promise<void> done;
+        for (auto& p : pipes) {
+            REQUIRE(pipe(p.data()) == 0);
+            (void) fcntl(p[0], F_SETFL, O_NONBLOCK);
+        }
+        auto server = [&](int fd) -> void {
+            char buf[64];
+            if (persistent) {
+                async_read_stream s(r, fd);
+                while (co_await s.next(buf, sizeof(buf)) > 0)
+                    ;
+            } else {
+                while (co_await async_read(r, fd, buf, sizeof(buf)) > 0)
+                    ;
+            }
+            if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                done.set_value();
+        };
+        for (auto& p : pipes)
+            server(p[0]);
+        
+        auto wakeups = atomic_load(&r._wakeups, std::memory_order_relaxed);
+        auto t0 = cpu();
+        char buf[64] = {};
+        for (int i = 0; i != rounds; ++i) {
+            for (auto& p : pipes)
+                (void) !write(p[1], buf, sizeof(buf));
+            std::this_thread::sleep_for(microseconds{100});
+        }
+        for (auto& p : pipes)
+            close(p[1]);
+        done.get_future().get();
+        auto t1 = cpu();
+        double n = (double) connections * rounds;
+        printf("%s: %6.2f us CPU per message, %5.3f reactor wakeups per message\n",
+               persistent ? "stream     " : "async_read ",
+               (t1 - t0) / n / 1e3,
+               (atomic_load(&r._wakeups, std::memory_order_relaxed) - wakeups) / n);
+        for (auto& p : pipes)
+            close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("await-inline", "[await]") {
+    
+    // the coroutine resumes on the reactor thread, until it transfers
+    
+    reactor r(reactor::default_backend, std::chrono::milliseconds{1}, false);
+    int p[2];
+    REQUIRE(pipe(p) == 0);
+    
+    std::promise<std::pair<bool, bool>> where;
+    auto reader = [&]() -> void {
+        char c;
+        ssize_t n = co_await inline_completion(async_read(r, p[0], &c, 1));
+        assert(n == 1);
+        bool before = std::this_thread::get_id() == r._thread.get_id();
+        co_await transfer;
+        bool after = std::this_thread::get_id() == r._thread.get_id();
+        where.set_value({before, after});
+    };
+    reader();
+    char c{0};
+    REQUIRE(write(p[1], &c, 1) == 1);
+    auto [before, after] = where.get_future().get();
+    REQUIRE(before);
+    REQUIRE_FALSE(after);
+    close(p[1]);
+    close(p[0]);
+    
+}
+
+TEST_CASE("await-inline-bench", "[await][.bench]") {
+    
+    // ping-pong of 8-byte messages with a server coroutine that resumes on
+    // the pool, or inline on the reactor thread
+    
+    using namespace std::chrono;
+    
+    reactor r(reactor::backend::epoll, milliseconds{1}, false);
+    int n = 50'000;
+    
+    for (bool inlined : { false, true }) {
+        
+        int p[2], q[2];
+        REQUIRE(pipe(p) == 0);
+        REQUIRE(pipe(q) == 0);
+        (void) fcntl(p[0], F_SETFL, O_NONBLOCK);
+        
+        std::promise<void> done;
+        auto server = [&]() -> void {
+            char buf[8];
+            for (;;) {
+                ssize_t k = inlined
+                    ? co_await inline_completion(async_read(r, p[0], buf, sizeof(buf)))
+                    : co_await async_read(r, p[0], buf, sizeof(buf));
+                if (k <= 0)
+                    break;
+                (void) !write(q[1], buf, k);
+            }
+            done.set_value();
+        };
+        server();
+        
+        auto t0 = steady_clock::now();
+        char buf[8] = {};
+        for (int i = 0; i != n; ++i) {
+            (void) !write(p[1], buf, sizeof(buf));
+            (void) !read(q[0], buf, sizeof(buf));
+        }
+        auto t1 = steady_clock::now();
+        close(p[1]);
+        done.get_future().get();
+        printf("%s: %6.2f us per round trip\n",
+               inlined ? "inline" : "pool  ",
+               duration<double, std::micro>(t1 - t0).count() / n);
+        for (int fd : { p[0], q[0], q[1] })
+            close(fd);
+        
+    }
+    
+}
+
+TEST_CASE("await-file", "[await]") {
+    
+    FILE* f = tmpfile();
+    int fd = fileno(f);
+    
+    std::promise<std::string> done;
+    auto writer = [&]() -> void {
+        std::string s = "hello, world";
+        ssize_t n = co_await async_pwrite(fd, s.data(), s.size(), 100);
+        assert(n == (ssize_t) s.size());
+        int e = co_await async_fsync(fd, true);
+        assert(e == 0);
+        char buf[5];
+        n = co_await async_pread(fd, buf, sizeof(buf), 107);
+        done.set_value(std::string(buf, std::max<ssize_t>(n, 0)));
+    };
+    writer();
+    REQUIRE(done.get_future().get() == "world");
+    fclose(f);
+    
+    // errors are reported through errno
+    std::promise<int> bad;
+    auto bad_reader = [&]() -> void {
+        char c;
+        ssize_t n = co_await async_pread(-1, &c, 1, 0);
+        bad.set_value((n == -1) ? errno : 0);
+    };
+    bad_reader();
+    REQUIRE(bad.get_future().get() == EBADF);
+    
+}
+
+TEST_CASE("await-file-bench", "[await][.bench]") {
+    
+    // coroutines that append to a file and fsync it, alongside short CPU
+    // tasks whose queueing delay we measure; the file I/O runs either on
+    // the pool itself, or on the blocking-I/O threads
+    
+    using namespace std::chrono;
+    
+    char path[] = "aarc-bench-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    unlink(path);
+    
+    for (bool offloaded : { false, true }) {
+        
+        int writers = 4;
+        int writes = 100;
+        std::atomic<int> remaining{writers};
+        std::promise<void> written;
+        auto writer = [&](int i) -> void {
+            char buf[4096] = {};
+            for (int j = 0; j != writes; ++j) {
+                off_t offset = ((off_t) i * writes + j) * sizeof(buf);
+                if (offloaded) {
+                    co_await async_pwrite(fd, buf, sizeof(buf), offset);
+                    co_await async_fsync(fd, true);
+                } else {
+                    co_await transfer;
+                    (void) !pwrite(fd, buf, sizeof(buf), offset);
+                    (void) !fdatasync(fd);
+                }
+            }
+            if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                written.set_value();
+        };
+        for (int i = 0; i != writers; ++i)
+            writer(i);
+        
+        // a CPU task every 100us, recording how long each waited to start
+        std::vector<double> delays;
+        std::mutex m;
+        auto future = written.get_future();
+        while (future.wait_for(microseconds{100}) != std::future_status::ready) {
+            auto t = steady_clock::now();
+            pool_submit_one([&m, &delays, t] {
+                auto d = duration<double, std::micro>(steady_clock::now() - t).count();
+                std::unique_lock lock(m);
+                delays.push_back(d);
+            });
+        }
+        std::this_thread::sleep_for(milliseconds{100});
+        std::unique_lock lock(m);
+        std::sort(delays.begin(), delays.end());
+        auto q = [&](double p) { return delays[(std::size_t) (p * (delays.size() - 1))]; };
+        printf("%s: %zu CPU tasks waited p50 %8.1f us, p99 %8.1f us, max %8.1f us\n",
+               offloaded ? "offloaded" : "on pool  ",
+               delays.size(), q(0.5), q(0.99), q(1.0));
+        
+    }
+    
+    close(fd);
+    
+}
+
+TEST_CASE("await-buffer", "[await]") {
+    
+    // chunks arriving with pauses in between are all delivered, in order,
+    // in buffers recycled through the pool, until end of file
+    
+    using namespace std::chrono;
+    
+    reactor select(reactor::backend::select);
+    reactor epoll(reactor::backend::epoll, milliseconds{1}, false);
+    reactor completions;
+    
+    for (reactor const* r : { &select, &epoll, &completions }) {
+        
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        (void) fcntl(p[0], F_SETFL, O_NONBLOCK);
+        
+        buffer_pool pool(16, 256);
+        std::promise<std::string> received;
+        auto consumer = [&]() -> void {
+            std::string t;
+            while (buffer b = co_await async_read_buffer(*r, p[0], pool))
+                t.append(b.begin(), b.end());
+            received.set_value(errno ? "error" : t);
+        };
+        consumer();
+        
+        std::string s;
+        for (int i = 0; i != 100; ++i) {
+            std::string m = std::to_string(i) + ",";
+            REQUIRE(write(p[1], m.data(), m.size()) == (ssize_t) m.size());
+            s += m;
+            if (i % 10 == 0)
+                std::this_thread::sleep_for(milliseconds{1});
+        }
+        close(p[1]);
+        REQUIRE(received.get_future().get() == s);
+        REQUIRE(pool.capacity() == 16); // <-- one slab sufficed
+        close(p[0]);
+        
+    }
+    
+    // the reactor's own pool
+    int p[2];
+    REQUIRE(pipe(p) == 0);
+    std::promise<std::string> received;
+    auto consumer = [&]() -> void {
+        buffer b = co_await async_read_buffer(p[0]);
+        received.set_value(std::string(b.begin(), b.end()));
+    };
+    consumer();
+    REQUIRE(write(p[1], "hello", 5) == 5);
+    REQUIRE(received.get_future().get() == "hello");
+    close(p[1]);
+    close(p[0]);
+    
+}
+
+#if defined(__linux__)
+
+TEST_CASE("await-buffer-bench", "[await][.bench]") {
+    
+    // many mostly idle connections, each of which has received a message
+    // and now waits for the next; compare the resident memory of a buffer
+    // per connection with buffers taken from the pool only once data is
+    // readable
+    
+    using namespace std::chrono;
+    
+    reactor r(reactor::backend::epoll, milliseconds{1}, false);
+    int connections = 8'000; // <-- two descriptors each
+    std::size_t size = 16 << 10;
+    
+    auto resident = [] {
+        long pages = 0;
+        long rss = 0;
+        if (FILE* f = fopen("/proc/self/statm", "r")) {
+            (void) !fscanf(f, "%ld %ld", &pages, &rss);
+            fclose(f);
+        }
+        return (double) rss * sysconf(_SC_PAGESIZE);
+    };
+    
+    for (bool pooled : { true, false }) {
+        
+        buffer_pool pool(size);
+        std::vector<std::array<int, 2>> pipes(connections);
+        std::atomic<int> received{0};
+        std::atomic<int> remaining{connections};
+        std::promise<void> done;
+        for (auto& p : pipes) {
+            REQUIRE(pipe(p.data()) == 0);
+            (void) fcntl(p[0], F_SETFL, O_NONBLOCK);
+        }
+        auto server = [&](int fd) -> void {
+            if (pooled) {
+                while (buffer b = co_await async_read_buffer(r, fd, pool))
+                    received.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                std::vector<char> buf(size);
+                while (co_await async_read(r, fd, buf.data(), buf.size()) > 0)
+                    received.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                done.set_value();
+        };
+        
+        auto before = resident();
+        for (auto& p : pipes)
+            server(p[0]);
+        
+        // every connection receives a message that fills its buffer, a
+        // hundred at a time, and then falls idle
+        std::vector<char> message(size, 'x');
+        for (int i = 0; i != connections; ++i) {
+            (void) !write(pipes[i][1], message.data(), message.size());
+            if (i % 100 == 99)
+                while (received.load(std::memory_order_relaxed) < i + 1)
+                    std::this_thread::sleep_for(microseconds{100});
+        }
+        while (received.load(std::memory_order_relaxed) < connections)
+            std::this_thread::sleep_for(microseconds{100});
+        auto after = resident();
+        
+        printf("%s: %d idle connections, %7.1f MB resident, %6.1f KB per connection",
+               pooled ? "pooled    " : "per-reader",
+               connections,
+               (after - before) / 1e6,
+               (after - before) / 1e3 / connections);
+        if (pooled)
+            printf(", %zu buffers in pool", pool.capacity());
+        printf("\n");
+        
+        for (auto& p : pipes)
+            close(p[1]);
+        done.get_future().get();
+        for (auto& p : pipes)
+            close(p[0]);
+        
+    }
+    
+}
+
+#endif
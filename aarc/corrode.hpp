@@ -9,8 +9,19 @@
 #ifndef corrode_hpp
 #define corrode_hpp
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include <cerrno>
 #include <experimental/coroutine>
 
+#include "buffer.hpp"
 #include "maybe.hpp"
 #include "reactor.hpp"
 #include "pool.hpp"
@@ -76,7 +87,7 @@ struct await_duration {
     bool await_ready() { return false; }
     template<typename T>
     void await_suspend(std::experimental::coroutine_handle<T> h) {
-        reactor::get().after(std::move(_t), h);
+        reactor::get()._when(std::chrono::steady_clock::now() + _t, h);
     }
     void await_resume() {}
 };
@@ -93,7 +104,7 @@ struct await_time_point {
     bool await_ready() { return false; }
     template<typename T>
     void await_suspend(std::experimental::coroutine_handle<T> h) {
-        reactor::get().when(std::move(_t), h);
+        reactor::get()._when(std::move(_t), h);
     }
     void await_resume() {}
 };
@@ -101,43 +112,70 @@ struct await_time_point {
 
 
 
+// true if a descriptor is ready now, without blocking.  poll, unlike
+// select, is not limited to descriptors below FD_SETSIZE
+inline bool ready_now(int fd, bool writeable) {
+    pollfd p{fd, (short) (writeable ? POLLOUT : POLLIN), 0};
+    return poll(&p, 1, 0) == 1;
+}
+
+
+
 struct async_read {
     
+    static constexpr bool _writeable = false; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
     int _fd;
     void* _buf;
     size_t _count;
     ssize_t _return_value;
+    int _errno;
     
     async_read(int fd, void* buf, size_t count)
-    : _fd(fd)
+    : async_read(reactor::get(fd), fd, buf, count) {
+    }
+    
+    async_read(reactor const& r, int fd, void* buf, size_t count)
+    : _reactor(&r)
+    , _fd(fd)
     , _buf(buf)
     , _count(count)
-    , _return_value(-1) {
+    , _return_value(-1)
+    , _errno(0) {
     }
 
-    void _execute() {
+    // true unless the operation would block
+    bool _execute() {
         _return_value = read(_fd, _buf, _count);
-        assert(_return_value > 0);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
     }
 
     bool await_ready() {
         //return false;
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(_fd, &fds);
-        timeval t{0, 0};
-        return ((select(_fd + 1, &fds, nullptr, nullptr, &t) == 1)
-                && ((void) _execute(), true));
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return ready_now(_fd, false) && _execute();
     }
     
     void await_suspend(std::experimental::coroutine_handle<> handle) {
-        reactor::get().when_readable(_fd, [=]() mutable {
-            _execute();
-            handle();
+        if (_reactor->has_completions())
+            return _reactor->submit_read(_fd, _buf, _count, &_return_value, handle);
+        _reactor->when_readable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
         });
     }
     
     ssize_t await_resume() {
+        if ((_return_value < 0) && _reactor->has_completions()) {
+            errno = (int) -_return_value; // <-- the engine reports -errno
+            return -1;
+        }
+        if (_return_value == -1)
+            errno = _errno;
         return _return_value;
     }
     
@@ -147,45 +185,1246 @@ struct async_read {
 
 struct async_write {
     
+    static constexpr bool _writeable = true; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
     int _fd;
     void const* _buf;
     size_t _count;
     ssize_t _return_value;
+    int _errno;
     
     async_write(int fd, void const* buf, size_t count)
-    : _fd(fd)
+    : async_write(reactor::get(fd), fd, buf, count) {
+    }
+    
+    async_write(reactor const& r, int fd, void const* buf, size_t count)
+    : _reactor(&r)
+    , _fd(fd)
     , _buf(buf)
-    , _count(count) {
+    , _count(count)
+    , _return_value(-1)
+    , _errno(0) {
     }
 
-    void _execute() {
+    // true unless the operation would block
+    bool _execute() {
         _return_value = write(_fd, _buf, _count);
-        assert(_return_value > 0);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
     }
 
     bool await_ready() {
         //return false;
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(_fd, &fds);
-        timeval t{0, 0};
-        return ((select(_fd + 1, nullptr, &fds, nullptr, &t) == 1)
-                && ((void) _execute(), true));
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return ready_now(_fd, true) && _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        if (_reactor->has_completions())
+            return _reactor->submit_write(_fd, _buf, _count, &_return_value, handle);
+        _reactor->when_writeable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
+        });
+    }
+    
+    ssize_t await_resume() {
+        if ((_return_value < 0) && _reactor->has_completions()) {
+            errno = (int) -_return_value; // <-- the engine reports -errno
+            return -1;
+        }
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+
+
+
+// scatter/gather awaitables
+//
+// the iovec array must outlive the operation; as for read and write, a
+// short transfer is not an error
+
+struct async_readv {
+    
+    static constexpr bool _writeable = false; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    iovec const* _iov;
+    int _iovcnt;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_readv(int fd, iovec const* iov, int iovcnt)
+    : async_readv(reactor::get(fd), fd, iov, iovcnt) {
+    }
+    
+    async_readv(reactor const& r, int fd, iovec const* iov, int iovcnt)
+    : _reactor(&r)
+    , _fd(fd)
+    , _iov(iov)
+    , _iovcnt(iovcnt)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = readv(_fd, _iov, _iovcnt);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return ready_now(_fd, false) && _execute();
     }
     
     void await_suspend(std::experimental::coroutine_handle<> handle) {
-        reactor::get().when_writeable(_fd, [=]() mutable {
+        if (_reactor->has_completions())
+            return _reactor->submit_readv(_fd, _iov, _iovcnt, &_return_value, handle);
+        _reactor->when_readable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_writev {
+    
+    static constexpr bool _writeable = true; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    iovec const* _iov;
+    int _iovcnt;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_writev(int fd, iovec const* iov, int iovcnt)
+    : async_writev(reactor::get(fd), fd, iov, iovcnt) {
+    }
+    
+    async_writev(reactor const& r, int fd, iovec const* iov, int iovcnt)
+    : _reactor(&r)
+    , _fd(fd)
+    , _iov(iov)
+    , _iovcnt(iovcnt)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = writev(_fd, _iov, _iovcnt);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return ready_now(_fd, true) && _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        if (_reactor->has_completions())
+            return _reactor->submit_writev(_fd, _iov, _iovcnt, &_return_value, handle);
+        _reactor->when_writeable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+
+// exact-length awaitables
+//
+// these transfer the whole buffer, re-arming with the reactor (or
+// resubmitting to the completion engine) after each short transfer, and
+// resume only when it is done, at end of file, or on error.  they return
+// the number of bytes transferred, which is short only at end of file, or
+// -1 with errno set (in which case _done says how far they got).  the
+// descriptor should be non-blocking, or a large transfer may block a pool
+// thread
+
+struct async_read_exact {
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    char* _buf;
+    size_t _count;
+    size_t _done;
+    ssize_t _return_value; // <-- of the latest read
+    int _errno;
+    
+    async_read_exact(int fd, void* buf, size_t count)
+    : async_read_exact(reactor::get(fd), fd, buf, count) {
+    }
+    
+    async_read_exact(reactor const& r, int fd, void* buf, size_t count)
+    : _reactor(&r)
+    , _fd(fd)
+    , _buf((char*) buf)
+    , _count(count)
+    , _done(0)
+    , _return_value(0)
+    , _errno(0) {
+    }
+    
+    // account for the latest read, and return true if we are finished
+    bool _advance() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value > 0)
+            _done += _return_value;
+        return (_done == _count) || (_return_value == 0) || ((_return_value == -1) && (_errno != EAGAIN) && (_errno != EINTR));
+    }
+    
+    void _execute() {
+        _return_value = read(_fd, _buf + _done, _count - _done);
+        _errno = errno;
+    }
+    
+    bool await_ready() {
+        if (_count == 0)
+            return true;
+        if (_reactor->has_completions())
+            return false;
+        return ready_now(_fd, false) && ((void) _execute(), _advance());
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        auto k = [=]() mutable {
+            if (!_reactor->has_completions())
+                _execute();
+            if (_advance())
+                return handle();
+            await_suspend(handle);
+        };
+        if (_reactor->has_completions())
+            return _reactor->submit_read(_fd, _buf + _done, _count - _done, &_return_value, k);
+        _reactor->when_readable(_fd, k);
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1) {
+            errno = _errno;
+            return -1;
+        }
+        return _done;
+    }
+    
+};
+
+struct async_write_all {
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    char const* _buf;
+    size_t _count;
+    size_t _done;
+    ssize_t _return_value; // <-- of the latest write
+    int _errno;
+    
+    async_write_all(int fd, void const* buf, size_t count)
+    : async_write_all(reactor::get(fd), fd, buf, count) {
+    }
+    
+    async_write_all(reactor const& r, int fd, void const* buf, size_t count)
+    : _reactor(&r)
+    , _fd(fd)
+    , _buf((char const*) buf)
+    , _count(count)
+    , _done(0)
+    , _return_value(0)
+    , _errno(0) {
+    }
+    
+    // account for the latest write, and return true if we are finished
+    bool _advance() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value > 0)
+            _done += _return_value;
+        return (_done == _count) || ((_return_value == -1) && (_errno != EAGAIN) && (_errno != EINTR));
+    }
+    
+    void _execute() {
+        _return_value = write(_fd, _buf + _done, _count - _done);
+        _errno = errno;
+    }
+    
+    bool await_ready() {
+        if (_count == 0)
+            return true;
+        if (_reactor->has_completions())
+            return false;
+        return ready_now(_fd, true) && ((void) _execute(), _advance());
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        auto k = [=]() mutable {
+            if (!_reactor->has_completions())
+                _execute();
+            if (_advance())
+                return handle();
+            await_suspend(handle);
+        };
+        if (_reactor->has_completions())
+            return _reactor->submit_write(_fd, _buf + _done, _count - _done, &_return_value, k);
+        _reactor->when_writeable(_fd, k);
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1) {
+            errno = _errno;
+            return -1;
+        }
+        return _done;
+    }
+    
+};
+
+
+// socket awaitables
+//
+// these first attempt the operation without blocking, and only if it would
+// block wait for readiness on the shard that owns the socket and try again
+// (readiness may be spurious, so they may wait more than once).  on failure
+// they return -1 with errno set, as the corresponding syscall would.  where
+// the completion engine is available, receives and sends are submitted to
+// it directly instead
+
+struct async_accept {
+
+#if defined(__linux__)
+    static constexpr int NONBLOCK = SOCK_NONBLOCK;
+    static constexpr int CLOEXEC = SOCK_CLOEXEC;
+#else
+    static constexpr int NONBLOCK = 1; // <-- emulated with fcntl
+    static constexpr int CLOEXEC = 2;
+#endif
+    
+    static constexpr bool _writeable = false; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    sockaddr* _addr;
+    socklen_t* _addrlen;
+    int _flags;
+    int _return_value;
+    int _errno;
+    
+    explicit async_accept(int fd,
+                          sockaddr* addr = nullptr,
+                          socklen_t* addrlen = nullptr,
+                          int flags = NONBLOCK | CLOEXEC)
+    : async_accept(reactor::get(fd), fd, addr, addrlen, flags) {
+    }
+    
+    async_accept(reactor const& r,
+                 int fd,
+                 sockaddr* addr = nullptr,
+                 socklen_t* addrlen = nullptr,
+                 int flags = NONBLOCK | CLOEXEC)
+    : _reactor(&r)
+    , _fd(fd)
+    , _addr(addr)
+    , _addrlen(addrlen)
+    , _flags(flags)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+#if defined(__linux__)
+        _return_value = accept4(_fd, _addr, _addrlen, _flags);
+#else
+        _return_value = accept(_fd, _addr, _addrlen);
+        if ((_return_value != -1) && (_flags & NONBLOCK))
+            (void) fcntl(_return_value, F_SETFL, fcntl(_return_value, F_GETFL) | O_NONBLOCK);
+        if ((_return_value != -1) && (_flags & CLOEXEC))
+            (void) fcntl(_return_value, F_SETFD, FD_CLOEXEC);
+#endif
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        _reactor->when_readable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        });
+    }
+    
+    int await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_connect {
+    
+    static constexpr bool _writeable = true; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    sockaddr const* _addr;
+    socklen_t _addrlen;
+    int _return_value;
+    int _errno;
+    
+    async_connect(int fd, sockaddr const* addr, socklen_t addrlen)
+    : async_connect(reactor::get(fd), fd, addr, addrlen) {
+    }
+    
+    async_connect(reactor const& r, int fd, sockaddr const* addr, socklen_t addrlen)
+    : _reactor(&r)
+    , _fd(fd)
+    , _addr(addr)
+    , _addrlen(addrlen)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // a non-blocking connect that cannot complete at once reports
+    // EINPROGRESS (or, if interrupted, EINTR) and carries on; the socket
+    // becomes writeable when it finishes, and SO_ERROR reports how
+    bool await_ready() {
+        _return_value = connect(_fd, _addr, _addrlen);
+        _errno = errno;
+        return (_return_value == 0) || ((_errno != EINPROGRESS) && (_errno != EINTR));
+    }
+    
+    // once the socket is writeable the connection has finished, one way
+    // or another
+    bool _execute() {
+        socklen_t n = sizeof(_errno);
+        if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &_errno, &n) == -1)
+            _errno = errno;
+        _return_value = _errno ? -1 : 0;
+        return true;
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        _reactor->when_writeable(_fd, [=]() mutable {
             _execute();
             handle();
         });
     }
     
+    int await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_recv {
+    
+    static constexpr bool _writeable = false; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    void* _buf;
+    size_t _count;
+    int _flags;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_recv(int fd, void* buf, size_t count, int flags = 0)
+    : async_recv(reactor::get(fd), fd, buf, count, flags) {
+    }
+    
+    async_recv(reactor const& r, int fd, void* buf, size_t count, int flags = 0)
+    : _reactor(&r)
+    , _fd(fd)
+    , _buf(buf)
+    , _count(count)
+    , _flags(flags)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = recv(_fd, _buf, _count, _flags | MSG_DONTWAIT);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        if (_reactor->has_completions())
+            return _reactor->submit_recv(_fd, _buf, _count, _flags, &_return_value, handle);
+        _reactor->when_readable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_send {
+    
+    static constexpr bool _writeable = true; // <-- the readiness we wait for
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    void const* _buf;
+    size_t _count;
+    int _flags;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_send(int fd, void const* buf, size_t count, int flags = 0)
+    : async_send(reactor::get(fd), fd, buf, count, flags) {
+    }
+    
+    async_send(reactor const& r, int fd, void const* buf, size_t count, int flags = 0)
+    : _reactor(&r)
+    , _fd(fd)
+    , _buf(buf)
+    , _count(count)
+    , _flags(flags)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = send(_fd, _buf, _count, _flags | MSG_DONTWAIT);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        if (_reactor->has_completions())
+            return false; // <-- submit without probing
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        if (_reactor->has_completions())
+            return _reactor->submit_send(_fd, _buf, _count, _flags, &_return_value, handle);
+        _reactor->when_writeable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_reactor->has_completions() && (_return_value < 0))
+            _errno = (int) -_return_value, _return_value = -1; // <-- the engine reports -errno
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+#if defined(__linux__)
+
+// zero-copy awaitables
+//
+// the kernel moves the data between descriptors without copying it through
+// user space.  like the socket awaitables these first try without blocking
+// and otherwise wait for the descriptor that is holding them up, on the
+// shard that owns it; each resumes with the bytes transferred (zero at end
+// of file), or -1 with errno set
+//
+// sendfile copies from a file to a socket; splice moves between a pipe and
+// any descriptor; tee duplicates the contents of one pipe into another
+// without consuming them
+
+struct async_sendfile {
+    
+    reactor const* _reactor; // <-- the shard that owns _out
+    int _out;
+    int _in;
+    off_t* _offset;
+    size_t _count;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_sendfile(int out, int in, off_t* offset, size_t count)
+    : async_sendfile(reactor::get(out), out, in, offset, count) {
+    }
+    
+    async_sendfile(reactor const& r, int out, int in, off_t* offset, size_t count)
+    : _reactor(&r)
+    , _out(out)
+    , _in(in)
+    , _offset(offset)
+    , _count(count)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = sendfile(_out, _in, _offset, _count);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        // the file is always ready, so only the socket can hold us up
+        _reactor->when_writeable(_out, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_splice {
+    
+    reactor const* _reactor_in; // <-- the shards that own _in and _out
+    reactor const* _reactor_out;
+    int _in;
+    loff_t* _off_in;
+    int _out;
+    loff_t* _off_out;
+    size_t _count;
+    unsigned _flags;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_splice(int in, int out, size_t count, unsigned flags = SPLICE_F_MOVE)
+    : async_splice(in, nullptr, out, nullptr, count, flags) {
+    }
+    
+    async_splice(int in, loff_t* off_in, int out, loff_t* off_out, size_t count, unsigned flags = SPLICE_F_MOVE)
+    : _reactor_in(&reactor::get(in))
+    , _reactor_out(&reactor::get(out))
+    , _in(in)
+    , _off_in(off_in)
+    , _out(out)
+    , _off_out(off_out)
+    , _count(count)
+    , _flags(flags | SPLICE_F_NONBLOCK)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    async_splice(reactor const& r, int in, int out, size_t count, unsigned flags = SPLICE_F_MOVE)
+    : async_splice(in, out, count, flags) {
+        _reactor_in = _reactor_out = &r;
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = splice(_in, _off_in, _out, _off_out, _count, _flags);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        // wait for whichever end is holding us up
+        auto k = [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        };
+        if (!ready_now(_out, true))
+            _reactor_out->when_writeable(_out, k);
+        else
+            _reactor_in->when_readable(_in, k);
+    }
+    
     ssize_t await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
         return _return_value;
     }
     
 };
 
+struct async_tee {
+    
+    reactor const* _reactor_in; // <-- the shards that own _in and _out
+    reactor const* _reactor_out;
+    int _in;
+    int _out;
+    size_t _count;
+    unsigned _flags;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_tee(int in, int out, size_t count, unsigned flags = 0)
+    : _reactor_in(&reactor::get(in))
+    , _reactor_out(&reactor::get(out))
+    , _in(in)
+    , _out(out)
+    , _count(count)
+    , _flags(flags | SPLICE_F_NONBLOCK)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    async_tee(reactor const& r, int in, int out, size_t count, unsigned flags = 0)
+    : async_tee(in, out, count, flags) {
+        _reactor_in = _reactor_out = &r;
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        _return_value = tee(_in, _out, _count, _flags);
+        _errno = errno;
+        return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        return _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        auto k = [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle);
+        };
+        if (!ready_now(_out, true))
+            _reactor_out->when_writeable(_out, k);
+        else
+            _reactor_in->when_readable(_in, k);
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+#endif
+
+// blocking file I/O
+//
+// select and epoll report regular files as always ready, so async_read on
+// a file just blocks whichever pool thread resumes.  these instead make the
+// syscall on the blocking-I/O threads (see offload_submit) and then resume
+// the coroutine on the pool, so disk latency never occupies a CPU worker.
+// each returns what the syscall returned, with errno set on failure
+
+struct async_pread {
+    
+    int _fd;
+    void* _buf;
+    size_t _count;
+    off_t _offset;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_pread(int fd, void* buf, size_t count, off_t offset)
+    : _fd(fd)
+    , _buf(buf)
+    , _count(count)
+    , _offset(offset)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        offload_submit([=]() mutable {
+            _return_value = pread(_fd, _buf, _count, _offset);
+            _errno = errno;
+            pool_submit_one(handle);
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_pwrite {
+    
+    int _fd;
+    void const* _buf;
+    size_t _count;
+    off_t _offset;
+    ssize_t _return_value;
+    int _errno;
+    
+    async_pwrite(int fd, void const* buf, size_t count, off_t offset)
+    : _fd(fd)
+    , _buf(buf)
+    , _count(count)
+    , _offset(offset)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        offload_submit([=]() mutable {
+            _return_value = pwrite(_fd, _buf, _count, _offset);
+            _errno = errno;
+            pool_submit_one(handle);
+        });
+    }
+    
+    ssize_t await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+struct async_fsync {
+    
+    int _fd;
+    bool _data_only; // <-- fdatasync, where available
+    int _return_value;
+    int _errno;
+    
+    explicit async_fsync(int fd, bool data_only = false)
+    : _fd(fd)
+    , _data_only(data_only)
+    , _return_value(-1)
+    , _errno(0) {
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        offload_submit([=]() mutable {
+#if defined(__linux__)
+            _return_value = _data_only ? fdatasync(_fd) : fsync(_fd);
+#else
+            _return_value = fsync(_fd);
+#endif
+            _errno = errno;
+            pool_submit_one(handle);
+        });
+    }
+    
+    int await_resume() {
+        if (_return_value == -1)
+            errno = _errno;
+        return _return_value;
+    }
+    
+};
+
+// persistent read streams
+//
+//     async_read_stream s(fd);
+//     while ((n = co_await s.next(buf, count)) > 0)
+//         ...
+//
+// yields each readable chunk until end of file (zero) or error (-1 with
+// errno set).  the descriptor is made non-blocking and stays registered
+// with its shard for the lifetime of the stream, edge-triggered where the
+// backend supports it, so a chatty connection does not re-register after
+// every read; chunks already buffered by the kernel are returned without
+// suspending.  elsewhere each wait falls back to when_readable
+//
+// at most one next() may be outstanding, and the stream must outlive it.
+// other waiters on the same descriptor must tolerate it being
+// edge-triggered (the reactor re-arms it as they arrive)
+
+struct async_read_stream {
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    detail::edge_node* _edge; // <-- or nullptr
+    
+    explicit async_read_stream(int fd)
+    : async_read_stream(reactor::get(fd), fd) {
+    }
+    
+    async_read_stream(reactor const& r, int fd)
+    : _reactor(&r)
+    , _fd(fd)
+    , _edge(nullptr) {
+        (void) fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+        if (r.has_edges())
+            _edge = r.when_readable_edges(_fd);
+    }
+    
+    async_read_stream(async_read_stream const&) = delete;
+    async_read_stream& operator=(async_read_stream const&) = delete;
+    
+    ~async_read_stream() {
+        if (_edge) {
+            _edge->cancel();
+            _reactor->purge(_fd);
+            _edge->release(1);
+        }
+    }
+    
+    struct awaitable {
+        
+        async_read_stream* _stream;
+        void* _buf;
+        size_t _count;
+        ssize_t _return_value;
+        int _errno;
+        
+        // true unless the operation would block
+        bool _execute() {
+            _return_value = read(_stream->_fd, _buf, _count);
+            _errno = errno;
+            return (_return_value != -1) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+        }
+        
+        bool await_ready() {
+            if (_stream->_edge)
+                _stream->_edge->reset(); // <-- before we read
+            return _execute();
+        }
+        
+        // false if data arrived before we could park
+        bool await_suspend(std::experimental::coroutine_handle<> handle) {
+            auto e = _stream->_edge;
+            fn<void()> f{[=]() mutable {
+                if (e)
+                    e->reset();
+                if (_execute() || !await_suspend(handle))
+                    handle();
+            }};
+            if (!e) {
+                _stream->_reactor->when_readable(_stream->_fd, std::move(f));
+                return true;
+            }
+            while (!e->park(f)) {
+                e->reset();
+                if (_execute())
+                    return false;
+            }
+            return true;
+        }
+        
+        ssize_t await_resume() {
+            if (_return_value == -1)
+                errno = _errno;
+            return _return_value;
+        }
+        
+    };
+    
+    awaitable next(void* buf, size_t count) {
+        return awaitable{this, buf, count, -1, 0};
+    }
+    
+};
+
+// pooled reads
+//
+//     buffer b = co_await async_read_buffer(fd);
+//
+// wait for readiness without a buffer, then take one from the reactor's
+// pool (or the given pool) and read into it.  resumes with the data, or an
+// empty buffer at end of file (errno 0) or on error (errno set).  the
+// buffer is returned to the pool when the last handle to it is destroyed
+//
+// the buffer cannot be handed over before the data is readable, so this
+// always waits for readiness, even where the completion engine is available
+
+struct async_read_buffer {
+    
+    reactor const* _reactor; // <-- the shard that owns _fd
+    int _fd;
+    buffer_pool* _pool;
+    buffer _buffer;
+    int _errno;
+    
+    explicit async_read_buffer(int fd)
+    : async_read_buffer(reactor::get(fd), fd) {
+    }
+    
+    async_read_buffer(reactor const& r, int fd)
+    : async_read_buffer(r, fd, r.buffers()) {
+    }
+    
+    async_read_buffer(reactor const& r, int fd, buffer_pool& pool)
+    : _reactor(&r)
+    , _fd(fd)
+    , _pool(&pool)
+    , _errno(0) {
+    }
+    
+    // true unless the operation would block
+    bool _execute() {
+        buffer b = _pool->acquire();
+        ssize_t n = read(_fd, b.data(), b.capacity());
+        _errno = (n == -1) ? errno : 0;
+        if (n > 0) {
+            b.resize(n);
+            _buffer = std::move(b);
+            return true;
+        }
+        // <-- b goes straight back to the pool
+        return (n == 0) || ((_errno != EAGAIN) && (_errno != EWOULDBLOCK));
+    }
+    
+    bool await_ready() {
+        return ready_now(_fd, false) && _execute();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        _reactor->when_readable(_fd, [=]() mutable {
+            if (_execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
+        });
+    }
+    
+    buffer await_resume() {
+        errno = _errno;
+        return std::move(_buffer);
+    }
+    
+};
+
+// deadlines
+//
+//     ssize_t n= co_await with_timeout(async_recv(fd, buf, count), 100ms);
+//
+// race an awaitable's wait for readiness against a timer on the same shard,
+// and resume with -1 and errno ETIMEDOUT if the timer wins.  the loser is
+// cancelled, which destroys its task at once; a cancelled timer is dropped
+// when the wheel reaches it, and a cancelled waiter is purged from its
+// queue straight away, so a stalled peer leaves nothing behind
+//
+// if both fire at once, neither can cancel the other.  they then race to
+// claim _race, the winner performs the operation (or times out), and the
+// coroutine is resumed by whichever of them touches the frame last
+//
+// this supports the single-shot awaitables that wait for readiness on one
+// descriptor (read, write, recv, send, accept and connect).  it always
+// waits for readiness, even where the completion engine is available,
+// because operations in flight in the engine cannot yet be cancelled
+
+template<typename Awaitable>
+struct deadline_awaitable {
+    
+    Awaitable _inner;
+    std::chrono::steady_clock::time_point _deadline;
+    timer _waiter;
+    timer _timer;
+    u64 _race;
+    bool _done;
+    bool _timed_out;
+    
+    deadline_awaitable(Awaitable inner, std::chrono::steady_clock::time_point deadline)
+    : _inner(std::move(inner))
+    , _deadline(deadline)
+    , _race(0)
+    , _done(false)
+    , _timed_out(false) {
+    }
+    
+    bool await_ready() {
+        if (_inner.await_ready())
+            return _done = true;
+        return _timed_out = (std::chrono::steady_clock::now() >= _deadline);
+    }
+    
+    void _finish(std::experimental::coroutine_handle<> handle) {
+        if (_done || _timed_out)
+            return handle();
+        await_suspend(handle); // <-- spurious readiness
+    }
+    
+    // called by each side once its node has fired
+    void _settle(timer& other, bool expired, std::experimental::coroutine_handle<> handle) {
+        bool contended = !other.cancel();
+        if (!contended) {
+            if (expired)
+                _inner._reactor->purge(_inner._fd);
+        } else {
+            u64 expected = 0;
+            if (!atomic_compare_exchange_strong(&_race,
+                                                &expected,
+                                                (u64) 1,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+                // the other side is deciding; the last to arrive resumes
+                if (atomic_fetch_add(&_race, (u64) 1, std::memory_order_acq_rel) == 2)
+                    _finish(handle);
+                return;
+            }
+        }
+        _timed_out = expired;
+        _done = !expired && _inner._execute();
+        if (contended && (atomic_fetch_add(&_race, (u64) 1, std::memory_order_acq_rel) != 2))
+            return;
+        _finish(handle);
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        _race = 0;
+        _waiter = timer{[this, handle] { _settle(_timer, false, handle); }};
+        _timer = timer{[this, handle] { _settle(_waiter, true, handle); }};
+        // once either task is scheduled the coroutine may be resumed and
+        // destroyed, so we must not touch the frame again
+        reactor const& r = *_inner._reactor;
+        int fd = _inner._fd;
+        auto deadline = _deadline;
+        auto w = _waiter._schedule();
+        auto t = _timer._schedule();
+        r._when(deadline, std::move(t));
+        if (Awaitable::_writeable)
+            r.when_writeable(fd, std::move(w));
+        else
+            r.when_readable(fd, std::move(w));
+    }
+    
+    auto await_resume() -> decltype(_inner._return_value) {
+        if (_timed_out) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (_inner._return_value == -1)
+            errno = _inner._errno;
+        return _inner._return_value;
+    }
+    
+};
+
+template<typename Awaitable>
+deadline_awaitable<Awaitable> with_deadline(Awaitable a, std::chrono::steady_clock::time_point t) {
+    return deadline_awaitable<Awaitable>(std::move(a), t);
+}
+
+template<typename Awaitable, typename Rep, typename Period>
+deadline_awaitable<Awaitable> with_timeout(Awaitable a, std::chrono::duration<Rep, Period> d) {
+    return deadline_awaitable<Awaitable>(std::move(a), std::chrono::steady_clock::now() + d);
+}
+
+// inline completions
+//
+//     ssize_t n = co_await inline_completion(async_recv(fd, buf, 8));
+//
+// wait for readiness with an inline registration, so the operation and the
+// coroutine run on the reactor thread, until the coroutine next suspends,
+// without a handoff to the pool.  the continuation must be short and must
+// not block; co_await transfer before doing anything more.  supports the
+// same awaitables as deadlines, and likewise always waits for readiness
+
+template<typename Awaitable>
+struct inline_awaitable {
+    
+    Awaitable _inner;
+    
+    explicit inline_awaitable(Awaitable inner)
+    : _inner(std::move(inner)) {
+    }
+    
+    bool await_ready() {
+        return _inner.await_ready();
+    }
+    
+    void await_suspend(std::experimental::coroutine_handle<> handle) {
+        fn<void()> f{[=]() mutable {
+            if (_inner._execute())
+                return handle();
+            await_suspend(handle); // <-- spurious readiness
+        }};
+        if (Awaitable::_writeable)
+            _inner._reactor->when_writeable_inline(_inner._fd, std::move(f));
+        else
+            _inner._reactor->when_readable_inline(_inner._fd, std::move(f));
+    }
+    
+    auto await_resume() -> decltype(_inner._return_value) {
+        if (_inner._return_value == -1)
+            errno = _inner._errno;
+        return _inner._return_value;
+    }
+    
+};
+
+template<typename Awaitable>
+inline_awaitable<Awaitable> inline_completion(Awaitable a) {
+    return inline_awaitable<Awaitable>(std::move(a));
+}
 
 template<typename T = void>
 struct future {
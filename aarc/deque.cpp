@@ -0,0 +1,68 @@
+//
+//  deque.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "deque.hpp"
+
+#include <catch2/catch.hpp>
+
+TEST_CASE("deque", "[deque]") {
+    
+    // the owner pops youngest first, thieves steal oldest first
+    deque<fn<void()>> d(4);
+    std::vector<int> order;
+    for (int i = 0; i != 10; ++i) // <-- grows twice
+        d.push([&order, i] { order.push_back(i); });
+    REQUIRE(!d.empty());
+    d.steal()();
+    d.steal()();
+    d.pop()();
+    d.pop()();
+    REQUIRE(order == std::vector<int>{0, 1, 9, 8});
+    while (auto f = d.pop())
+        f();
+    REQUIRE(order.size() == 10);
+    REQUIRE(d.empty());
+    REQUIRE(!d.pop());
+    REQUIRE(!d.steal());
+    
+}
+
+TEST_CASE("deque-multi", "[deque]") {
+    
+    // the owner pushes and pops while thieves steal; every task runs
+    // exactly once
+    deque<fn<void()>> d(16);
+    int n = 200'000;
+    std::vector<u64> runs(n);
+    std::atomic<bool> done{false};
+    std::vector<std::thread> thieves;
+    for (int i = 0; i != 3; ++i) {
+        thieves.emplace_back([&] {
+            while (!done.load(std::memory_order_acquire))
+                if (auto f = d.steal())
+                    f();
+        });
+    }
+    for (int i = 0; i != n; ++i) {
+        d.push([&runs, i] { atomic_fetch_add(&runs[i], (u64) 1, std::memory_order_relaxed); });
+        if (i % 3 == 0)
+            if (auto f = d.pop())
+                f();
+    }
+    while (auto f = d.pop())
+        f();
+    done.store(true, std::memory_order_release);
+    for (auto& t : thieves)
+        t.join();
+    REQUIRE(std::count(runs.begin(), runs.end(), 1) == n);
+    
+}
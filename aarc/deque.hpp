@@ -0,0 +1,155 @@
+//
+//  deque.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef deque_hpp
+#define deque_hpp
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "atomic.hpp"
+#include "common.hpp"
+#include "fn.hpp"
+
+using rust::i64;
+using namespace aarc;
+
+// work-stealing deque
+//
+// the Chase-Lev deque, with the memory orders of Lê, Pop, Cohen and Zappa
+// Nardelli (2013).  one thread owns the deque and pushes and pops at the
+// bottom, LIFO, so that it works depth-first on the tasks it spawned while
+// they are still hot in its cache; any thread may steal from the top, FIFO,
+// taking the oldest and typically largest piece of work
+//
+// the owner and a thief only contend for the last item.  the circular array
+// grows when full; old arrays may still be read by thieves, so they are
+// retired rather than freed until the deque is destroyed
+//
+// holds fn nodes, whose ownership passes in and out with push, pop and
+// steal
+
+template<typename>
+struct deque;
+
+template<typename R, typename... Args>
+struct deque<fn<R(Args...)>> {
+    
+    using node = detail::node<R(Args...)>;
+    
+    struct array {
+        
+        i64 _mask;
+        std::unique_ptr<node*[]> _slots;
+        
+        explicit array(i64 n)
+        : _mask(n - 1)
+        , _slots(new node*[n]) {
+            assert(n && !(n & (n - 1)));
+        }
+        
+        node* load(i64 i) const {
+            return atomic_load(&_slots[i & _mask], std::memory_order_relaxed);
+        }
+        
+        void store(i64 i, node* p) const {
+            atomic_store(&_slots[i & _mask], p, std::memory_order_relaxed);
+        }
+        
+    };
+    
+    alignas(64) mutable i64 _top;
+    alignas(64) mutable i64 _bottom;
+    mutable array* _array;
+    std::vector<std::unique_ptr<array>> _arrays; // <-- owner only
+    
+    explicit deque(i64 n = 256)
+    : _top(0)
+    , _bottom(0) {
+        _arrays.emplace_back(new array(n));
+        _array = _arrays.back().get();
+    }
+    
+    deque(deque const&) = delete;
+    deque& operator=(deque const&) = delete;
+    
+    ~deque() {
+        while (pop())
+            ;
+    }
+    
+    array* _grow(array* a, i64 t, i64 b) {
+        _arrays.emplace_back(new array(2 * (a->_mask + 1)));
+        array* c = _arrays.back().get();
+        for (i64 i = t; i != b; ++i)
+            c->store(i, a->load(i));
+        atomic_store(&_array, c, std::memory_order_release);
+        return c;
+    }
+    
+    // owner only
+    void push(fn<R(Args...)> x) {
+        i64 b = atomic_load(&_bottom, std::memory_order_relaxed);
+        i64 t = atomic_load(&_top, std::memory_order_acquire);
+        array* a = atomic_load(&_array, std::memory_order_relaxed);
+        if (b - t > a->_mask)
+            a = _grow(a, t, b);
+        a->store(b, std::exchange(x._value, nullptr).ptr);
+        std::atomic_thread_fence(std::memory_order_release);
+        atomic_store(&_bottom, b + 1, std::memory_order_relaxed);
+    }
+    
+    // owner only; the youngest task, or nothing
+    fn<R(Args...)> pop() {
+        i64 b = atomic_load(&_bottom, std::memory_order_relaxed) - 1;
+        array* a = atomic_load(&_array, std::memory_order_relaxed);
+        atomic_store(&_bottom, b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 t = atomic_load(&_top, std::memory_order_relaxed);
+        node* p = nullptr;
+        if (t <= b) {
+            p = a->load(b);
+            if (t == b) {
+                // the last item; race the thieves for it
+                if (!atomic_compare_exchange_strong(&_top, &t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    p = nullptr;
+                atomic_store(&_bottom, b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            atomic_store(&_bottom, b + 1, std::memory_order_relaxed);
+        }
+        return fn<R(Args...)>{CountedPtr<node>{p}};
+    }
+    
+    // any thread; the oldest task, or nothing if the deque is empty or we
+    // lost a race
+    fn<R(Args...)> steal() const {
+        i64 t = atomic_load(&_top, std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 b = atomic_load(&_bottom, std::memory_order_acquire);
+        node* p = nullptr;
+        if (t < b) {
+            array* a = atomic_load(&_array, std::memory_order_acquire);
+            p = a->load(t);
+            if (!atomic_compare_exchange_strong(&_top, &t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                p = nullptr;
+        }
+        return fn<R(Args...)>{CountedPtr<node>{p}};
+    }
+    
+    // racy, for deciding whether to look harder
+    bool empty() const {
+        i64 t = atomic_load(&_top, std::memory_order_relaxed);
+        i64 b = atomic_load(&_bottom, std::memory_order_relaxed);
+        return b <= t;
+    }
+    
+};
+
+#endif /* deque_hpp */
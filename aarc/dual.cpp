@@ -6,490 +6,23 @@
 //  Copyright © 2020 Antony Searle. All rights reserved.
 //
 
+#include <algorithm>
+#include <future>
 #include <iostream>
 #include <thread>
 #include <deque>
 
 #include "atomic.hpp"
+#include "deque.hpp"
 #include "dual.hpp"
 #include "fn.hpp"
 #include "y.hpp"
 #include "stack.hpp"
+#include "topology.hpp"
 #include "counted.hpp"
 
 #include <catch2/catch.hpp>
 
-// a lock-free dual atomic data structure that is either a queue of tasks,
-// a stack of waiters, or empty
-//
-// when a task is pushed, it is matched with the youngest waiter, or enqueued
-// if there are no waiters.  when a thread pops, it is matched with the oldest
-// task, or becomes the youngest waiter
-//
-// tasks are handled in order, and that order is multi-thread well-defined
-//
-// if task submission is delayed until the end of the current job (as in
-// asio::dispatch), we can gain efficiency
-
-using namespace aarc;
-
-struct dual {
-    
-    inline thread_local static std::deque<fn<void()>> _continuations;
-    
-    alignas(64) mutable CountedPtr<detail::node<void()>> _head;
-    alignas(64) mutable CountedPtr<detail::node<void()>> _tail;
-            
-    dual() {
-        auto p = new detail::node<void()>;
-        p->_next = 0;
-        auto MAX = CountedPtr<detail::node<void()>>::MAX;
-        p->_count = MAX * 2;
-        _head = CountedPtr<detail::node<void()>>(MAX, p, 0);
-        _tail = _head;
-    }
-    
-    dual(dual const&) = delete;
-    
-    /*
-    dual(dual&& other)
-    : _head{std::exchange(other._head, 0)}
-    , _tail{std::exchange(other._tail, 0)} {
-    }
-     */
-    
-    ~dual() {
-        // no calls to push, pop etc. are active but it is possible that the
-        // nodes are still retained elswehere so we must destroy them properly
-        
-        // nodes that are retained aren't permitted to mutate _next (including
-        // reusing the nodes in another container) unless they have established
-        // unique ownership, i.e.
-        //     ptr(a)->_count.load(memory_order_acquire) == cnt(a)
-        
-        // advance tail
-        CountedPtr<detail::node<void()>> a, b;
-        for (;;) {
-            a = _tail;
-            b = a->_next;
-            if (!b.ptr || b.tag)
-                break;
-            _tail = b;
-            a->release(a.cnt);
-            b->release(1); // <-- coalesce this somehow?
-        }
-        // advance head
-        for (;;) {
-            a = _head;
-            b = a->_next;
-            if (!b.ptr || b.tag)
-                break;
-            _head = b;
-            a->release(a.cnt);
-            b->erase_and_release(1);
-        }
-        // drain stack
-        while ((a = _tail->_next).ptr) {
-            _tail->_next = _tail->_next->_next;
-            a->release(a.cnt);
-        }
-        assert(_head.ptr == _tail.ptr);
-        _head->release(_head.cnt + _tail.cnt);
-    }
-    
-    
-    // bitwise idioms:
-    //
-    //               p & PTR <=> ptr(p) != nullptr
-    //         (p ^ q) & PTR <=> ptr(p) != ptr(q)
-    //     p & (p - 1) & CNT <=> cnt(p) == 2^n + 1
-    //              p &  CNT <=> cnt(p) > 1
-    //              p & ~CNT <=> cnt(p & ~CNT) == 1
-    //              p |  CNT <=> cnt(p |  CNT) == 0x1'0000
-    //              p -  INC <=> cnt(p -  INC) == cnt(p) - 1
-
-    /*
-    static std::pair<u64, u64> _acquire(u64& p, u64 expected) {
-        for (;;) {
-            assert(expected & PTR); // <-- nonnull pointer bits
-            if (__builtin_expect(expected & CNT, true)) { // <-- nonzero counter bits
-                u64 desired = expected - INC;
-                if (atomic_compare_exchange_weak(&p, &expected, desired, std::memory_order_acquire, std::memory_order_relaxed)) {
-                    if (__builtin_expect(expected & desired & CNT, true)) {
-                        return {desired, 1}; // <-- fast path completes
-                    } else { // <-- counter is a power of two
-                        expected = desired;
-                        atomic_fetch_add(&ptr(expected)->_count, LOW, std::memory_order_relaxed);
-                        do if (atomic_compare_exchange_weak(&p, &expected, desired = expected | CNT, std::memory_order_release, std::memory_order_relaxed)) {
-                            if (__builtin_expect((expected & CNT) == 0, false)) // <-- we fixed an exhausted counter
-                                atomic_notify_all(&p);        // <-- notify potential waiters
-                            return{desired, cnt(expected)};
-                        } while (!((expected ^ desired) & PTR)); // <-- while the pointer bits are unchanged
-                        ptr(desired)->release(1 + LOW); // <-- start over
-                    }
-                }
-            } else { // <-- the counter is zero
-                atomic_wait(&p, expected, std::memory_order_relaxed); // <-- until counter may have changed
-                expected = atomic_load(&p, std::memory_order_relaxed);
-            }
-        }
-    }
-     */
-    
-    /*
-    static std::pair<u64, u64> _acquire_specific(u64& p, u64 const specific) {
-        assert(specific & PTR);
-        u64 expected = specific;
-        do {
-            if (__builtin_expect(expected & CNT, true)) {
-                u64 desired = expected - INC;
-                if (atomic_compare_exchange_weak(&p, &expected, desired, std::memory_order_acquire, std::memory_order_relaxed)) {
-                    if (__builtin_expect(expected & desired & CNT, true)) {
-                        assert(!((desired ^ specific) & PTR));
-                        return {desired, 1}; // <-- fast path completes
-                    } else { // <-- count is a power of two, perform housekeeping
-                        expected = desired;
-                        atomic_fetch_add(&ptr(specific)->_count, LOW, std::memory_order_relaxed);
-                        do if (atomic_compare_exchange_weak(&p, &expected, desired = expected | CNT, std::memory_order_release, std::memory_order_relaxed)) {
-                            if (__builtin_expect((expected & CNT) == 0, false)) // <-- we fixed an exhausted counter
-                                atomic_notify_all(&p);        // <-- notify potential waiters
-                            assert(!((desired ^ specific) & PTR));
-                            return{desired, cnt(expected)};
-                        } while (!((expected ^ specific) & PTR)); // <-- while the pointer bits are unchanged
-                        ptr(specific)->release(1 + LOW); // <-- give up
-                    }
-                }
-            } else {
-                atomic_wait(&p, expected, std::memory_order_relaxed);
-                expected = atomic_load(&p, std::memory_order_relaxed);
-            }
-        } while (!((expected ^ specific) & PTR));
-        return {expected, 0};
-    }
-    */
-        
-    CountedPtr<detail::node<void()>> _pop_promise_or_push_item(CountedPtr<detail::node<void()>> z) const {
-        
-        if (z.ptr) {
-            
-            assert(z.tag == 0);
-            assert(z.cnt == 1);
-
-            z->_next = 0;
-            z->_promise = 0;
-            auto MAX = CountedPtr<detail::node<void()>>::MAX;
-            z->_count = MAX * 2;
-            z.cnt = MAX - 1;
-            assert(z->_count == 2 * z.cnt + 2);
-            
-            // over the lifetime of the node,
-            //
-            //           weight    FFFF is assigned to _tail
-            //           weight       1 is assigned to the thread that writes it to _tail
-            //           weight    FFFF is assigned to _head
-            //           weight       1 is assigned to the thread that writes it to _head
-            //                    -----
-            //     total weight   20000 is written to the count
-            //     local weight-1  FFFE is written to the handle
-            //
-            // a thread that does not want to retain the node after writing it
-            // to _head or _tail (as when eagerly advancing _tail) can add its
-            // weight to the write without overflowing the counter
-
-        }
-        
-        using P = CountedPtr<detail::node<void()>>;
-        
-        P a; // <-- old value of _tail
-        P b; // <-- new value of _tail
-        P c; // <-- old value of _tail->_next
-        P d; // <-- new value of _tail->_next
-        P e; // <-- old value of _tail->_next->_next
-        
-        u64 m = 0; // <-- how much of _tail we own
-        u64 n = 0;
-    
-    _load_tail:
-        a = atomic_load(&_tail, std::memory_order_relaxed);
-    _acquire_tail:
-        assert(m == 0);
-        m = atomic_acquire(&_tail, &a);
-        b = a;
-    _load_next:
-        assert(m > 0);
-        c = atomic_load(&a->_next, std::memory_order_acquire);
-    _classify_next:
-        if (c.ptr == 0)     // <-- end of queue
-            goto _push;
-        else if (c.tag) // <-- stack node
-            goto _acquire_next;
-        else // <-- queue node
-            goto _swing_tail;
-        
-    _push: // add the new node (or, if there is no new node, we failed to try_pop a stack node)
-        if (z.ptr && !atomic_compare_exchange_strong(&a->_next,
-                                                     &c,
-                                                     z,
-                                                     std::memory_order_acq_rel,
-                                                     std::memory_order_relaxed))
-            goto _classify_next;
-        a->release(m);
-        assert(n == 0);
-        return 0;
-        
-        
-    _swing_tail: // move stale tail forwards
-        if (!atomic_compare_exchange_weak(&_tail, &b, c, std::memory_order_release, std::memory_order_relaxed))
-            goto _swing_tail_failed;
-        if (__builtin_expect((b.cnt == 1) && (c.cnt > 1), false))  // <-- we happened to fix a counter
-            atomic_notify_all(&_tail);
-        a->release(m + b.cnt);
-        a = c;
-        b = c;
-        m = 1;
-        goto _load_next;
-
-    _swing_tail_failed:
-        if (a.ptr != b.ptr)
-            goto _swing_tail_failed_due_to_pointer_change;
-        goto _swing_tail;
-
-    _swing_tail_failed_due_to_pointer_change:
-        a->release(m);
-        m = 0;
-        a = b;
-        goto _acquire_tail;
-        
-        
-    _acquire_next: // pop stack node
-        assert(m);
-        // std::tie(c, n) = _acquire_specific(ptr(a)->_next, c);
-        n = atomic_compare_acquire_strong(&a->_next, &c);
-        if (n == 0)
-            goto _classify_next;
-        e = atomic_load(&c->_next, std::memory_order_relaxed);
-    _pop_next:
-        d = c;
-        if (!atomic_compare_exchange_weak(&a->_next,
-                                          &d,
-                                          e,
-                                          std::memory_order_acquire,
-                                          std::memory_order_relaxed))
-            goto _pop_next_failed;
-        a->release(m);
-        assert(c.cnt + n <= P::MAX);
-        c.cnt += n;
-        return c;
-    
-    _pop_next_failed:
-        if (c.ptr != d.ptr)
-            goto _pop_next_failed_due_to_pointer_change;
-        else
-            goto _pop_next;
-        
-    _pop_next_failed_due_to_pointer_change:
-        c->release(n);
-        c = d;
-        n = 0;
-        goto _classify_next;
-        
-    };
-    
-    
-    
-    [[nodiscard]] CountedPtr<detail::node<void()>>
-    _pop_item_or_push_promise(CountedPtr<detail::node<void()>> z = 0) const {
-        
-        using P = CountedPtr<detail::node<void()>>;
-        
-        if (z.ptr) {
-            // assert(!(z & ~PTR));
-            assert(z.tag == 0);
-            assert(z.cnt == 1);
-            z->_next = 0;
-            z->_count = P::MAX;
-            z->_promise = 0;
-            z.cnt = P::MAX - 1;
-            assert(z->_count == z.cnt + 1); // <-- submitter retains 1
-        }
-
-        P  a; // <-- old value of _head
-        P  b; // <-- new value of _head
-        P  c; // <-- old value of _head->_next
-        
-        u64 m = 0;
-        
-    _load_head:
-        a = atomic_load(&_head, std::memory_order_relaxed);
-    _acquire_head:
-        assert(m == 0);
-        m = atomic_acquire(&_head, &a);
-        b = a;
-    _load_next:
-        assert(a.ptr);
-        c = atomic_load(&a->_next, std::memory_order_acquire);
-    _classify_next:
-        //assert((c.ptr && !c.tag) == (c.cnt == P::MAX - 1));
-        if (c.ptr && !c.tag)
-            goto _swing_head;
-    _push: // <-- update _head->_next to push a stack node (or, if there is no stack node provided, try_pop has failed)
-        if (z.ptr) {
-            z.tag = std::min<u64>(c.tag + 1, P::TAG); // <-- use tag bits to track stack depth why not
-            assert(z.tag);
-            z->_next = c;
-            if (!atomic_compare_exchange_strong(&a->_next,
-                                                &c,
-                                                z,
-                                                std::memory_order_acq_rel,
-                                                std::memory_order_relaxed))
-                goto _classify_next;
-        }
-        a->release(m);
-        m = 0;
-        return 0;
-                        
-    _swing_head: // <-- advance head to claim a queue node
-        if (!atomic_compare_exchange_weak(&_head, &b, c, std::memory_order_release, std::memory_order_relaxed))
-            goto _swing_head_failed;
-        if (__builtin_expect((b.cnt == 1) && (c.cnt > 1), false)) // <-- we happened to fix a counter
-            atomic_notify_all(&_head);
-        a->release(b.cnt + m);
-        c.cnt = 1;
-        return c;
-        
-    _swing_head_failed:
-        if (a.ptr != b.ptr)
-            goto _swing_head_failed_due_to_pointer_change;
-        goto _swing_head;
-        
-    _swing_head_failed_due_to_pointer_change:
-        a->release(m);
-        m = 0;
-        a = b;
-        goto _acquire_head;
-        
-    }
-    
-    // try_push fails if no threads are waiting
-    bool try_push(fn<void()>& x) const {
-        assert(x._value.ptr);
-        CountedPtr<detail::node<void()>> waiter = _pop_promise_or_push_item(nullptr); // aka try_pop_waiter
-        if (waiter.ptr) {
-            assert(waiter.ptr);
-            [[maybe_unused]] u64 n = waiter.tag; // <-- there were n waiters (saturating count)
-            atomic_store(&waiter->_promise, std::exchange(x._value, nullptr), std::memory_order_release);
-            atomic_notify_one(&waiter->_promise);
-            waiter->release(waiter.cnt);
-        }
-        return (bool) waiter.ptr;
-    }
-    
-    
-    void push(fn<void()> x) const {
-        assert(x._value.ptr);
-        CountedPtr<detail::node<void()>> waiter = _pop_promise_or_push_item(x._value);
-        if (waiter.ptr) {
-            assert(waiter.ptr);
-            [[maybe_unused]] u64 n = waiter.tag; // <-- there were n waiters (saturating count)
-            atomic_store(&waiter->_promise, std::exchange(x._value, 0), std::memory_order_release);
-            atomic_notify_one(&waiter->_promise);
-            waiter->release(waiter.cnt);
-        } else {
-            x._value = 0; // <-- we gave up ownership
-        }
-    }
-    
-    // if result is nonzero it MUST be erased and released
-    //
-    //    if (u64 task = x.try_pop())
-    //        mptr(task)->mut_call_and_erase_and_release
-    //
-    [[nodiscard]] CountedPtr<detail::node<void()>> try_pop() const {
-        return _pop_item_or_push_promise(0);
-    }
-    
-    bool try_pop_and_call() const {
-        auto task = _pop_item_or_push_promise(nullptr);
-        if (task) {
-            assert(task.ptr);
-            task->mut_call_and_erase_and_release(task.cnt);
-        }
-        return (bool) task;
-    }
-    
-    void pop_and_call() const {
-        // a node containing a promise
-        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
-        auto task = _pop_item_or_push_promise(promise.get());
-        if (task) {
-            task->mut_call_and_erase_and_release(task.cnt);
-        } else {
-            detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
-            atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
-            task = atomic_load(&ptr->_promise, std::memory_order_acquire);
-            ptr->release(1);
-            assert(task);
-            task->mut_call_and_erase_and_delete();
-        }
-    }
-    
-    [[noreturn]] void pop_and_call_forever() const {
-        // a node containing a promise
-        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
-        for (;;) {
-            auto task = _pop_item_or_push_promise(promise.get());
-            if (task) {
-                task->mut_call_and_erase_and_release(task.cnt);
-            } else {
-                detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
-                promise.reset(new detail::node<void()>);
-                atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
-                task = atomic_load(&ptr->_promise, std::memory_order_acquire);
-                ptr->release(1);
-                assert(task);
-                task->mut_call_and_erase_and_delete();
-            }
-        }
-    }
-
-    [[noreturn]] void pop_and_call_forever_with_dispatch() const {
-        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
-        for (;;) {
-            while (!_continuations.empty()) {
-                while (_continuations.size() > 1) {
-                    push(std::move(_continuations.front()));
-                    _continuations.pop_front();
-                }
-                assert(_continuations.size() == 1);
-                if (auto f = try_pop()) {
-                    push(std::move(_continuations.front()));
-                    _continuations.pop_front();
-                    f->mut_call_and_erase_and_release(f.cnt);
-                } else {
-                    fn<void()> g = std::move(_continuations.front());
-                    _continuations.pop_front();
-                    g();
-                }
-            }
-            assert(_continuations.empty() && promise);
-            auto f = _pop_item_or_push_promise(promise.get());
-            if (f) {
-                f->mut_call_and_erase_and_release(f.cnt);
-            } else {
-                detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
-                atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
-                auto g = atomic_load(&ptr->_promise, std::memory_order_acquire);
-                ptr->release(1);
-                g->mut_call_and_erase_and_delete();
-                promise.reset(new detail::node<void()>);
-            }
-        }
-    }
-
-};
-
-
-
 TEST_CASE("dual", "[dual]") {
     printf("extant: %llu\n", atomic_load(&detail::node<void()>::_extant, std::memory_order_relaxed));
 
@@ -624,56 +157,686 @@ TEST_CASE("dual-exhaust", "[dual]") {
     
 }
 
+TEST_CASE("dual-push-many", "[dual]") {
+    
+    {
+        // with no waiters the batch is queued in order
+        dual d;
+        std::vector<int> order;
+        stack<fn<void()>> s;
+        for (int i = 0; i != 100; ++i)
+            s.push([&order, i] { order.push_back(i); });
+        s.reverse();
+        d.push_many(std::move(s));
+        d.push([&order] { order.push_back(100); });
+        for (int i = 0; i != 101; ++i)
+            d.pop_and_call();
+        REQUIRE(order.size() == 101);
+        REQUIRE(std::is_sorted(order.begin(), order.end()));
+    }
+    
+    {
+        // waiters are served first, then the rest is queued; repeat so that
+        // waiters also arrive while the batch is being pushed
+        dual d;
+        std::atomic<int> n{0};
+        for (int round = 0; round != 100; ++round) {
+            std::vector<std::thread> t;
+            for (int i = 0; i != 4; ++i)
+                t.emplace_back([&d] { d.pop_and_call(); });
+            stack<fn<void()>> s;
+            for (int i = 0; i != 10; ++i)
+                s.push([&n] { n.fetch_add(1, std::memory_order_relaxed); });
+            d.push_many(std::move(s));
+            for (auto& x : t)
+                x.join();
+            while (d.try_pop_and_call())
+                ;
+        }
+        REQUIRE(n.load() == 1000);
+    }
+    
+}
+
 // try_push (fails if no waiter found)
 // try_pop
 // defer - to local queue, process last job oneself if try_pop fails (or if we
 // know the queue is empty because pushing next-to-last-job returned a waiter
 
 
-struct pool_dual : dual {
+void pool_submit_one(fn<void()> f) {
+    pool_dual::_get().submit(std::move(f));
+}
+
+void offload_submit(fn<void()> f) {
+    pool_dual::_get_blocking().submit(std::move(f));
+}
+
+void pool_submit_many(stack<fn<void()>> s) {
+    pool_dual::_get().submit_many(std::move(s));
+}
+
+void pool_submit_one(fn<void()> f, lane l) {
+    pool_dual::_get().submit(std::move(f), l);
+}
+
+// a binary tree of tasks, each of which spawns its children and returns,
+// with a serial fib at the leaves; the last to finish sets done
+struct fork_join {
+    
+    pool_dual const* _pool;
+    int _leaf;
+    std::atomic<u64> _outstanding{1};
+    std::atomic<u64> _sum{0};
+    std::promise<void> _done;
+    
+    fork_join(pool_dual const* pool, int leaf)
+    : _pool(pool)
+    , _leaf(leaf) {
+    }
     
-    std::vector<std::thread> _threads;
+    static u64 fib(int n) {
+        return (n < 2) ? n : fib(n - 1) + fib(n - 2);
+    }
     
-    pool_dual() {
-        auto n = std::thread::hardware_concurrency();
-        std::vector<std::thread> t;
-        for (decltype(n) i = 0; i != n; ++i) {
-            _threads.emplace_back([this] {
-                try {
-                    pop_and_call_forever_with_dispatch();
-                } catch (...) {
-                    // no rethrow
-                }
+    void spawn(int depth) {
+        _pool->submit([this, depth] {
+            if (depth) {
+                _outstanding.fetch_add(2, std::memory_order_relaxed);
+                spawn(depth - 1);
+                spawn(depth - 1);
+            } else {
+                _sum.fetch_add(fib(_leaf), std::memory_order_relaxed);
+            }
+            if (_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                _done.set_value();
+        });
+    }
+    
+    u64 operator()(int depth) {
+        spawn(depth);
+        _done.get_future().get();
+        return _sum.load(std::memory_order_relaxed);
+    }
+    
+};
+
+// with every worker of p held busy, queue 100 tasks with submit(i, task),
+// then shut down, releasing the workers from another thread once shutdown
+// has begun.  the tasks share token, and count in ran any that run
+struct shutdown_result {
+    bool waited; // <-- for the running tasks
+    bool dropped; // <-- the queued tasks were destroyed
+};
+
+template<typename Submit>
+shutdown_result shutdown_busy(pool_dual& p, pool_dual::shutdown_mode mode,
+                              std::shared_ptr<int> const& token, std::atomic<int>& ran,
+                              Submit&& submit) {
+    using namespace std::chrono;
+    std::size_t workers = p._workers.size();
+    std::atomic<std::size_t> running{0};
+    std::atomic<bool> release{false};
+    for (std::size_t i = 0; i != workers; ++i)
+        p.submit([&] {
+            running.fetch_add(1, std::memory_order_relaxed);
+            while (!release.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(milliseconds{1});
+        });
+    while (running.load(std::memory_order_relaxed) != workers)
+        std::this_thread::sleep_for(milliseconds{1});
+    for (int i = 0; i != 100; ++i)
+        submit(i, fn<void()>{[&ran, token] { ran.fetch_add(1, std::memory_order_relaxed); }});
+    std::thread t([&] {
+        std::this_thread::sleep_for(milliseconds{10});
+        release.store(true, std::memory_order_release);
+    });
+    p.shutdown(mode);
+    shutdown_result r{release.load(), token.use_count() == 1};
+    t.join();
+    return r;
+}
+
+TEST_CASE("pool-steal", "[dual]") {
+    
+    for (bool stealing : { false, true }) {
+        pool_dual p(4, stealing);
+        REQUIRE(fork_join{&p, 10}(12) == 4096 * fork_join::fib(10));
+        
+        // deferred continuations are run too
+        std::atomic<int> n{0};
+        std::promise<void> done;
+        p.submit([&] {
+            for (int i = 0; i != 100; ++i) {
+                dual::_continuations.emplace_back([&] {
+                    if (n.fetch_add(1, std::memory_order_relaxed) == 99)
+                        done.set_value();
+                });
+            }
+        });
+        done.get_future().get();
+    }
+    
+}
+
+TEST_CASE("pool-shutdown", "[dual]") {
+    
+    using namespace std::chrono;
+    
+    for (bool stealing : { false, true }) {
+        
+        {
+            // drain runs everything queued, and everything it spawns
+            pool_dual p(2, stealing);
+            std::atomic<int> n{0};
+            for (int i = 0; i != 1000; ++i)
+                p.submit([&] {
+                    n.fetch_add(1, std::memory_order_relaxed);
+                    p.submit([&] { n.fetch_add(1, std::memory_order_relaxed); });
+                });
+            p.shutdown(pool_dual::shutdown_mode::drain);
+            REQUIRE(n.load() == 2000);
+        }
+        
+        for (auto mode : { pool_dual::shutdown_mode::drop, pool_dual::shutdown_mode::immediate }) {
+            // drop destroys the queued work once the running tasks finish;
+            // immediate returns at once and leaves it for the destructor
+            auto token = std::make_shared<int>(0);
+            std::atomic<int> n{0};
+            {
+                pool_dual p(2, stealing);
+                auto r = shutdown_busy(p, mode, token, n, [&p](int, fn<void()> f) {
+                    p.submit(std::move(f));
+                });
+                REQUIRE(r.waited == (mode == pool_dual::shutdown_mode::drop));
+                REQUIRE(r.dropped == (mode == pool_dual::shutdown_mode::drop));
+            }
+            REQUIRE(n.load() == 0);
+            REQUIRE(token.use_count() == 1);
+        }
+        
+        {
+            // quiesce waits for spawned work too, and the pool carries on
+            pool_dual p(4, stealing);
+            std::atomic<int> n{0};
+            for (int round = 0; round != 10; ++round) {
+                for (int i = 0; i != 100; ++i)
+                    p.submit([&] {
+                        std::this_thread::sleep_for(microseconds{10});
+                        dual::_continuations.emplace_back([&] { n.fetch_add(1, std::memory_order_relaxed); });
+                    });
+                p.quiesce();
+                REQUIRE(n.load() == 100 * (round + 1));
+            }
+        }
+        
+    }
+    
+    {
+        // work offloaded to the blocking pool is counted like any other
+        std::atomic<int> n{0};
+        for (int i = 0; i != 100; ++i)
+            offload_submit([&] { n.fetch_add(1, std::memory_order_relaxed); });
+        pool_dual::_get_blocking().quiesce();
+        REQUIRE(n.load() == 100);
+    }
+    
+}
+
+TEST_CASE("pool-numa", "[dual]") {
+    
+    using namespace std::chrono;
+    
+    // a machine of two nodes, faked on whatever CPU we have
+    unsigned c = (unsigned) std::max(topology::current_cpu(), 0);
+    topology t;
+    t._nodes = {{c}, {c}};
+    
+    {
+        // workers are spread evenly across the nodes, each with a queue
+        pool_dual p(t, 4);
+        REQUIRE(p._nodes.size() == 2);
+        REQUIRE(p._nodes[0]->_queue == &p._dual());
+        REQUIRE(p._nodes[1]->_queue != &p._dual());
+        REQUIRE(p._nodes[0]->_workers.size() == 2);
+        REQUIRE(p._nodes[1]->_workers.size() == 2);
+        REQUIRE(fork_join{&p, 10}(10) == 1024 * fork_join::fib(10));
+        
+        // work queued on one node reaches the workers of the other when
+        // its own are busy
+        std::atomic<int> running{0};
+        for (int i = 0; i != 4; ++i)
+            p.submit([&] {
+                running.fetch_add(1, std::memory_order_relaxed);
+                while (running.load(std::memory_order_relaxed) != 4)
+                    std::this_thread::sleep_for(microseconds{100});
             });
+        p.quiesce();
+        REQUIRE(running.load() == 4);
+        
+        // and so does work queued directly on another node
+        std::atomic<int> n{0};
+        for (int i = 0; i != 1000; ++i)
+            p._push(*p._nodes[i & 1]->_queue, [&] { n.fetch_add(1, std::memory_order_relaxed); });
+        p.quiesce();
+        REQUIRE(n.load() == 1000);
+    }
+    
+    {
+        // drop destroys the work queued on every node
+        auto token = std::make_shared<int>(0);
+        std::atomic<int> n{0};
+        pool_dual p(t, 2);
+        auto r = shutdown_busy(p, pool_dual::shutdown_mode::drop, token, n, [&p](int i, fn<void()> f) {
+            p._push(*p._nodes[i & 1]->_queue, std::move(f));
+        });
+        REQUIRE(r.dropped);
+        REQUIRE(n.load() == 0);
+    }
+    
+}
+
+TEST_CASE("pool-elastic", "[dual]") {
+    
+    using namespace std::chrono;
+    
+    pool_dual::elastic e;
+    e.min = 1;
+    e.max = 4;
+    e.idle_timeout = milliseconds{50};
+    e.interval = milliseconds{1};
+    pool_dual p(e);
+    REQUIRE(p.threads() == 1);
+    
+    // tasks that block on each other need more workers than we start with;
+    // twice as many as the maximum never get them all
+    std::atomic<int> running{0};
+    std::atomic<bool> release{false};
+    for (int i = 0; i != 8; ++i)
+        p.submit([&] {
+            running.fetch_add(1, std::memory_order_relaxed);
+            while (!release.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(milliseconds{1});
+        });
+    auto deadline = steady_clock::now() + seconds{10};
+    while ((running.load() < 4) && (steady_clock::now() < deadline))
+        std::this_thread::sleep_for(milliseconds{1});
+    std::this_thread::sleep_for(milliseconds{20});
+    REQUIRE(running.load() == 4);
+    REQUIRE(p.threads() == 4);
+    release.store(true, std::memory_order_release);
+    p.quiesce();
+    REQUIRE(running.load() == 8);
+    
+    // idle workers retire down to the minimum
+    deadline = steady_clock::now() + seconds{10};
+    while ((p.threads() > 1) && (steady_clock::now() < deadline))
+        std::this_thread::sleep_for(milliseconds{10});
+    REQUIRE(p.threads() == 1);
+    
+    // and the pool carries on
+    REQUIRE(fork_join{&p, 10}(10) == 1024 * fork_join::fib(10));
+    std::atomic<int> n{0};
+    for (int i = 0; i != 1000; ++i)
+        p.submit([&] { n.fetch_add(1, std::memory_order_relaxed); });
+    p.quiesce();
+    REQUIRE(n.load() == 1000);
+    
+}
+
+TEST_CASE("pool-lanes", "[dual]") {
+    
+    using namespace std::chrono;
+    
+    // one worker, held up while we queue work in every lane
+    pool_dual p(1);
+    std::atomic<bool> release{false};
+    auto hold = [&] {
+        p.submit([&] {
+            while (!release.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(milliseconds{1});
+        });
+        std::this_thread::sleep_for(milliseconds{10});
+    };
+    std::vector<int> order;
+    auto record = [&](int i) {
+        return [&order, i] { order.push_back(i); };
+    };
+    
+    {
+        // without aging, strictly by lane and then in order
+        p.aging(lane::normal, 0);
+        p.aging(lane::background, 0);
+        hold();
+        for (int i = 0; i != 3; ++i) {
+            p.submit(record(20 + i), lane::background);
+            p.submit(record(10 + i), lane::normal);
+            p.submit(record(0 + i), lane::urgent);
+        }
+        release.store(true, std::memory_order_release);
+        p.quiesce();
+        REQUIRE(order == std::vector<int>{0, 1, 2, 10, 11, 12, 20, 21, 22});
+    }
+    
+    {
+        // with aging, the background lane gets its turn under load
+        order.clear();
+        release.store(false);
+        p.aging(lane::background, 4);
+        hold();
+        for (int i = 0; i != 10; ++i)
+            p.submit(record(100 + i), lane::background);
+        for (int i = 0; i != 100; ++i)
+            p.submit(record(i), lane::normal);
+        release.store(true, std::memory_order_release);
+        p.quiesce();
+        REQUIRE(order.size() == 110);
+        auto first = std::find(order.begin(), order.end(), 100) - order.begin();
+        REQUIRE(first < 8);
+        auto middle = std::stable_partition(order.begin(), order.end(), [](int i) { return i < 100; });
+        REQUIRE(std::is_sorted(order.begin(), middle)); // <-- each lane in order
+        REQUIRE(std::is_sorted(middle, order.end()));
+    }
+    
+    {
+        // urgent work submitted by a task jumps the queue too
+        order.clear();
+        release.store(false);
+        hold();
+        p.submit([&] {
+            p.submit(record(1));
+            p.submit(record(0), lane::urgent);
+        });
+        release.store(true, std::memory_order_release);
+        p.quiesce();
+        REQUIRE(order == std::vector<int>{0, 1});
+    }
+    
+    {
+        // drop destroys the work in every lane
+        auto token = std::make_shared<int>(0);
+        std::atomic<int> n{0};
+        auto r = shutdown_busy(p, pool_dual::shutdown_mode::drop, token, n, [&p](int i, fn<void()> f) {
+            p.submit(std::move(f), (i & 1) ? lane::urgent : lane::background);
+        });
+        REQUIRE(r.dropped);
+        REQUIRE(n.load() == 0);
+    }
+    
+}
+
+TEST_CASE("pool-steal-bench", "[dual][.bench]") {
+    
+    using namespace std::chrono;
+    
+    int depth = 16;
+    int leaf = 12;
+    for (unsigned n : { 1, 2, 4, 8, 16, 32, 64 }) {
+        double t[2];
+        for (bool stealing : { false, true }) {
+            pool_dual p(n, stealing);
+            auto a = steady_clock::now();
+            (void) fork_join{&p, leaf}(depth);
+            auto b = steady_clock::now();
+            t[stealing] = duration<double, std::milli>(b - a).count();
         }
+        printf("%2u threads: %2d-deep fork-join, dual %8.1f ms, stealing %8.1f ms\n",
+               n, depth, t[0], t[1]);
     }
     
-    ~pool_dual() {
-        // submit kill jobs
-        for (std::size_t i = 0; i != _threads.size(); ++i)
-            push([] { throw 0; });
-        // join threads as they finish
-        while (!_threads.empty()) {
-            _threads.back().join();
-            _threads.pop_back();
+}
+
+TEST_CASE("dual-push-many-bench", "[dual][.bench]") {
+    
+    // bursts of tasks submitted from outside the pool, as by the reactor,
+    // one push at a time or as a batch
+    
+    using namespace std::chrono;
+    
+    int bursts = 2'000;
+    int burst = 256;
+    for (unsigned n : { 1, 4, 16 }) {
+        double t[2];
+        for (bool batched : { false, true }) {
+            pool_dual p(n);
+            std::atomic<u64> remaining{(u64) bursts * burst};
+            std::promise<void> done;
+            auto a = steady_clock::now();
+            for (int i = 0; i != bursts; ++i) {
+                stack<fn<void()>> s;
+                for (int j = 0; j != burst; ++j)
+                    s.push([&] {
+                        if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                            done.set_value();
+                    });
+                if (batched) {
+                    p.submit_many(std::move(s));
+                } else {
+                    s.reverse();
+                    while (!s.empty())
+                        p.submit(s.pop());
+                }
+            }
+            done.get_future().get();
+            auto b = steady_clock::now();
+            t[batched] = duration<double, std::nano>(b - a).count() / (bursts * burst);
         }
+        printf("%2u threads: bursts of %d, push %6.1f ns, push_many %6.1f ns per task\n",
+               n, burst, t[0], t[1]);
+    }
+    
+}
+
+TEST_CASE("pool-shutdown-bench", "[dual][.bench]") {
+    
+    // how long it takes to start a pool, and to shut it down again
+    
+    using namespace std::chrono;
+    
+    for (unsigned n : { 1, 4, 16, 64 }) {
+        int rounds = 100;
+        double t = 0;
+        for (int i = 0; i != rounds; ++i) {
+            pool_dual p(n);
+            std::this_thread::sleep_for(microseconds{100}); // <-- let the workers park
+            auto a = steady_clock::now();
+            p.shutdown();
+            auto b = steady_clock::now();
+            t += duration<double, std::micro>(b - a).count();
+        }
+        printf("%2u threads: shutdown %8.1f us\n", n, t / rounds);
+    }
+    
+}
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// last-level cache misses of this thread and the threads it creates from
+// now on, or nothing where perf events are unavailable
+struct llc_misses {
+    
+    int _fd;
+    
+    llc_misses() {
+        perf_event_attr a = {};
+        a.size = sizeof(a);
+        a.type = PERF_TYPE_HARDWARE;
+        a.config = PERF_COUNT_HW_CACHE_MISSES;
+        a.inherit = 1;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        _fd = (int) syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
     }
     
-    static pool_dual const& _get() {
-        static pool_dual p;
-        return p;
+    ~llc_misses() {
+        if (_fd >= 0)
+            (void) close(_fd);
+    }
+    
+    // inherited counts are only summed in as the threads exit
+    long long read() const {
+        long long n = -1;
+        if ((_fd < 0) || (::read(_fd, &n, sizeof(n)) != sizeof(n)))
+            return -1;
+        return n;
     }
     
 };
 
-void pool_submit_one(fn<void()> f) {
-    pool_dual::_get().push(std::move(f));
+#else
+
+struct llc_misses {
+    long long read() const { return -1; }
+};
+
+#endif
+
+TEST_CASE("pool-numa-bench", "[dual][.bench]") {
+    
+    // each node has a working set, first touched by a submitter pinned to
+    // that node, which submits tasks that sum pieces of it.  the plain pool
+    // runs them wherever; the placed pool keeps them on the node they were
+    // submitted from, so misses are satisfied locally
+    
+    using namespace std::chrono;
+    
+    topology t = topology::discover();
+    std::size_t words = 4 << 20; // <-- 32 MB per node, bigger than a cache
+    std::size_t piece = 16 << 10;
+    int passes = 8;
+    printf("%zu nodes, %zu cpus\n", t.nodes(), t.cpus());
+    for (bool placed : { false, true }) {
+        llc_misses misses;
+        double ms;
+        {
+            std::unique_ptr<pool_dual> p{placed ? new pool_dual(t) : new pool_dual((unsigned) t.cpus())};
+            std::vector<std::vector<u64>> sets(t.nodes());
+            std::atomic<u64> sum{0};
+            std::vector<std::thread> submitters;
+            auto a = steady_clock::now();
+            for (std::size_t i = 0; i != t.nodes(); ++i)
+                submitters.emplace_back([&, i] {
+                    (void) topology::pin(t._nodes[i].front());
+                    sets[i].assign(words, 1); // <-- first touch places the pages here
+                    std::atomic<std::size_t> remaining{passes * words / piece};
+                    std::promise<void> done;
+                    for (int k = 0; k != passes; ++k)
+                        for (std::size_t j = 0; j != words; j += piece)
+                            p->submit([&, i, j] {
+                                u64 s = 0;
+                                for (std::size_t m = j; m != j + piece; ++m)
+                                    s += sets[i][m];
+                                sum.fetch_add(s, std::memory_order_relaxed);
+                                if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                                    done.set_value();
+                            });
+                    done.get_future().get();
+                });
+            for (auto& s : submitters)
+                s.join();
+            auto b = steady_clock::now();
+            ms = duration<double, std::milli>(b - a).count();
+            REQUIRE(sum.load() == t.nodes() * passes * words);
+        } // <-- joins the workers, whose counts are then summed in
+        long long n = misses.read();
+        if (n < 0)
+            printf("%s pool: %8.1f ms, LLC misses n/a\n", placed ? "placed" : " plain", ms);
+        else
+            printf("%s pool: %8.1f ms, LLC misses %12lld\n", placed ? "placed" : " plain", ms, n);
+    }
+    
 }
 
-void pool_submit_many(stack<fn<void()>> s) {
-    pool_dual const& r = pool_dual::_get();
-    s.reverse();
-    while (!s.empty()) {
-        r.push(s.pop());
+TEST_CASE("pool-elastic-bench", "[dual][.bench]") {
+    
+    // bursts of tasks that block for a millisecond, as on a disk or a lock,
+    // separated by idle periods.  the fixed pool has a worker per CPU; the
+    // elastic pool grows to meet the burst and shrinks between them
+    
+    using namespace std::chrono;
+    
+    unsigned hw = std::thread::hardware_concurrency();
+    int bursts = 3;
+    int burst = 1'000;
+    for (bool elastic : { false, true }) {
+        pool_dual::elastic e;
+        e.min = 1;
+        e.max = 64;
+        e.idle_timeout = milliseconds{100};
+        std::unique_ptr<pool_dual> p{elastic ? new pool_dual(e) : new pool_dual(hw)};
+        for (int i = 0; i != bursts; ++i) {
+            auto a = steady_clock::now();
+            for (int j = 0; j != burst; ++j)
+                p->submit([] { std::this_thread::sleep_for(milliseconds{1}); });
+            p->quiesce();
+            auto b = steady_clock::now();
+            u64 peak = p->threads();
+            std::this_thread::sleep_for(milliseconds{500});
+            printf("%s pool: burst of %d in %7.1f ms, %2llu threads, %2llu after idling\n",
+                   elastic ? "elastic" : "  fixed", burst,
+                   duration<double, std::milli>(b - a).count(),
+                   (unsigned long long) peak, (unsigned long long) p->threads());
+        }
     }
+    
+}
+
+TEST_CASE("pool-lanes-bench", "[dual][.bench]") {
+    
+    // a feeder keeps the pool saturated with 100 us background tasks, while
+    // foreground tasks arrive every 500 us; we measure how long they queue
+    // before they start, with everything in the normal lane and with the
+    // foreground urgent and the background in the background lane
+    
+    using namespace std::chrono;
+    
+    auto spin = [](microseconds d) {
+        auto t = steady_clock::now() + d;
+        while (steady_clock::now() < t)
+            ;
+    };
+    unsigned n = std::thread::hardware_concurrency();
+    for (bool lanes : { false, true }) {
+        pool_dual p(n);
+        std::atomic<int> outstanding{0};
+        std::atomic<bool> stop{false};
+        std::thread feeder([&] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (outstanding.load(std::memory_order_relaxed) < (int) (16 * n)) {
+                    outstanding.fetch_add(1, std::memory_order_relaxed);
+                    p.submit([&] {
+                        spin(microseconds{100});
+                        outstanding.fetch_sub(1, std::memory_order_relaxed);
+                    }, lanes ? lane::background : lane::normal);
+                } else {
+                    std::this_thread::sleep_for(microseconds{20});
+                }
+            }
+        });
+        std::this_thread::sleep_for(milliseconds{50});
+        int samples = 2'000;
+        std::vector<double> latency(samples);
+        std::atomic<int> done{0};
+        for (int i = 0; i != samples; ++i) {
+            auto a = steady_clock::now();
+            p.submit([&, a, i] {
+                latency[i] = duration<double, std::micro>(steady_clock::now() - a).count();
+                done.fetch_add(1, std::memory_order_release);
+            }, lanes ? lane::urgent : lane::normal);
+            std::this_thread::sleep_for(microseconds{500});
+        }
+        while (done.load(std::memory_order_acquire) != samples)
+            std::this_thread::sleep_for(milliseconds{1});
+        stop.store(true);
+        feeder.join();
+        std::sort(latency.begin(), latency.end());
+        printf("%s: foreground p50 %8.1f us, p99 %8.1f us\n",
+               lanes ? "  lanes" : "no lanes",
+               latency[samples / 2], latency[samples * 99 / 100]);
+    }
+    
 }
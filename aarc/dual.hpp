@@ -11,4 +11,1310 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "atomic.hpp"
+#include "counted.hpp"
+#include "deque.hpp"
+#include "fn.hpp"
+#include "pool.hpp"
+#include "stack.hpp"
+#include "topology.hpp"
+
+// a lock-free dual atomic data structure that is either a queue of tasks,
+// a stack of waiters, or empty
+//
+// when a task is pushed, it is matched with the youngest waiter, or enqueued
+// if there are no waiters.  when a thread pops, it is matched with the oldest
+// task, or becomes the youngest waiter
+//
+// tasks are handled in order, and that order is multi-thread well-defined
+//
+// if task submission is delayed until the end of the current job (as in
+// asio::dispatch), we can gain efficiency
+
+using namespace aarc;
+
+struct dual {
+    
+    inline thread_local static std::deque<fn<void()>> _continuations;
+    
+    alignas(64) mutable CountedPtr<detail::node<void()>> _head;
+    alignas(64) mutable CountedPtr<detail::node<void()>> _tail;
+    
+    dual() {
+        auto p = new detail::node<void()>;
+        p->_next = 0;
+        auto MAX = CountedPtr<detail::node<void()>>::MAX;
+        p->_count = MAX * 2;
+        _head = CountedPtr<detail::node<void()>>(MAX, p, 0);
+        _tail = _head;
+    }
+    
+    dual(dual const&) = delete;
+    
+    /*
+    dual(dual&& other)
+    : _head{std::exchange(other._head, 0)}
+    , _tail{std::exchange(other._tail, 0)} {
+    }
+     */
+    
+    ~dual() {
+        // no calls to push, pop etc. are active but it is possible that the
+        // nodes are still retained elswehere so we must destroy them properly
+        
+        // nodes that are retained aren't permitted to mutate _next (including
+        // reusing the nodes in another container) unless they have established
+        // unique ownership, i.e.
+        //     ptr(a)->_count.load(memory_order_acquire) == cnt(a)
+        
+        // advance tail
+        CountedPtr<detail::node<void()>> a, b;
+        for (;;) {
+            a = _tail;
+            b = a->_next;
+            if (!b.ptr || b.tag)
+                break;
+            _tail = b;
+            a->release(a.cnt);
+            b->release(1); // <-- coalesce this somehow?
+        }
+        // advance head
+        for (;;) {
+            a = _head;
+            b = a->_next;
+            if (!b.ptr || b.tag)
+                break;
+            _head = b;
+            a->release(a.cnt);
+            b->erase_and_release(1);
+        }
+        // drain stack
+        while ((a = _tail->_next).ptr) {
+            _tail->_next = _tail->_next->_next;
+            a->release(a.cnt);
+        }
+        assert(_head.ptr == _tail.ptr);
+        _head->release(_head.cnt + _tail.cnt);
+    }
+    
+    
+    // bitwise idioms:
+    //
+    //               p & PTR <=> ptr(p) != nullptr
+    //         (p ^ q) & PTR <=> ptr(p) != ptr(q)
+    //     p & (p - 1) & CNT <=> cnt(p) == 2^n + 1
+    //              p &  CNT <=> cnt(p) > 1
+    //              p & ~CNT <=> cnt(p & ~CNT) == 1
+    //              p |  CNT <=> cnt(p |  CNT) == 0x1'0000
+    //              p -  INC <=> cnt(p -  INC) == cnt(p) - 1
+    
+    /*
+    static std::pair<u64, u64> _acquire(u64& p, u64 expected) {
+        for (;;) {
+            assert(expected & PTR); // <-- nonnull pointer bits
+            if (__builtin_expect(expected & CNT, true)) { // <-- nonzero counter bits
+                u64 desired = expected - INC;
+                if (atomic_compare_exchange_weak(&p, &expected, desired, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    if (__builtin_expect(expected & desired & CNT, true)) {
+                        return {desired, 1}; // <-- fast path completes
+                    } else { // <-- counter is a power of two
+                        expected = desired;
+                        atomic_fetch_add(&ptr(expected)->_count, LOW, std::memory_order_relaxed);
+                        do if (atomic_compare_exchange_weak(&p, &expected, desired = expected | CNT, std::memory_order_release, std::memory_order_relaxed)) {
+                            if (__builtin_expect((expected & CNT) == 0, false)) // <-- we fixed an exhausted counter
+                                atomic_notify_all(&p);        // <-- notify potential waiters
+                            return{desired, cnt(expected)};
+                        } while (!((expected ^ desired) & PTR)); // <-- while the pointer bits are unchanged
+                        ptr(desired)->release(1 + LOW); // <-- start over
+                    }
+                }
+            } else { // <-- the counter is zero
+                atomic_wait(&p, expected, std::memory_order_relaxed); // <-- until counter may have changed
+                expected = atomic_load(&p, std::memory_order_relaxed);
+            }
+        }
+    }
+     */
+    
+    /*
+    static std::pair<u64, u64> _acquire_specific(u64& p, u64 const specific) {
+        assert(specific & PTR);
+        u64 expected = specific;
+        do {
+            if (__builtin_expect(expected & CNT, true)) {
+                u64 desired = expected - INC;
+                if (atomic_compare_exchange_weak(&p, &expected, desired, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    if (__builtin_expect(expected & desired & CNT, true)) {
+                        assert(!((desired ^ specific) & PTR));
+                        return {desired, 1}; // <-- fast path completes
+                    } else { // <-- count is a power of two, perform housekeeping
+                        expected = desired;
+                        atomic_fetch_add(&ptr(specific)->_count, LOW, std::memory_order_relaxed);
+                        do if (atomic_compare_exchange_weak(&p, &expected, desired = expected | CNT, std::memory_order_release, std::memory_order_relaxed)) {
+                            if (__builtin_expect((expected & CNT) == 0, false)) // <-- we fixed an exhausted counter
+                                atomic_notify_all(&p);        // <-- notify potential waiters
+                            assert(!((desired ^ specific) & PTR));
+                            return{desired, cnt(expected)};
+                        } while (!((expected ^ specific) & PTR)); // <-- while the pointer bits are unchanged
+                        ptr(specific)->release(1 + LOW); // <-- give up
+                    }
+                }
+            } else {
+                atomic_wait(&p, expected, std::memory_order_relaxed);
+                expected = atomic_load(&p, std::memory_order_relaxed);
+            }
+        } while (!((expected ^ specific) & PTR));
+        return {expected, 0};
+    }
+    */
+    
+    // prepare a task node to be linked into the queue
+    static void _init_item(CountedPtr<detail::node<void()>>& z) {
+        
+        assert(z.ptr);
+        assert(z.tag == 0);
+        assert(z.cnt == 1);
+        
+        z->_next = 0;
+        z->_promise = 0;
+        auto MAX = CountedPtr<detail::node<void()>>::MAX;
+        z->_count = MAX * 2;
+        z.cnt = MAX - 1;
+        assert(z->_count == 2 * z.cnt + 2);
+        
+        // over the lifetime of the node,
+        //
+        //           weight    FFFF is assigned to _tail
+        //           weight       1 is assigned to the thread that writes it to _tail
+        //           weight    FFFF is assigned to _head
+        //           weight       1 is assigned to the thread that writes it to _head
+        //                    -----
+        //     total weight   20000 is written to the count
+        //     local weight-1  FFFE is written to the handle
+        //
+        // a thread that does not want to retain the node after writing it
+        // to _head or _tail (as when eagerly advancing _tail) can add its
+        // weight to the write without overflowing the counter
+        
+    }
+    
+    CountedPtr<detail::node<void()>> _pop_promise_or_push_item(CountedPtr<detail::node<void()>> z) const {
+        if (z.ptr)
+            _init_item(z);
+        return _pop_promise_or_push_items(z);
+    }
+    
+    // z is a prepared node, and may head a chain of them linked through
+    // _next, which is pushed with a single CAS
+    CountedPtr<detail::node<void()>> _pop_promise_or_push_items(CountedPtr<detail::node<void()>> z) const {
+        
+        using P = CountedPtr<detail::node<void()>>;
+        
+        P a; // <-- old value of _tail
+        P b; // <-- new value of _tail
+        P c; // <-- old value of _tail->_next
+        P d; // <-- new value of _tail->_next
+        P e; // <-- old value of _tail->_next->_next
+        
+        u64 m = 0; // <-- how much of _tail we own
+        u64 n = 0;
+    
+    _load_tail:
+        a = atomic_load(&_tail, std::memory_order_relaxed);
+    _acquire_tail:
+        assert(m == 0);
+        m = atomic_acquire(&_tail, &a);
+        b = a;
+    _load_next:
+        assert(m > 0);
+        c = atomic_load(&a->_next, std::memory_order_acquire);
+    _classify_next:
+        if (c.ptr == 0)     // <-- end of queue
+            goto _push;
+        else if (c.tag) // <-- stack node
+            goto _acquire_next;
+        else // <-- queue node
+            goto _swing_tail;
+    
+    _push: // add the new node (or, if there is no new node, we failed to try_pop a stack node)
+        if (z.ptr && !atomic_compare_exchange_strong(&a->_next,
+                                                     &c,
+                                                     z,
+                                                     std::memory_order_acq_rel,
+                                                     std::memory_order_relaxed))
+            goto _classify_next;
+        a->release(m);
+        assert(n == 0);
+        return 0;
+    
+    
+    _swing_tail: // move stale tail forwards
+        if (!atomic_compare_exchange_weak(&_tail, &b, c, std::memory_order_release, std::memory_order_relaxed))
+            goto _swing_tail_failed;
+        if (__builtin_expect((b.cnt == 1) && (c.cnt > 1), false))  // <-- we happened to fix a counter
+            atomic_notify_all(&_tail);
+        a->release(m + b.cnt);
+        a = c;
+        b = c;
+        m = 1;
+        goto _load_next;
+    
+    _swing_tail_failed:
+        if (a.ptr != b.ptr)
+            goto _swing_tail_failed_due_to_pointer_change;
+        goto _swing_tail;
+    
+    _swing_tail_failed_due_to_pointer_change:
+        a->release(m);
+        m = 0;
+        a = b;
+        goto _acquire_tail;
+    
+    
+    _acquire_next: // pop stack node
+        assert(m);
+        // std::tie(c, n) = _acquire_specific(ptr(a)->_next, c);
+        n = atomic_compare_acquire_strong(&a->_next, &c);
+        if (n == 0)
+            goto _classify_next;
+        e = atomic_load(&c->_next, std::memory_order_relaxed);
+    _pop_next:
+        d = c;
+        if (!atomic_compare_exchange_weak(&a->_next,
+                                          &d,
+                                          e,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed))
+            goto _pop_next_failed;
+        a->release(m);
+        assert(c.cnt + n <= P::MAX);
+        c.cnt += n;
+        return c;
+    
+    _pop_next_failed:
+        if (c.ptr != d.ptr)
+            goto _pop_next_failed_due_to_pointer_change;
+        else
+            goto _pop_next;
+    
+    _pop_next_failed_due_to_pointer_change:
+        c->release(n);
+        c = d;
+        n = 0;
+        goto _classify_next;
+        
+    };
+    
+    
+    
+    [[nodiscard]] CountedPtr<detail::node<void()>>
+    _pop_item_or_push_promise(CountedPtr<detail::node<void()>> z = 0) const {
+        
+        using P = CountedPtr<detail::node<void()>>;
+        
+        if (z.ptr) {
+            // assert(!(z & ~PTR));
+            assert(z.tag == 0);
+            assert(z.cnt == 1);
+            z->_next = 0;
+            z->_count = P::MAX;
+            z->_promise = 0;
+            z.cnt = P::MAX - 1;
+            assert(z->_count == z.cnt + 1); // <-- submitter retains 1
+        }
+        
+        P  a; // <-- old value of _head
+        P  b; // <-- new value of _head
+        P  c; // <-- old value of _head->_next
+        
+        u64 m = 0;
+    
+    _load_head:
+        a = atomic_load(&_head, std::memory_order_relaxed);
+    _acquire_head:
+        assert(m == 0);
+        m = atomic_acquire(&_head, &a);
+        b = a;
+    _load_next:
+        assert(a.ptr);
+        c = atomic_load(&a->_next, std::memory_order_acquire);
+    _classify_next:
+        //assert((c.ptr && !c.tag) == (c.cnt == P::MAX - 1));
+        if (c.ptr && !c.tag)
+            goto _swing_head;
+    _push: // <-- update _head->_next to push a stack node (or, if there is no stack node provided, try_pop has failed)
+        if (z.ptr) {
+            z.tag = std::min<u64>(c.tag + 1, P::TAG); // <-- use tag bits to track stack depth why not
+            assert(z.tag);
+            z->_next = c;
+            if (!atomic_compare_exchange_strong(&a->_next,
+                                                &c,
+                                                z,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed))
+                goto _classify_next;
+        }
+        a->release(m);
+        m = 0;
+        return 0;
+    
+    _swing_head: // <-- advance head to claim a queue node
+        if (!atomic_compare_exchange_weak(&_head, &b, c, std::memory_order_release, std::memory_order_relaxed))
+            goto _swing_head_failed;
+        if (__builtin_expect((b.cnt == 1) && (c.cnt > 1), false)) // <-- we happened to fix a counter
+            atomic_notify_all(&_head);
+        a->release(b.cnt + m);
+        c.cnt = 1;
+        return c;
+    
+    _swing_head_failed:
+        if (a.ptr != b.ptr)
+            goto _swing_head_failed_due_to_pointer_change;
+        goto _swing_head;
+    
+    _swing_head_failed_due_to_pointer_change:
+        a->release(m);
+        m = 0;
+        a = b;
+        goto _acquire_head;
+        
+    }
+    
+    // try_push fails if no threads are waiting
+    bool try_push(fn<void()>& x) const {
+        assert(x._value.ptr);
+        CountedPtr<detail::node<void()>> waiter = _pop_promise_or_push_item(nullptr); // aka try_pop_waiter
+        if (waiter.ptr) {
+            assert(waiter.ptr);
+            [[maybe_unused]] u64 n = waiter.tag; // <-- there were n waiters (saturating count)
+            atomic_store(&waiter->_promise, std::exchange(x._value, nullptr), std::memory_order_release);
+            atomic_notify_one(&waiter->_promise);
+            waiter->release(waiter.cnt);
+        }
+        return (bool) waiter.ptr;
+    }
+    
+    
+    void push(fn<void()> x) const {
+        assert(x._value.ptr);
+        CountedPtr<detail::node<void()>> waiter = _pop_promise_or_push_item(x._value);
+        if (waiter.ptr) {
+            assert(waiter.ptr);
+            [[maybe_unused]] u64 n = waiter.tag; // <-- there were n waiters (saturating count)
+            atomic_store(&waiter->_promise, std::exchange(x._value, 0), std::memory_order_release);
+            atomic_notify_one(&waiter->_promise);
+            waiter->release(waiter.cnt);
+        } else {
+            x._value = 0; // <-- we gave up ownership
+        }
+    }
+    
+    static void _fulfil(CountedPtr<detail::node<void()>> waiter, CountedPtr<detail::node<void()>> task) {
+        atomic_store(&waiter->_promise, task, std::memory_order_release);
+        atomic_notify_one(&waiter->_promise);
+        waiter->release(waiter.cnt);
+    }
+    
+    // push the tasks in the order they pop from s.  parked waiters are
+    // handed tasks one after another, without allocating; whatever remains
+    // is linked into a chain and appended to the queue with a single CAS,
+    // unless more waiters turn up, who are served from the front of the
+    // chain
+    void push_many(stack<fn<void()>> s) const {
+        using P = CountedPtr<detail::node<void()>>;
+        while (!s.empty()) {
+            P waiter = _pop_promise_or_push_item(nullptr);
+            if (!waiter.ptr)
+                break;
+            fn<void()> f = s.pop();
+            _fulfil(waiter, std::exchange(f._value, nullptr));
+        }
+        if (s.empty())
+            return;
+        // link the rest back to front
+        s.reverse();
+        P first = nullptr;
+        while (!s.empty()) {
+            fn<void()> f = s.pop();
+            P z = std::exchange(f._value, nullptr);
+            _init_item(z);
+            z->_next = first;
+            first = z;
+        }
+        while (P waiter = _pop_promise_or_push_items(first)) {
+            P task{first.ptr}; // <-- a waiter deletes its task directly
+            first = first->_next;
+            _fulfil(waiter, task);
+            if (!first.ptr)
+                return;
+        }
+    }
+    
+    // if result is nonzero it MUST be erased and released
+    //
+    //    if (u64 task = x.try_pop())
+    //        mptr(task)->mut_call_and_erase_and_release
+    //
+    [[nodiscard]] CountedPtr<detail::node<void()>> try_pop() const {
+        return _pop_item_or_push_promise(0);
+    }
+    
+    bool try_pop_and_call() const {
+        auto task = _pop_item_or_push_promise(nullptr);
+        if (task) {
+            assert(task.ptr);
+            task->mut_call_and_erase_and_release(task.cnt);
+        }
+        return (bool) task;
+    }
+    
+    void pop_and_call() const {
+        // a node containing a promise
+        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
+        auto task = _pop_item_or_push_promise(promise.get());
+        if (task) {
+            task->mut_call_and_erase_and_release(task.cnt);
+        } else {
+            detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
+            atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
+            task = atomic_load(&ptr->_promise, std::memory_order_acquire);
+            ptr->release(1);
+            assert(task);
+            task->mut_call_and_erase_and_delete();
+        }
+    }
+    
+    [[noreturn]] void pop_and_call_forever() const {
+        // a node containing a promise
+        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
+        for (;;) {
+            auto task = _pop_item_or_push_promise(promise.get());
+            if (task) {
+                task->mut_call_and_erase_and_release(task.cnt);
+            } else {
+                detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
+                promise.reset(new detail::node<void()>);
+                atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
+                task = atomic_load(&ptr->_promise, std::memory_order_acquire);
+                ptr->release(1);
+                assert(task);
+                task->mut_call_and_erase_and_delete();
+            }
+        }
+    }
+    
+    [[noreturn]] void pop_and_call_forever_with_dispatch() const {
+        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
+        for (;;) {
+            while (!_continuations.empty()) {
+                while (_continuations.size() > 1) {
+                    push(std::move(_continuations.front()));
+                    _continuations.pop_front();
+                }
+                assert(_continuations.size() == 1);
+                if (auto f = try_pop()) {
+                    push(std::move(_continuations.front()));
+                    _continuations.pop_front();
+                    f->mut_call_and_erase_and_release(f.cnt);
+                } else {
+                    fn<void()> g = std::move(_continuations.front());
+                    _continuations.pop_front();
+                    g();
+                }
+            }
+            assert(_continuations.empty() && promise);
+            auto f = _pop_item_or_push_promise(promise.get());
+            if (f) {
+                f->mut_call_and_erase_and_release(f.cnt);
+            } else {
+                detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
+                atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
+                auto g = atomic_load(&ptr->_promise, std::memory_order_acquire);
+                ptr->release(1);
+                g->mut_call_and_erase_and_delete();
+                promise.reset(new detail::node<void()>);
+            }
+        }
+    }
+    
+};
+
+
+
+// work stealing
+//
+// tasks submitted from outside the pool go through the dual, but each worker
+// owns a deque for the tasks it spawns itself (including the continuations
+// deferred to dual::_continuations), so that fork-join work does not
+// contend on the dual's _head and _tail.  a worker runs its own tasks
+// youngest first, checks the dual now and then so that outside work is not
+// starved, and otherwise steals the oldest tasks of its peers before it
+// parks on the dual
+//
+// a worker that spawns a task while others are parked hands a wakeup to one
+// of them through the dual.  a worker about to park first registers as a
+// waiter and then looks again, so that a spawn (or a shutdown) that raced
+// with it is never missed; if it finds a reason to stay awake it hands a
+// wakeup to the dual itself, which may be its own
+//
+// shutdown
+//
+// shutdown marks the pool as stopping and hands a no-op wakeup to each
+// parked worker, so that it looks at the mode:
+//
+//     drain      run the queued work, and any work it spawns, then stop
+//     drop       finish running tasks, then destroy the queued work unrun
+//     immediate  finish running tasks and return at once, leaving the
+//                queued work queued until the pool is destroyed
+//
+// work submitted from outside once shutdown has begun may never run.  the
+// destructor drains, unless the pool was shut down immediately, in which
+// case it destroys whatever is still queued without running it.  drain and
+// drop (and the destructor) join the workers, so they must not be called
+// from a task on the pool itself, which would wait for its own thread.  a
+// task that throws terminates the process, as it would on a std::thread
+//
+// quiesce waits for a moment when every worker is parked and everything
+// submitted through the dual has been taken, which is to say the pool is
+// idle.  it counts submissions through the dual, but not spawns into the
+// deques, which a worker must have run before it can park.  the pool is
+// privately a dual, so that nothing pushes to (or pops from) it without
+// being counted
+//
+// NUMA placement
+//
+// given a topology, the pool pins its workers to CPUs, spread evenly across
+// the nodes, and gives each node a dual of its own (the first node's is the
+// pool itself).  work submitted from outside goes to the dual of the
+// submitter's node.  a worker looks in its own deque, its node's dual and
+// its node's peers before it takes work from other nodes, and parks on its
+// node's dual, so that a submission wakes a local worker if there is one,
+// and otherwise hands a wakeup to another node whose workers come to steal.
+// a worker about to park also looks in the other nodes' duals, and queues
+// anything it finds there for itself
+//
+// priority lanes
+//
+// each node has a dual for each lane; the normal lane is the dual the
+// workers park on, and the others are only ever popped, so submitting to
+// them hands a wakeup to a parked worker.  a worker looks at the urgent lane
+// before anything else, including its own deque, and otherwise looks at the
+// lanes in order.  to keep the lower lanes from starving, every _aging[l]
+// looks it tries lane l first, so that under any load lane l gets at least
+// that share of the turns
+//
+// elastic workers
+//
+// an elastic pool keeps between min and max workers.  it has a slot for
+// each of max, and an empty slot counts as parked.  a supervisor thread
+// samples the pool every interval; when it sees work queued (in the dual or
+// the deques) and no worker parked, twice running, it starts a worker in an
+// empty slot.  when it sees a worker that has been parked longer than the
+// idle timeout, it hands the dual a retire token, and whichever parked
+// worker receives it exits and empties its slot.  the supervisor itself
+// sleeps until poked while the pool is idle at its minimum
+
+struct pool_dual : private dual {
+    
+    enum class shutdown_mode {
+        drain,
+        drop,
+        immediate,
+    };
+    
+    static constexpr u64 RUNNING = 0;
+    static constexpr u64 DRAINING = 1;
+    static constexpr u64 DROPPING = 2;
+    static constexpr u64 STOPPING = 3;
+    
+    struct worker {
+        deque<fn<void()>> _deque;
+        u64 _random; // <-- victim selection
+        u64 _ticks;
+        u64 _looks; // <-- at the lanes
+        unsigned _node;
+        int _cpu; // <-- pinned to, or -1
+        mutable u64 _live = 0; // <-- slot occupied
+        mutable i64 _since = 0; // <-- when it parked, or zero
+        std::thread _thread;
+        
+        worker(u64 seed, unsigned node, int cpu)
+        : _deque()
+        , _random(seed)
+        , _ticks(0)
+        , _looks(0)
+        , _node(node)
+        , _cpu(cpu)
+        , _thread() {
+        }
+    };
+    
+    struct elastic {
+        unsigned min = 1;
+        unsigned max = 4 * std::thread::hardware_concurrency();
+        std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds{10};
+        std::chrono::steady_clock::duration interval = std::chrono::milliseconds{1};
+    };
+    
+    struct node {
+        alignas(64) mutable u64 _idle; // <-- workers parked or about to park
+        alignas(64) mutable u64 _urgent; // <-- tasks in the urgent lane
+        dual const* _queue; // <-- the normal lane, where workers park
+        dual const* _lanes[3];
+        std::vector<worker*> _workers;
+    };
+    
+    // a task taken from one dual to be run elsewhere, which must be
+    // released to the dual it came from even if it never runs
+    struct _transfer {
+        CountedPtr<detail::node<void()>> _task;
+        explicit _transfer(CountedPtr<detail::node<void()>> task) : _task(task) {}
+        _transfer(_transfer&& other) : _task(std::exchange(other._task, nullptr)) {}
+        ~_transfer() {
+            if (_task.ptr)
+                _task->erase_and_release(_task.cnt);
+        }
+        void operator()() {
+            auto task = std::exchange(_task, nullptr);
+            task->mut_call_and_erase_and_release(task.cnt);
+        }
+    };
+    
+    // the pool and worker of the current thread, if any
+    inline thread_local static pool_dual const* _pool = nullptr;
+    inline thread_local static worker* _worker = nullptr;
+    
+    // set by a retire token
+    inline thread_local static bool _retire = false;
+    
+    // how often a worker with local work checks the dual first
+    static constexpr u64 GLOBAL_INTERVAL = 61;
+    
+    bool _stealing;
+    std::vector<std::unique_ptr<dual>> _duals; // <-- all but the first node's normal lane
+    std::vector<std::unique_ptr<node>> _nodes;
+    std::vector<unsigned> _node_of; // <-- by CPU
+    std::vector<std::unique_ptr<worker>> _workers;
+    alignas(64) mutable u64 _parked; // <-- workers parked, or stopped
+    alignas(64) mutable u64 _submitted; // <-- through the duals
+    alignas(64) mutable u64 _taken; // <-- from the duals
+    mutable u64 _stopping;
+    mutable u64 _aging[3] = {0, 8, 32}; // <-- lane first every n looks
+    
+    // elastic only
+    std::unique_ptr<elastic> _elastic;
+    alignas(64) mutable u64 _live; // <-- workers started and not retiring
+    mutable u64 _dozing; // <-- the supervisor waits to be poked
+    mutable std::mutex _mutex;
+    mutable std::condition_variable _condition;
+    std::thread _supervisor;
+    
+    // n unpinned workers sharing the pool's own dual
+    explicit pool_dual(unsigned n = std::thread::hardware_concurrency(), bool stealing = true)
+    : _stealing(stealing)
+    , _parked(0)
+    , _submitted(0)
+    , _taken(0)
+    , _stopping(RUNNING) {
+        _start(n, nullptr);
+    }
+    
+    // n workers pinned to the CPUs of a topology, spread across its nodes,
+    // with a dual per node; n = 0 for one worker per CPU
+    explicit pool_dual(topology const& t, unsigned n = 0)
+    : _stealing(true)
+    , _parked(0)
+    , _submitted(0)
+    , _taken(0)
+    , _stopping(RUNNING) {
+        _start(n ? n : (unsigned) t.cpus(), &t);
+    }
+    
+    // between e.min and e.max unpinned workers, as the load requires
+    explicit pool_dual(elastic e)
+    : _stealing(true)
+    , _parked(0)
+    , _submitted(0)
+    , _taken(0)
+    , _stopping(RUNNING)
+    , _elastic(new elastic(e))
+    , _live(0)
+    , _dozing(0) {
+        assert(e.min && (e.min <= e.max));
+        _start(e.max, nullptr, e.min);
+        _supervisor = std::thread(&pool_dual::_supervise, this);
+    }
+    
+    // n slots, of which the first k start workers
+    void _start(unsigned n, topology const* t, unsigned k = ~0u) {
+        std::size_t nodes = t ? t->nodes() : 1;
+        for (std::size_t i = 0; i != nodes; ++i) {
+            dual const* q = this;
+            if (i)
+                q = _duals.emplace_back(new dual).get();
+            dual const* u = _duals.emplace_back(new dual).get();
+            dual const* b = _duals.emplace_back(new dual).get();
+            _nodes.emplace_back(new node{0, 0, q, {u, q, b}, {}});
+        }
+        // interleave the nodes, so that n workers fill each evenly
+        std::vector<std::pair<unsigned, int>> slots;
+        if (t) {
+            for (std::size_t j = 0; slots.size() != t->cpus(); ++j)
+                for (std::size_t i = 0; i != nodes; ++i)
+                    if (j < t->_nodes[i].size()) {
+                        unsigned c = t->_nodes[i][j];
+                        slots.emplace_back((unsigned) i, (int) c);
+                        if (c >= _node_of.size())
+                            _node_of.resize(c + 1, 0);
+                        _node_of[c] = (unsigned) i;
+                    }
+        } else {
+            slots.emplace_back(0, -1);
+        }
+        for (decltype(n) i = 0; i != n; ++i) {
+            auto [m, c] = slots[i % slots.size()];
+            _workers.emplace_back(new worker(0x9E37'79B9'7F4A'7C15 * (i + 1), m, c));
+            _nodes[m]->_workers.push_back(_workers.back().get());
+        }
+        for (decltype(n) i = 0; i != n; ++i) {
+            if (i < k)
+                _spawn(*_workers[i]);
+            else
+                ++_parked; // <-- an empty slot
+        }
+    }
+    
+    void _spawn(worker& w) {
+        if (w._thread.joinable())
+            w._thread.join(); // <-- retired, and about to return
+        atomic_store(&w._live, (u64) 1, std::memory_order_relaxed);
+        atomic_fetch_add(&_live, (u64) 1, std::memory_order_relaxed);
+        w._thread = std::thread(&pool_dual::_run, this, std::ref(w));
+    }
+    
+    pool_dual(pool_dual const&) = delete;
+    pool_dual& operator=(pool_dual const&) = delete;
+    
+    ~pool_dual() {
+        if (atomic_load(&_stopping, std::memory_order_relaxed) == RUNNING)
+            shutdown(shutdown_mode::drain);
+        _join();
+    }
+    
+    void _join() {
+        assert(_pool != this); // <-- a worker cannot join itself
+        if (_supervisor.joinable())
+            _supervisor.join(); // <-- so that no more workers start
+        for (auto& w : _workers)
+            if (w->_thread.joinable())
+                w->_thread.join();
+    }
+    
+    void shutdown(shutdown_mode mode = shutdown_mode::drain) {
+        u64 s = (mode == shutdown_mode::drain) ? DRAINING : (mode == shutdown_mode::drop) ? DROPPING : STOPPING;
+        u64 expected = RUNNING;
+        if (!atomic_compare_exchange_strong(&_stopping, &expected, s, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return; // <-- already shut down
+        if (_elastic)
+            _poke();
+        // wake the parked workers; any about to park will see _stopping
+        for (auto& m : _nodes) {
+            for (;;) {
+                fn<void()> f{[] {}};
+                if (!_try_push(*m->_queue, f))
+                    break;
+            }
+        }
+        if (mode == shutdown_mode::immediate)
+            return;
+        _join();
+        if (mode == shutdown_mode::drop) {
+            for (auto& m : _nodes)
+                for (dual const* q : m->_lanes)
+                    while (auto task = q->try_pop())
+                        task->erase_and_release(task.cnt);
+            for (auto& w : _workers)
+                while (w->_deque.pop())
+                    ;
+        }
+    }
+    
+    void quiesce() const {
+        u64 n = _workers.size();
+        for (;;) {
+            u64 taken = atomic_load(&_taken, std::memory_order_seq_cst);
+            u64 parked = atomic_load(&_parked, std::memory_order_seq_cst);
+            u64 submitted = atomic_load(&_submitted, std::memory_order_seq_cst);
+            if ((parked == n) && ((taken == submitted) || atomic_load(&_stopping, std::memory_order_relaxed)))
+                return;
+            if (parked != n)
+                atomic_wait(&_parked, parked, std::memory_order_relaxed);
+            else
+                std::this_thread::yield(); // <-- a handoff is in flight
+        }
+    }
+    
+    static pool_dual const& _get() {
+        static pool_dual p;
+        return p;
+    }
+    
+    // blocking I/O gets its own threads, so that the CPU workers above are
+    // never stuck waiting for a disk.  the number is fixed, so a flood of
+    // requests queues up rather than spawning threads
+    static pool_dual const& _get_blocking() {
+        static pool_dual p(4);
+        return p;
+    }
+    
+    // the node of the calling thread
+    node const& _home() const {
+        if (_pool == this)
+            return *_nodes[_worker->_node];
+        if (_nodes.size() == 1)
+            return *_nodes[0];
+        int c = topology::current_cpu();
+        return *_nodes[((c >= 0) && ((std::size_t) c < _node_of.size())) ? _node_of[c] : 0];
+    }
+    
+    // the pool's own dual, which is the first node's normal lane
+    dual const& _dual() const {
+        return *this;
+    }
+    
+    // submissions through the duals are counted for quiesce
+    
+    void _push(dual const& q, fn<void()> f) const {
+        atomic_fetch_add(&_submitted, (u64) 1, std::memory_order_seq_cst);
+        q.push(std::move(f));
+    }
+    
+    bool _try_push(dual const& q, fn<void()>& f) const {
+        atomic_fetch_add(&_submitted, (u64) 1, std::memory_order_seq_cst);
+        if (q.try_push(f))
+            return true;
+        atomic_fetch_add(&_taken, (u64) 1, std::memory_order_seq_cst); // <-- never was
+        return false;
+    }
+    
+    void _push_many(dual const& q, stack<fn<void()>> s) const {
+        u64 n = 0;
+        for ([[maybe_unused]] auto& x : s)
+            ++n;
+        atomic_fetch_add(&_submitted, n, std::memory_order_seq_cst);
+        q.push_many(std::move(s));
+    }
+    
+    void submit(fn<void()> f) const {
+        if (_pool != this) {
+            node const& h = _home();
+            if ((_nodes.size() != 1) && _try_push(*h._queue, f))
+                return; // <-- handed to a local worker
+            _push(*h._queue, std::move(f));
+            if (_elastic && atomic_load(&_dozing, std::memory_order_seq_cst))
+                _poke();
+            return _wake_remote(h);
+        }
+        _worker->_deque.push(std::move(f));
+        _wake();
+    }
+    
+    void submit(fn<void()> f, lane l) const {
+        if (l == lane::normal)
+            return submit(std::move(f));
+        // priority beats locality, so this goes to the lane even from a
+        // worker
+        node const& h = _home();
+        if (l == lane::urgent)
+            atomic_fetch_add(&h._urgent, (u64) 1, std::memory_order_relaxed);
+        _push(*h._lanes[(int) l], std::move(f));
+        if (_elastic && atomic_load(&_dozing, std::memory_order_seq_cst))
+            _poke();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_wake(h))
+            return;
+        for (auto& m : _nodes)
+            if ((m.get() != &h) && _wake(*m))
+                return;
+    }
+    
+    // lane l is looked at first every n looks; zero for never
+    void aging(lane l, u64 n) const {
+        atomic_store(&_aging[(int) l], n, std::memory_order_relaxed);
+    }
+    
+    // in the order they were pushed onto s
+    void submit_many(stack<fn<void()>> s) const {
+        s.reverse();
+        if (_pool != this) {
+            node const& h = _home();
+            _push_many(*h._queue, std::move(s));
+            if (_elastic && atomic_load(&_dozing, std::memory_order_seq_cst))
+                _poke();
+            return _wake_remote(h);
+        }
+        while (!s.empty())
+            _worker->_deque.push(s.pop());
+        _wake();
+    }
+    
+    void _poke() const {
+        std::unique_lock lock{_mutex};
+        atomic_store(&_dozing, (u64) 0, std::memory_order_relaxed);
+        _condition.notify_one();
+    }
+    
+    static i64 _now() {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    
+    void _supervise() {
+        elastic const& e = *_elastic;
+        node const& h = *_nodes[0];
+        u64 n = _workers.size();
+        int backlogged = 0;
+        std::unique_lock lock{_mutex};
+        while (!atomic_load(&_stopping, std::memory_order_relaxed)) {
+            u64 live = atomic_load(&_live, std::memory_order_relaxed);
+            
+            // retire the workers parked longer than the idle timeout
+            i64 now = _now();
+            for (auto& w : _workers) {
+                if (live <= e.min)
+                    break;
+                i64 since = atomic_load(&w->_since, std::memory_order_relaxed);
+                if (!since || (now - since < e.idle_timeout.count()))
+                    continue;
+                // any parked worker may take the token; it is all the same
+                fn<void()> f{[] { _retire = true; }};
+                atomic_fetch_sub(&_live, (u64) 1, std::memory_order_relaxed);
+                if (!_try_push(*h._queue, f)) {
+                    atomic_fetch_add(&_live, (u64) 1, std::memory_order_relaxed);
+                    break;
+                }
+                --live;
+            }
+            
+            // start a worker when work has waited for one twice running
+            bool waiting = (atomic_load(&_submitted, std::memory_order_seq_cst)
+                            != atomic_load(&_taken, std::memory_order_seq_cst)) || _any();
+            if (waiting && !atomic_load(&h._idle, std::memory_order_seq_cst))
+                ++backlogged;
+            else
+                backlogged = 0;
+            if ((backlogged >= 2) && (live < e.max)) {
+                for (auto& w : _workers)
+                    if (!atomic_load(&w->_live, std::memory_order_acquire)) {
+                        atomic_fetch_sub(&_parked, (u64) 1, std::memory_order_seq_cst);
+                        _spawn(*w);
+                        break;
+                    }
+                backlogged = 0;
+            }
+            
+            if (atomic_load(&_parked, std::memory_order_seq_cst) != n) {
+                _condition.wait_for(lock, e.interval); // <-- busy; sample
+            } else if (live > e.min) {
+                _condition.wait_for(lock, e.idle_timeout); // <-- idle; retire
+            } else {
+                // idle at the minimum; doze until a submission pokes us,
+                // checking again in case one raced with us
+                atomic_store(&_dozing, (u64) 1, std::memory_order_seq_cst);
+                if ((atomic_load(&_submitted, std::memory_order_seq_cst)
+                     != atomic_load(&_taken, std::memory_order_seq_cst))
+                    || (atomic_load(&_parked, std::memory_order_seq_cst) != n))
+                    atomic_store(&_dozing, (u64) 0, std::memory_order_relaxed);
+                _condition.wait(lock, [this] {
+                    return !atomic_load(&_dozing, std::memory_order_relaxed)
+                    || atomic_load(&_stopping, std::memory_order_relaxed);
+                });
+            }
+        }
+    }
+    
+    // whether more pieces of work would find takers: a worker is parked, or
+    // thieves have emptied our deque
+    bool _hungry() const {
+        for (auto& m : _nodes)
+            if (atomic_load(&m->_idle, std::memory_order_relaxed))
+                return true;
+        return (_pool == this) && _worker->_deque.empty();
+    }
+    
+    // run one task on the calling thread, for a thread waiting on work in
+    // the pool; false if there was none to be found
+    bool _help() const {
+        if (_pool == this) {
+            worker& w = *_worker;
+            if (auto f = w._deque.pop())
+                return _call(w, std::move(f)), true;
+            if (auto task = _try_pop_lanes(*_nodes[w._node], w))
+                return _call(w, task), true;
+            if (auto f = _steal(w, true))
+                return _call(w, std::move(f)), true;
+            if (auto task = _try_pop_remote(w))
+                return _call(w, task), true;
+            if (auto f = _steal(w, false))
+                return _call(w, std::move(f)), true;
+            return false;
+        }
+        node const& h = _home();
+        CountedPtr<detail::node<void()>> task = nullptr;
+        for (int l = 0; !task && (l != 3); ++l)
+            task = _try_pop_lane(h, l);
+        if (task) {
+            atomic_fetch_add(&_taken, (u64) 1, std::memory_order_seq_cst);
+            task->mut_call_and_erase_and_release(task.cnt);
+        } else {
+            fn<void()> f;
+            for (auto& w : _workers)
+                if ((f = w->_deque.steal()))
+                    break;
+            if (!f)
+                return false;
+            f();
+        }
+        // continuations go to the dual, as from any outside thread
+        if (!_continuations.empty()) {
+            stack<fn<void()>> s;
+            while (!_continuations.empty()) {
+                s.push(std::move(_continuations.back()));
+                _continuations.pop_back();
+            }
+            _push_many(*h._queue, std::move(s));
+        }
+        return true;
+    }
+    
+    // workers running or parked
+    u64 threads() const {
+        u64 n = 0;
+        for (auto& w : _workers)
+            n += atomic_load(&w->_live, std::memory_order_acquire);
+        return n;
+    }
+    
+    // hand a wakeup to a parked worker of node m, if there is one
+    bool _wake(node const& m) const {
+        if (!atomic_load(&m._idle, std::memory_order_relaxed))
+            return false;
+        fn<void()> f{[] {}};
+        return _try_push(*m._queue, f);
+    }
+    
+    // after queueing work on a node with no parked workers, hand a wakeup
+    // to another node, whose workers will come to steal
+    void _wake_remote(node const& h) const {
+        if (_nodes.size() == 1)
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(auto& m : _nodes)
+            if ((m.get() != &h) && _wake(*m))
+                return;
+    }
+    
+    // after spawning work into our deque, hand a wakeup to a parked worker,
+    // local if possible
+    void _wake() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        node const& h = *_nodes[_worker->_node];
+        if (_wake(h))
+            return;
+        for (auto& m : _nodes)
+            if ((m.get() != &h) && _wake(*m))
+                return;
+    }
+    
+    bool _any() const {
+        for (auto& w : _workers)
+            if (!w->_deque.empty())
+                return true;
+        return false;
+    }
+    
+    // steal from the peers on our node, or on the other nodes
+    fn<void()> _steal(worker& w, bool local) const {
+        // xorshift
+        w._random ^= w._random << 13;
+        w._random ^= w._random >> 7;
+        w._random ^= w._random << 17;
+        std::size_t n = _workers.size();
+        std::size_t k = w._random % n;
+        for (std::size_t i = 0; i != n; ++i) {
+            auto& v = *_workers[(k + i) % n];
+            if ((&v != &w) && ((v._node == w._node) == local))
+                if (auto f = v._deque.steal())
+                    return f;
+        }
+        return fn<void()>{};
+    }
+    
+    CountedPtr<detail::node<void()>> _try_pop_lane(node const& m, int l) const {
+        if ((l == (int) lane::urgent) && !atomic_load(&m._urgent, std::memory_order_relaxed))
+            return nullptr;
+        auto task = m._lanes[l]->try_pop();
+        if (task && (l == (int) lane::urgent))
+            atomic_fetch_sub(&m._urgent, (u64) 1, std::memory_order_relaxed);
+        return task;
+    }
+    
+    // the lanes in order, except that a lower lane goes first on its turn
+    CountedPtr<detail::node<void()>> _try_pop_lanes(node const& m, worker& w) const {
+        u64 t = ++w._looks;
+        int first = 0;
+        for (int l = 2; l; --l) {
+            u64 n = atomic_load(&_aging[l], std::memory_order_relaxed);
+            if (n && !(t % n)) {
+                first = l;
+                break;
+            }
+        }
+        if (auto task = _try_pop_lane(m, first))
+            return task;
+        for (int l = 0; l != 3; ++l)
+            if (l != first)
+                if (auto task = _try_pop_lane(m, l))
+                    return task;
+        return nullptr;
+    }
+    
+    CountedPtr<detail::node<void()>> _try_pop_remote(worker& w) const {
+        for (auto& m : _nodes)
+            if (m.get() != _nodes[w._node].get())
+                if (auto task = _try_pop_lanes(*m, w))
+                    return task;
+        return nullptr;
+    }
+    
+    // deferred continuations go to the bottom of our deque, oldest first,
+    // so we run the youngest next and thieves take the oldest
+    void _defer(worker& w) const {
+        if (_continuations.empty())
+            return;
+        if (_pool != this) {
+            stack<fn<void()>> s;
+            while (!_continuations.empty()) {
+                s.push(std::move(_continuations.back()));
+                _continuations.pop_back();
+            }
+            return _push_many(*_nodes[w._node]->_queue, std::move(s));
+        }
+        while (!_continuations.empty()) {
+            w._deque.push(std::move(_continuations.front()));
+            _continuations.pop_front();
+        }
+        _wake();
+    }
+    
+    void _call(worker& w, fn<void()> f) const {
+        f();
+        _defer(w);
+    }
+    
+    // tasks popped from a dual carry a share of its reference counts
+    void _call(worker& w, CountedPtr<detail::node<void()>> task) const {
+        atomic_fetch_add(&_taken, (u64) 1, std::memory_order_seq_cst);
+        task->mut_call_and_erase_and_release(task.cnt);
+        _defer(w);
+    }
+    
+    void _run(worker& w) const {
+        if (w._cpu >= 0)
+            (void) topology::pin((unsigned) w._cpu);
+        if (_stealing) {
+            _pool = this;
+            _worker = &w;
+        }
+        node const& h = *_nodes[w._node];
+        dual const& q = *h._queue;
+        std::unique_ptr<detail::node<void()>> promise{new detail::node<void()>};
+        for (;;) {
+            u64 stopping = atomic_load(&_stopping, std::memory_order_acquire);
+            if (stopping > DRAINING)
+                break;
+            if (!(++w._ticks % GLOBAL_INTERVAL)) {
+                if (auto task = _try_pop_lanes(h, w)) {
+                    _call(w, task);
+                    continue;
+                }
+            } else if (auto task = _try_pop_lane(h, (int) lane::urgent)) {
+                _call(w, task);
+                continue;
+            }
+            if (auto f = w._deque.pop()) {
+                _call(w, std::move(f));
+                continue;
+            }
+            if (auto task = _try_pop_lanes(h, w)) {
+                _call(w, task);
+                continue;
+            }
+            if (auto f = _steal(w, true)) {
+                _call(w, std::move(f));
+                continue;
+            }
+            if (auto task = _try_pop_remote(w)) {
+                _call(w, task);
+                continue;
+            }
+            if (auto f = _steal(w, false)) {
+                _call(w, std::move(f));
+                continue;
+            }
+            if (stopping)
+                break; // <-- drained all we can see
+            atomic_fetch_add(&h._idle, (u64) 1, std::memory_order_seq_cst);
+            if (auto task = q._pop_item_or_push_promise(promise.get())) {
+                atomic_fetch_sub(&h._idle, (u64) 1, std::memory_order_relaxed);
+                _call(w, task);
+                continue;
+            }
+            detail::node<void()> const* ptr = promise.release(); // <-- now managed by queue
+            promise.reset(new detail::node<void()>);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto found = _try_pop_lanes(h, w); // <-- the other lanes
+            if (!found)
+                found = _try_pop_remote(w);
+            if (found) {
+                // we can't run it while we wait, so queue it for ourselves
+                atomic_fetch_add(&_taken, (u64) 1, std::memory_order_seq_cst);
+                _push(q, _transfer{found});
+            } else if (_any() || atomic_load(&_stopping, std::memory_order_relaxed)) {
+                _push(q, [] {}); // <-- someone must come back for it
+            }
+            if (_elastic)
+                atomic_store(&w._since, _now(), std::memory_order_relaxed);
+            if (atomic_fetch_add(&_parked, (u64) 1, std::memory_order_seq_cst) + 1 == _workers.size())
+                atomic_notify_all(&_parked);
+            atomic_wait(&ptr->_promise, 0, std::memory_order_relaxed);
+            atomic_store(&w._since, (i64) 0, std::memory_order_relaxed);
+            auto task = atomic_load(&ptr->_promise, std::memory_order_acquire);
+            ptr->release(1);
+            atomic_fetch_sub(&_parked, (u64) 1, std::memory_order_seq_cst);
+            atomic_fetch_sub(&h._idle, (u64) 1, std::memory_order_relaxed);
+            atomic_fetch_add(&_taken, (u64) 1, std::memory_order_seq_cst);
+            assert(task);
+            _call(w, fn<void()>{task});
+            if (_retire) {
+                _retire = false;
+                break;
+            }
+        }
+        // a stopped or retired worker counts as parked
+        if (atomic_fetch_add(&_parked, (u64) 1, std::memory_order_seq_cst) + 1 == _workers.size())
+            atomic_notify_all(&_parked);
+        atomic_store(&w._live, (u64) 0, std::memory_order_release);
+    }
+    
+};
+
 #endif /* dual_hpp */
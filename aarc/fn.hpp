@@ -118,6 +118,12 @@ namespace detail {
         virtual R mut_call_and_erase_and_delete(Args...) { abort(); }
         virtual R mut_call_and_erase_and_release(u64 n, Args...) { abort(); }
         
+        // timers may be cancelled (see reactor.hpp); an expiring timer
+        // yields the node to call, or nullptr, and gives up its ownership of
+        // itself
+        virtual bool cancelled() const { return false; }
+        virtual node* expire() { return this; }
+        
     }; // node
     
     template<typename F, typename T>
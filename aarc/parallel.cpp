@@ -0,0 +1,158 @@
+//
+//  parallel.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "parallel.hpp"
+
+#include <catch2/catch.hpp>
+
+TEST_CASE("parallel", "[parallel]") {
+    
+    pool_dual p(4);
+    
+    {
+        // every index exactly once, whatever the grain
+        for (std::size_t n : { 0, 1, 7, 1000, 100'000 }) {
+            for (std::size_t grain : { 0, 1, 3, 64 }) {
+                std::vector<std::atomic<int>> v(n);
+                parallel_for(0, n, grain, [&](std::size_t i, std::size_t j) {
+                    for (; i != j; ++i)
+                        v[i].fetch_add(1, std::memory_order_relaxed);
+                }, p);
+                REQUIRE(std::all_of(v.begin(), v.end(), [](auto& x) { return x.load() == 1; }));
+            }
+        }
+    }
+    
+    {
+        // and from inside the pool, where the caller helps rather than
+        // blocking a worker
+        std::atomic<u64> sum{0};
+        std::atomic<int> done{0};
+        for (int k = 0; k != 8; ++k)
+            p.submit([&] {
+                parallel_for(0, 10'000, 0, [&](std::size_t i, std::size_t j) {
+                    u64 s = 0;
+                    for (; i != j; ++i)
+                        s += i;
+                    sum.fetch_add(s, std::memory_order_relaxed);
+                }, p);
+                done.fetch_add(1, std::memory_order_release);
+            });
+        while (done.load(std::memory_order_acquire) != 8)
+            std::this_thread::yield();
+        REQUIRE(sum.load() == 8 * (u64) 9'999 * 10'000 / 2);
+    }
+    
+    {
+        u64 n = 1'000'000;
+        u64 sum = parallel_reduce(0, n, 0, (u64) 0, [](std::size_t i, std::size_t j) {
+            u64 s = 0;
+            for (; i != j; ++i)
+                s += i;
+            return s;
+        }, std::plus<>{}, p);
+        REQUIRE(sum == n * (n - 1) / 2);
+        REQUIRE(parallel_reduce(5, 5, 0, 42, [](std::size_t, std::size_t) { return 0; }, std::plus<>{}, p) == 42);
+    }
+    
+    {
+        std::mt19937_64 g(7);
+        for (std::size_t n : { 0, 1, 100, 8191, 8192, 100'000, 123'457 }) {
+            for (u64 range : { 10, 1'000'000'000 }) {
+                std::vector<u64> v(n);
+                for (auto& x : v)
+                    x = g() % range;
+                auto w = v;
+                std::sort(w.begin(), w.end());
+                parallel_sort(v.begin(), v.end(), std::less<>{}, p);
+                REQUIRE(v == w);
+            }
+        }
+        // with a comparator, and non-trivial values
+        std::vector<std::string> v(50'000);
+        for (auto& s : v)
+            s = std::to_string(g() % 100'000);
+        auto w = v;
+        std::sort(w.begin(), w.end(), std::greater<>{});
+        parallel_sort(v.begin(), v.end(), std::greater<>{}, p);
+        REQUIRE(v == w);
+    }
+    
+    {
+        // values that cannot be default-constructed
+        struct key {
+            u64 x;
+            explicit key(u64 x) : x(x) {}
+            bool operator<(key const& other) const { return x < other.x; }
+        };
+        std::mt19937_64 g(11);
+        std::vector<key> v;
+        for (int i = 0; i != 50'000; ++i)
+            v.emplace_back(g() % 1'000);
+        parallel_sort(v.begin(), v.end(), std::less<>{}, p);
+        REQUIRE(std::is_sorted(v.begin(), v.end()));
+    }
+    
+    {
+        // non-trivial partial results, combined at every split
+        std::size_t n = 100'000;
+        auto s = parallel_reduce(0, n, 1, std::string{}, [](std::size_t i, std::size_t j) {
+            return std::string(j - i, 'x');
+        }, [](std::string a, std::string b) { return a + b; }, p);
+        REQUIRE(s.size() == n);
+    }
+    
+}
+
+TEST_CASE("parallel-bench", "[parallel][.bench]") {
+    
+    // 10^8 elements, on pools of t - 1 workers plus the calling thread
+    
+    using namespace std::chrono;
+    
+    std::size_t n = 100'000'000;
+    std::vector<std::uint32_t> data(n);
+    std::vector<std::uint32_t> copy(n);
+    std::mt19937 g(1);
+    for (auto& x : copy)
+        x = g();
+    unsigned hw = std::thread::hardware_concurrency();
+    for (unsigned t = 1; t <= std::max(hw, 4u); t *= 2) {
+        pool_dual p(t - 1);
+        auto a = steady_clock::now();
+        parallel_for(0, n, 0, [&](std::size_t i, std::size_t j) {
+            for (; i != j; ++i)
+                data[i] = copy[i] * 2654435761u + 1;
+        }, p);
+        auto b = steady_clock::now();
+        u64 sum = parallel_reduce(0, n, 0, (u64) 0, [&](std::size_t i, std::size_t j) {
+            u64 s = 0;
+            for (; i != j; ++i)
+                s += data[i];
+            return s;
+        }, std::plus<>{}, p);
+        auto c = steady_clock::now();
+        data = copy;
+        auto d = steady_clock::now();
+        parallel_sort(data.begin(), data.end(), std::less<>{}, p);
+        auto e = steady_clock::now();
+        REQUIRE(std::is_sorted(data.begin(), data.end()));
+        printf("%2u threads: for %7.1f ms, reduce %7.1f ms (%llu), sort %8.1f ms\n", t,
+               duration<double, std::milli>(b - a).count(),
+               duration<double, std::milli>(c - b).count(),
+               (unsigned long long) (sum & 0xFFFF),
+               duration<double, std::milli>(e - d).count());
+    }
+    
+}
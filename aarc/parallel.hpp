@@ -0,0 +1,277 @@
+//
+//  parallel.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+
+#include "atomic.hpp"
+#include "dual.hpp"
+#include "maybe.hpp"
+
+// data parallelism
+//
+// parallel_for, parallel_reduce and parallel_sort split a range of indices
+// recursively across the pool.  splitting is lazy: a thread working through
+// a range splits off half of what it has left only when the pool is hungry,
+// which is to say a worker is parked or thieves have emptied its deque, and
+// otherwise works through the range a grain at a time, looking again
+// between grains.  so a busy pool sees few tasks, and an idle one is fed
+// halves until every worker has some; the grain is only the smallest piece,
+// and by default is an eighth of an even share
+//
+// the calling thread works on the range too, and once it has run out, runs
+// other pool tasks (stealing them if need be) until the whole range is done,
+// sleeping only when there is nothing to help with.  this also makes them
+// safe to call from inside a pool task
+//
+// parallel_reduce takes no lock: partial results are combined pairwise as
+// the halves of each split finish, so the combines form a tree
+
+namespace detail {
+    
+    // the caller helps until the job's future is ready.  the last piece to
+    // finish readies it, which is its last touch of the job, so the job may
+    // live in the caller's frame
+    template<typename R>
+    R parallel_wait(std::future<R>& done, pool_dual const& pool) {
+        while ((done.wait_for(std::chrono::seconds{0}) != std::future_status::ready) && pool._help())
+            ;
+        return done.get();
+    }
+    
+    template<typename F>
+    struct parallel_job {
+        
+        pool_dual const* _pool;
+        std::size_t _grain;
+        F const* _f;
+        mutable u64 _pending; // <-- indices not yet done
+        mutable std::promise<void> _done;
+        
+        void _work(std::size_t first, std::size_t last) const {
+            while (last - first > _grain) {
+                if (_pool->_hungry()) {
+                    std::size_t middle = first + (last - first) / 2;
+                    _pool->submit([this, middle, last] { _work(middle, last); });
+                    last = middle;
+                } else {
+                    (*_f)(first, first + _grain);
+                    _finish(_grain);
+                    first += _grain;
+                }
+            }
+            (*_f)(first, last);
+            _finish(last - first); // <-- may be the last touch of *this
+        }
+        
+        void _finish(std::size_t n) const {
+            if (atomic_fetch_sub(&_pending, (u64) n, std::memory_order_acq_rel) == n)
+                _done.set_value();
+        }
+        
+    };
+    
+    // each piece folds its grains into a partial result.  a piece that
+    // splits becomes the left half of a join, and the split-off piece the
+    // right; whichever half arrives second combines the two and carries the
+    // result up to the parent join, until the last arrives at the root
+    template<typename T, typename F, typename Combine>
+    struct reduce_job {
+        
+        struct join {
+            join* _parent;
+            int _side; // <-- of the parent
+            u64 _arrived;
+            maybe<T> _halves[2];
+        };
+        
+        pool_dual const* _pool;
+        std::size_t _grain;
+        F const* _f;
+        Combine const* _combine;
+        mutable std::promise<T> _done;
+        
+        void _work(std::size_t first, std::size_t last, join* parent, int side) const {
+            std::size_t n = std::min(last - first, _grain);
+            T x = (*_f)(first, first + n);
+            first += n;
+            while (first != last) {
+                if ((last - first > _grain) && _pool->_hungry()) {
+                    std::size_t middle = first + (last - first) / 2;
+                    auto j = new join{parent, side, 0, {}};
+                    _pool->submit([this, middle, last, j] { _work(middle, last, j, 1); });
+                    parent = j;
+                    side = 0;
+                    last = middle;
+                } else {
+                    n = std::min(last - first, _grain);
+                    T y = (*_f)(first, first + n);
+                    x = (*_combine)(std::move(x), std::move(y));
+                    first += n;
+                }
+            }
+            _arrive(std::move(x), parent, side);
+        }
+        
+        void _arrive(T x, join* j, int side) const {
+            while (j) {
+                j->_halves[side].emplace(std::move(x));
+                if (!atomic_fetch_add(&j->_arrived, (u64) 1, std::memory_order_acq_rel))
+                    return; // <-- the other half will combine
+                x = (*_combine)(std::move(j->_halves[0].value), std::move(j->_halves[1].value));
+                j->_halves[0].erase();
+                j->_halves[1].erase();
+                side = j->_side;
+                delete std::exchange(j, j->_parent);
+            }
+            _done.set_value(std::move(x)); // <-- the last touch of *this
+        }
+        
+    };
+    
+    inline std::size_t parallel_grain(std::size_t n, pool_dual const& pool) {
+        return std::max<std::size_t>(1, n / (8 * (pool._workers.size() + 1)));
+    }
+    
+    // the number of elements of a in the first d of merge(a, b), taking
+    // from a first on ties
+    template<typename It, typename Compare>
+    std::size_t co_rank(std::size_t d, It a, std::size_t m, It b, std::size_t n, Compare& comp) {
+        std::size_t lo = (d > n) ? d - n : 0;
+        std::size_t hi = std::min(d, m);
+        while (lo < hi) {
+            std::size_t i = lo + (hi - lo) / 2;
+            if (comp(b[d - i - 1], a[i]))
+                hi = i;
+            else
+                lo = i + 1;
+        }
+        return lo;
+    }
+    
+    // std::merge into uninitialized storage
+    template<typename It, typename T, typename Compare>
+    T* uninitialized_merge(It a, It a_end, It b, It b_end, T* out, Compare& comp) {
+        for (; a != a_end; ++out) {
+            if (b == b_end)
+                return std::uninitialized_copy(a, a_end, out);
+            if (comp(*b, *a))
+                ::new ((void*) out) T(*b++);
+            else
+                ::new ((void*) out) T(*a++);
+        }
+        return std::uninitialized_copy(b, b_end, out);
+    }
+    
+} // namespace detail
+
+// f(i, j) for disjoint [i, j) covering [first, last); grain 0 for the default
+template<typename F>
+void parallel_for(std::size_t first, std::size_t last, std::size_t grain, F f,
+                  pool_dual const& pool = pool_dual::_get()) {
+    if (first == last)
+        return;
+    if (!grain)
+        grain = detail::parallel_grain(last - first, pool);
+    detail::parallel_job<F> job{&pool, grain, &f, last - first, {}};
+    auto done = job._done.get_future();
+    job._work(first, last);
+    detail::parallel_wait(done, pool);
+}
+
+// combine(..., f(i, j)) over disjoint [i, j) covering [first, last), in no
+// particular order, so combine must be associative and commutative
+template<typename T, typename F, typename Combine>
+T parallel_reduce(std::size_t first, std::size_t last, std::size_t grain,
+                  T identity, F f, Combine combine,
+                  pool_dual const& pool = pool_dual::_get()) {
+    if (first == last)
+        return identity;
+    if (!grain)
+        grain = detail::parallel_grain(last - first, pool);
+    detail::reduce_job<T, F, Combine> job{&pool, grain, &f, &combine, {}};
+    auto done = job._done.get_future();
+    job._work(first, last, nullptr, 0);
+    return combine(std::move(identity), detail::parallel_wait(done, pool));
+}
+
+// merge sort: sort a few runs per thread, then merge them pairwise, back and
+// forth through a buffer, splitting each merge by output position so that
+// the last merges are as parallel as the first.  the buffer is constructed
+// by the first merge, so T need only be copyable.  not stable
+template<typename It, typename Compare = std::less<>>
+void parallel_sort(It first, It last, Compare comp = Compare{},
+                   pool_dual const& pool = pool_dual::_get()) {
+    using T = typename std::iterator_traits<It>::value_type;
+    std::size_t n = last - first;
+    std::size_t threads = pool._workers.size() + 1;
+    if ((threads == 1) || (n < 8192))
+        return std::sort(first, last, comp);
+    std::size_t k = 1;
+    while (k < 4 * threads)
+        k *= 2;
+    std::size_t w = (n + k - 1) / k;
+    assert(w < n); // <-- so the first merge constructs the whole buffer
+    parallel_for(0, k, 1, [&](std::size_t i, std::size_t j) {
+        for (; i != j; ++i)
+            std::sort(first + std::min(i * w, n), first + std::min((i + 1) * w, n), comp);
+    }, pool);
+    std::allocator<T> allocator;
+    T* buffer = allocator.allocate(n);
+    auto merge = [&](auto src, auto dst, auto&& merge_into) {
+        parallel_for(0, n, 0, [&](std::size_t lo, std::size_t hi) {
+            while (lo != hi) {
+                std::size_t base = lo / (2 * w) * (2 * w);
+                std::size_t middle = std::min(base + w, n);
+                std::size_t end = std::min(base + 2 * w, n);
+                std::size_t d0 = lo - base;
+                std::size_t d1 = std::min(hi, end) - base;
+                auto a = src + base;
+                auto b = src + middle;
+                std::size_t i0 = detail::co_rank(d0, a, middle - base, b, end - middle, comp);
+                std::size_t i1 = detail::co_rank(d1, a, middle - base, b, end - middle, comp);
+                // copy, not move: other pieces may still be searching src
+                merge_into(a + i0, a + i1, b + (d0 - i0), b + (d1 - i1), dst + base + d0);
+                lo = base + d1;
+            }
+        }, pool);
+    };
+    auto assign = [&](auto a, auto a_end, auto b, auto b_end, auto out) {
+        std::merge(a, a_end, b, b_end, out, comp);
+    };
+    auto construct = [&](auto a, auto a_end, auto b, auto b_end, auto out) {
+        detail::uninitialized_merge(a, a_end, b, b_end, out, comp);
+    };
+    merge(first, buffer, construct);
+    bool buffered = true;
+    for (w *= 2; w < n; w *= 2) {
+        if (buffered)
+            merge(buffer, first, assign);
+        else
+            merge(first, buffer, assign);
+        buffered = !buffered;
+    }
+    if (buffered || !std::is_trivially_destructible_v<T>)
+        parallel_for(0, n, 0, [&](std::size_t i, std::size_t j) {
+            if (buffered)
+                std::move(buffer + i, buffer + j, first + i);
+            std::destroy(buffer + i, buffer + j);
+        }, pool);
+    allocator.deallocate(buffer, n);
+}
+
+#endif /* parallel_hpp */
@@ -22,5 +22,18 @@
 void pool_submit_one(fn<void()> f);
 void pool_submit_many(stack<fn<void()>> s);
 
+// workers drain the higher lanes first, but give the lower lanes a turn now
+// and then so they are never starved (see pool_dual::aging)
+enum class lane {
+    urgent,
+    normal,
+    background,
+};
+
+void pool_submit_one(fn<void()> f, lane l);
+
+// run a task that may block in a syscall on the blocking-I/O threads
+void offload_submit(fn<void()> f);
+
 
 #endif /* pool_hpp */
@@ -6,149 +6,1725 @@
 //  Copyright © 2020 Antony Searle. All rights reserved.
 //
 
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
 #include "reactor.hpp"
 
 #include <catch2/catch.hpp>
 
-reactor::reactor()
-: _cancelled_and_notifications{0} {
-    if (pipe(_pipe) != 0) {
+namespace {
+    
+    // admit new timers, move expired timers to pending, and return the
+    // microseconds until the next timer event (or -1 if there are none)
+    
+    std::int64_t _expire(reactor const& r,
+                         wheel& timers,
+                         stack<fn<void()>> stale,
+                         stack<fn<void()>>& pending) {
+        while (!stale.empty())
+            timers.insert(stale.pop());
+        auto now = std::chrono::steady_clock::now();
+        auto next = timers.expire(now, pending, [&](auto t) {
+            if constexpr (reactor_stats::enabled)
+                r._stats->timer_lateness_ns.record(now - t);
+        });
+        if (next == std::chrono::steady_clock::time_point::max())
+            return -1;
+        return std::chrono::ceil<std::chrono::microseconds>(next - now).count();
+    }
+    
+    // hand the pending tasks to the pool.  the dispatch probe goes last, so
+    // it measures how long the pool takes to start the whole batch
+    
+    void _dispatch(reactor const& r, stack<fn<void()>> pending) {
+        if constexpr (reactor_stats::enabled) {
+            pending.push([stats = r._stats, t = std::chrono::steady_clock::now()] {
+                stats->dispatch_ns.record(std::chrono::steady_clock::now() - t);
+            });
+        }
+        pool_submit_many(std::move(pending));
+    }
+    
+    // run inline completions, oldest first, until the budget is spent, and
+    // hand the rest to the pool
+    
+    void _run_inline(reactor const& r, stack<fn<void()>> inlined) {
+        if (inlined.empty())
+            return;
+        inlined.reverse();
+        auto deadline = std::chrono::steady_clock::now() + r._inline_budget;
+        do {
+            inlined.pop()();
+        } while (!inlined.empty() && (std::chrono::steady_clock::now() < deadline));
+        if (!inlined.empty()) {
+            inlined.reverse(); // <-- as the pool expects
+            _dispatch(r, std::move(inlined));
+        }
+    }
+    
+    // record the iteration, and how longand for how many events the
+    // kernel made us wait
+    
+    struct _waiting {
+        
+        reactor const& _reactor;
+        std::chrono::steady_clock::time_point _start;
+        
+        explicit _waiting(reactor const& r) : _reactor(r) {
+            if constexpr (reactor_stats::enabled)
+                _start = std::chrono::steady_clock::now();
+        }
+        
+        void done(int count) {
+            if constexpr (reactor_stats::enabled) {
+                auto& s = *_reactor._stats;
+                s.wait_ns.record(std::chrono::steady_clock::now() - _start);
+                s.events.record((u64) std::max(count, 0));
+                atomic_store(&s.iterations, s.iterations + 1, std::memory_order_relaxed);
+            }
+        }
+        
+    };
+    
+    // busy-poll until the kernel reports eventsor a notification arrives,
+    // for no longer than the spin budget or the time to the next timer.
+    // poll must ask the kernel for events with a zero timeout; between polls
+    // we check for notifications without a syscall, and since we do not
+    // announce that we are sleeping, notifiers make no syscalls either.
+    // returns false if the budget was spent and the caller should block
+    
+    template<typename F>
+    bool _busy_poll(reactor const& r, std::int64_t usecs, int& count, F&& poll) {
+        auto budget = r._spin;
+        if (usecs >= 0)
+            budget = std::min<std::chrono::steady_clock::duration>(budget, std::chrono::microseconds{usecs});
+        if (budget <= std::chrono::steady_clock::duration::zero())
+            return false;
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        do {
+            if (atomic_load(&r._cancelled_and_notifications, std::memory_order_relaxed)
+                & (reactor::NOTIFIED_BIT | reactor::CANCELLED_BIT)) {
+                count = 0; // <-- the loop will see it
+                return true;
+            }
+            count = poll();
+            if (count)
+                return true;
+        } while (std::chrono::steady_clock::now() < deadline);
+        return false;
+    }
+    
+    // a FIFO queue of waiters; the intrusive stack holds them oldest first,
+    // and we remember the newest so we can append after it
+    
+    struct waiters {
+        
+        stack<fn<void()>> _stack;
+        detail::node<void()>* _tail = nullptr;
+        
+        bool empty() {
+            return _stack.empty();
+        }
+        
+        void push(fn<void()> f) {
+            auto p = f._value.ptr;
+            if (_stack.empty())
+                _stack.push(std::move(f));
+            else
+                _stack.insert(stack<fn<void()>>::iterator{&_tail->_next}, std::move(f));
+            _tail = p;
+        }
+        
+        void push_front(fn<void()> f) {
+            auto p = f._value.ptr;
+            _stack.push(std::move(f));
+            if (!_tail)
+                _tail = p;
+        }
+        
+        // a waiter re-armed by the task that held the queue keeps its place
+        void admit(fn<void()> f) {
+            if (f->_flags & reactor::REARM) {
+                f->_flags &= ~reactor::REARM;
+                push_front(std::move(f));
+            } else {
+                push(std::move(f));
+            }
+        }
+        
+        fn<void()> pop() {
+            auto f = _stack.pop();
+            if (_stack.empty())
+                _tail = nullptr;
+            return f;
+        }
+        
+        stack<fn<void()>> take() {
+            _tail = nullptr;
+            return std::move(_stack);
+        }
+        
+        // move the oldest live waiter to pending, or to inlined if it asked
+        // to run on the reactor thread.  like timers, ordinary waiters yield
+        // themselves, and cancellable waiters yield their task or, if they
+        // were cancelled, nothing, in which case we try the next
+        bool wake(stack<fn<void()>>& pending, stack<fn<void()>>& inlined) {
+            while (!empty()) {
+                auto f = pop();
+                auto& target = (f->_flags & reactor::INLINE) ? inlined : pending;
+                if (auto p = std::exchange(f._value, nullptr).ptr->expire()) {
+                    target.push(fn<void()>{CountedPtr<detail::node<void()>>{p}});
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        void wake_all(stack<fn<void()>>& pending, stack<fn<void()>>& inlined) {
+            while (wake(pending, inlined))
+                ;
+        }
+        
+        // drop cancelled waiters, preserving the order of the rest
+        void purge() {
+            auto s = take(); // <-- oldest first, and push appends
+            while(!s.empty()) {
+                auto f = s.pop();
+                if (!f->cancelled())
+                    push(std::move(f));
+            }
+        }
+        
+    };
+    
+    // waiters indexed by descriptor
+    //
+    // the kernel hands out the lowest free descriptor, so a dense table
+    // grown on demand is both small and O(1); each descriptor has separate
+    // queues for each kind of event, and the state of its registration with
+    // the backend
+    
+    struct registry {
+        
+        struct entry {
+            waiters readers;
+            waiters writers;
+            waiters excepters;
+            fn<void()> edge; // <-- a detail::edge_node, or empty
+            std::uint32_t registered = 0;// <-- events in the kernel interest set
+            bool dirty = false; // <-- has new waiters
+            bool held[3] = {}; // <-- a woken waiter's task has yet to run, by queue
+        };
+        
+        static constexpr waiters entry::* queues[3] = {
+            &entry::readers,
+            &entry::writers,
+            &entry::excepters,
+        };
+        
+        std::vector<entry> _entries;
+        
+        entry& operator[](int fd) {
+            assert(fd >= 0);
+            if ((std::size_t) fd >= _entries.size())
+                _entries.resize(std::max<std::size_t>(fd + 1, _entries.size() * 2));
+            return _entries[fd];
+        }
+        
+    };
+    
+    // wake the oldest live waiter on queue k of fd, unless another holds
+    // the queue; the woken waiter holds it until its task has run
+    bool _wake_held(reactor const& r, int fd, int k, registry::entry& e,
+                    stack<fn<void()>>& pending, stack<fn<void()>>& inlined) {
+        if (e.held[k])
+            return false;
+        auto& q = e.*registry::queues[k];
+        while (!q.empty()) {
+            auto f = q.pop();
+            auto& target = (f->_flags & reactor::INLINE) ? inlined : pending;
+            if (auto p = std::exchange(f._value, nullptr).ptr->expire()) {
+                target.push([&r, fd, k, task = fn<void()>{CountedPtr<detail::node<void()>>{p}}]() mutable {
+                    r._run_held(fd, k, std::move(task));
+                });
+                e.held[k] = true;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+} // namespace
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+// io_uring completion engine
+//
+// we drive the rings directly rather than depend on liburing.  only the
+// reactor thread touches the submission queue, filling it from the
+// submissions buffer once per loop iteration and making one io_uring_enter
+// call for the batch.  the kernel signals completions on the reactor's
+// eventfd, so whichever backend is waiting for readiness wakes up to reap
+// them
+//
+// operations in flight when the reactor is destroyed are abandoned, along
+// with their continuations, just as waiters for readiness are
+
+struct reactor::ring {
+    
+    int _fd;
+    
+    void* _rings;
+    std::size_t _rings_size;
+    io_uring_sqe* _sqes;
+    std::size_t _sqes_size;
+    
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_flags;
+    unsigned* _sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned _cq_mask;
+    io_uring_cqe* _cqes;
+    
+    // returns nullptr if the kernel does not support what we need
+    static ring* make(unsigned entries, int eventfd) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+        if (fd == -1)
+            return nullptr; // <-- not supported, or forbidden by seccomp
+        // we need one mapping for both rings, completions that are never
+        // dropped, reads and writes at the current file position, and
+        // operations on non-blocking descriptors that wait for readiness
+        // rather than fail with EAGAIN
+        unsigned required = (IORING_FEAT_SINGLE_MMAP
+                             | IORING_FEAT_NODROP
+                             | IORING_FEAT_RW_CUR_POS
+                             | IORING_FEAT_FAST_POLL);
+        if ((p.features & required) != required) {
+            close(fd);
+            return nullptr;
+        }
+        auto r = new ring;
+        r->_fd = fd;
+        r->_rings_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                                  p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+        r->_rings = mmap(nullptr, r->_rings_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        r->_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        r->_sqes = (io_uring_sqe*) mmap(nullptr, r->_sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if ((r->_rings == MAP_FAILED) || (r->_sqes == MAP_FAILED)
+            || (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventfd, 1) != 0)) {
+            if (r->_rings != MAP_FAILED)
+                munmap(r->_rings, r->_rings_size);
+            if (r->_sqes != MAP_FAILED)
+                munmap(r->_sqes, r->_sqes_size);
+            close(fd);
+            delete r;
+            return nullptr;
+        }
+        auto base = (char*) r->_rings;
+        r->_sq_head = (unsigned*) (base + p.sq_off.head);
+        r->_sq_tail = (unsigned*) (base + p.sq_off.tail);
+        r->_sq_flags = (unsigned*) (base + p.sq_off.flags);
+        r->_sq_array = (unsigned*) (base + p.sq_off.array);
+        r->_sq_mask = *(unsigned*) (base + p.sq_off.ring_mask);
+        r->_sq_entries = *(unsigned*) (base + p.sq_off.ring_entries);
+        r->_cq_head = (unsigned*) (base + p.cq_off.head);
+        r->_cq_tail = (unsigned*) (base + p.cq_off.tail);
+        r->_cq_mask = *(unsigned*) (base + p.cq_off.ring_mask);
+        r->_cqes = (io_uring_cqe*) (base + p.cq_off.cqes);
+        return r;
+    }
+    
+    ~ring() {
+        munmap(_sqes, _sqes_size);
+        munmap(_rings, _rings_size);
+        close(_fd);
+    }
+    
+    int _enter(unsigned to_submit, unsigned flags) {
+        return (int) syscall(__NR_io_uring_enter, _fd, to_submit, 0, flags, nullptr, 0);
+    }
+    
+    // move completed operations to pending
+    void reap(stack<fn<void()>>& pending) {
+        for (;;) {
+            unsigned head = *_cq_head;
+            unsigned tail = atomic_load(_cq_tail, std::memory_order_acquire);
+            for (; head != tail; ++head) {
+                io_uring_cqe& c = _cqes[head & _cq_mask];
+                auto p = (detail::io_node*) c.user_data;
+                *p->_result = c.res;
+                pending.push(std::move(p->_continuation));
+                p->erase_and_delete();
+            }
+            atomic_store(_cq_head, head, std::memory_order_release);
+            // completions that did not fit wait in the kernel until we ask
+            if (!(atomic_load(_sq_flags, std::memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW))
+                return;
+            if ((_enter(0, IORING_ENTER_GETEVENTS) == -1) && (errno != EINTR))
+                (void) perror(strerror(errno)), abort();
+        }
+    }
+    
+    // hand the submission queue to the kernel
+    void _flush(unsigned n, stack<fn<void()>>& pending) {
+        while (n) {
+            int r = _enter(n, 0);
+            if (r >= 0) {
+                n -= r;
+            } else if ((errno == EAGAIN) || (errno == EBUSY)) {
+                reap(pending); // <-- make room for completions
+            } else if (errno != EINTR) {
+                (void) perror(strerror(errno)), abort();
+            }
+        }
+    }
+    
+    void submit(stack<fn<void()>> s, stack<fn<void()>>& pending) {
+        s.reverse(); // <-- oldest first
+        unsigned n = 0;
+        unsigned tail = *_sq_tail;
+        while (!s.empty()) {
+            if (tail - atomic_load(_sq_head, std::memory_order_acquire) == _sq_entries) {
+                atomic_store(_sq_tail, tail, std::memory_order_release);
+                _flush(std::exchange(n, 0), pending);
+            }
+            auto f = s.pop();
+            auto p = static_cast<detail::io_node*>((detail::node<void()>*) std::exchange(f._value, nullptr).ptr);
+            unsigned i = tail & _sq_mask;
+            io_uring_sqe& e = _sqes[i];
+            std::memset(&e, 0, sizeof(e));
+            switch (p->_opcode) {
+                case detail::io_node::READ:
+                    e.opcode = IORING_OP_READ;
+                    e.off = (std::uint64_t) -1; // <-- the current file position
+                    break;
+                case detail::io_node::WRITE:
+                    e.opcode = IORING_OP_WRITE;
+                    e.off = (std::uint64_t) -1;
+                    break;
+                case detail::io_node::READV:
+                    e.opcode = IORING_OP_READV;
+                    e.off = (std::uint64_t) -1;
+                    break;
+                case detail::io_node::WRITEV:
+                    e.opcode = IORING_OP_WRITEV;
+                    e.off = (std::uint64_t) -1;
+                    break;
+                case detail::io_node::RECV:
+                    e.opcode = IORING_OP_RECV;
+                    e.msg_flags = (unsigned) p->_flags;
+                    break;
+                case detail::io_node::SEND:
+                    e.opcode = IORING_OP_SEND;
+                    e.msg_flags = (unsigned) p->_flags;
+                    break;
+                default:
+                    abort();
+            }
+            e.fd = p->_fd;
+            e.addr = (std::uint64_t) p->_buf;
+            e.len = (unsigned) std::min<std::size_t>(p->_count, 0x7FFF'F000); // <-- the most read(2) will transfer
+            e.user_data = (std::uint64_t) p;
+            _sq_array[i] = i;
+            ++tail;
+            ++n;
+        }
+        atomic_store(_sq_tail, tail, std::memory_order_release);
+        _flush(n, pending);
+    }
+    
+};
+
+#else
+
+struct reactor::ring {
+    void reap(stack<fn<void()>>&) {}
+    void submit(stack<fn<void()>>, stack<fn<void()>>&) {}
+};
+
+#endif
+
+reactor::reactor(backend b,
+                 std::chrono::steady_clock::duration resolution,
+                 bool completions,
+                 std::chrono::steady_clock::duration spin,
+                 std::chrono::steady_clock::duration inline_budget)
+: _cancelled_and_notifications{0}
+, _wakeups{0}
+, _backend{b}
+, _epoll{-1}
+, _ring{nullptr}
+, _resolution{resolution}
+, _spin{spin}
+, _stats{std::make_shared<reactor_stats>()}
+, _inline_budget{inline_budget}
+, _buffers{std::make_unique<buffer_pool>()} {
+#if defined(__linux__)
+    _pipe[0] = _pipe[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_pipe[0] == -1) {
+        perror(strerror(errno));
+        abort();
+    }
+    if (_backend == backend::epoll) {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (_epoll == -1)
+            (void) perror(strerror(errno)), abort();
+        epoll_event e;
+        e.events = EPOLLIN;
+        e.data.fd = _pipe[0];
+        if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _pipe[0], &e) != 0)
+            (void) perror(strerror(errno)), abort();
+    }
+#if __has_include(<linux/io_uring.h>)
+    if (completions)
+        _ring = ring::make(256, _pipe[0]);
+#endif
+#else
+    _backend = backend::select;
+    if ((pipe(_pipe) != 0)
+        || (fcntl(_pipe[0], F_SETFL, O_NONBLOCK) != 0)
+        || (fcntl(_pipe[1], F_SETFL, O_NONBLOCK) != 0)) {
         perror(strerror(errno));
         abort();
     }
+#endif
     _thread = std::thread(&reactor::_run, this);
 }
 
 reactor::~reactor() {
     _cancel();
     _thread.join();
-    close(_pipe[1]);
+    delete _ring;
+    if (_epoll != -1)
+        close(_epoll);
+    if (_pipe[1] != _pipe[0])
+        close(_pipe[1]);
     close(_pipe[0]);
 }
 
+reactor_group::reactor_group(std::size_t n,
+                             reactor::backend b,
+                             std::chrono::steady_clock::duration resolution) {
+    assert(n > 0);
+    _shards.reserve(n);
+    for (std::size_t i = 0; i != n; ++i)
+        _shards.push_back(std::make_unique<reactor>(b, resolution));
+}
+
+void reactor::_wake() const {
+#if defined(__linux__)
+    std::uint64_t one{1};
+    if (write(_pipe[1], &one, sizeof(one)) != sizeof(one))
+        (void) perror(strerror(errno)), abort();
+#else
+    unsigned char c{0};
+    if ((write(_pipe[1], &c, 1) != 1) && (errno != EAGAIN)) // <-- a full pipe is readable anyway
+        (void) perror(strerror(errno)), abort();
+#endif
+}
+
+void reactor::_drain() const {
+    // a late notifier may still be about to write, which will cause at most
+    // one spurious wakeup
+#if defined(__linux__)
+    std::uint64_t n;
+    if ((read(_pipe[0], &n, sizeof(n)) != sizeof(n)) && (errno != EAGAIN))
+        (void) perror(strerror(errno)), abort();
+#else
+    unsigned char buf[64];
+    ssize_t r;
+    while ((r = read(_pipe[0], buf, sizeof(buf))) == sizeof(buf))
+        ;
+    if ((r < 0) && (errno != EAGAIN))
+        (void) perror(strerror(errno)), abort();
+#endif
+}
+
 void reactor::_run() const {
+    if (_backend == backend::epoll)
+        _run_epoll();
+    else
+        _run_select();
+}
+
+void reactor::_run_select() const {
     
-    struct cmp_t {
-        bool operator()(const fn<void()>& a,
-                        const fn<void()>& b) {
-            return a->_t > b->_t; // <-- reverse order puts earliest at top of priority queue
-        }
-    };
+    // select is O(descriptors) in the kernel anyway, so we only avoid
+    // rebuilding the sets; they are maintained incrementally as queues
+    // become empty or nonempty, and copied before each call
     
-    stack<fn<void()>> readers;
-    stack<fn<void()>> writers;
-    stack<fn<void()>> excepters;
-    std::priority_queue<fn<void()>, std::vector<fn<void()>>, cmp_t> timers;
+    registry fds;
+    wheel timers(_resolution);
     
     stack<fn<void()>> pending;
-    std::vector<char> buf;
+    stack<fn<void()>> inlined; // <-- to run on this thread
     
     int count = 0; // <-- the number of events observed by select
+    int maxfd = _pipe[0];
     
-    fd_set readset;
-    FD_ZERO(&readset);
-    
-    fd_set writeset;
-    FD_ZERO(&writeset);
-    fd_set* pwriteset = nullptr;
-    
-    fd_set exceptset;
-    FD_ZERO(&exceptset);
-    fd_set* pexceptset = nullptr;
+    fd_set wanted[3];
+    fd_set ready[3];
+    for (int k = 0; k != 3; ++k) {
+        FD_ZERO(&wanted[k]);
+        FD_ZERO(&ready[k]);
+    }
     
     timeval timeout;
     timeval *ptimeout = nullptr;
     
-    std::uint64_t outstanding = 0; // <-- single-byte write notifications we have synchronized with but not yet cleared
-    
     for (;;) {
         
+        // wake the oldest waiter for each event, and stop watching for it
+        // while the waiter holds the queue
+        if (count && FD_ISSET(_pipe[0], &ready[0])) {
+            FD_CLR(_pipe[0], &ready[0]);
+            _drain();
+            --count;
+        }
+        for (int fd = 0; count && (fd <= maxfd); ++fd) {
+            for (int k = 0; k != 3; ++k) {
+                if (FD_ISSET(fd, &ready[k])) {
+                    --count;
+                    registry::entry& e = fds[fd];
+                    _wake_held(*this, fd, k, e, pending, inlined);
+                    if (e.held[k] || (e.*registry::queues[k]).empty())
+                        FD_CLR(fd, &wanted[k]);
+                }
+            }
+        }
+        assert(count == 0); // <-- detects overcount
+        
+        // run inline completions before we look for new arrivals, so that
+        // the waiters they register are admitted without another iteration
+        if (!pending.empty())
+            _dispatch(*this, std::move(pending));
+        _run_inline(*this, std::move(inlined));
+        
         {
-            // establish an ordering between this read and the writes that preceeded notifications
+            // establish an ordering between this read and the writes that
+            // preceeded notifications, and announce that we are awake
             auto old = atomic_fetch_and(&_cancelled_and_notifications,
                                         CANCELLED_BIT,
                                         std::memory_order_acquire);
             if (old & CANCELLED_BIT)
                 break;
-            outstanding += old;
-            assert(outstanding >= old);
         }
         
-        readers.splice(_readers_buf.take());
-        writers.splice(_writers_buf.take());
-        excepters.splice(_excepters_buf.take());
-        
-        {
-            auto stale = _timers_buf.take();
-            while (!stale.empty())
-                timers.push(stale.pop());
-        }
-        
-        if (count && FD_ISSET(_pipe[0], &readset)) {
-            // we risk clearing notifications before we have observed their
-            // effects, so only read as many notifications (bytes) as we
-            // know have been sent
-            assert(outstanding > 0); // <-- else why is pipe readable?
-            buf.reserve(std::max<std::size_t>(outstanding, buf.capacity())); // <-- undefined behavior?
-            ssize_t r = read(_pipe[0], buf.data(), outstanding);
-            if (r < 0)
-                (void) perror(strerror(errno)), abort();
-            assert(r <= outstanding);
-            outstanding -= r;
-            //printf("outstanding notifications %llu\n", outstanding);
-            --count;
-        } else {
-            FD_SET(_pipe[0], &readset);
+        // releases go first, so that a waiter re-armed by a task that has
+        // since released is admitted (to the front) before we look again
+        for (auto s = _releases_buf.take(); !s.empty(); ) {
+            auto f = s.pop();
+            int fd = f->_fd;
+            int k = f->_flags;
+            registry::entry& e = fds[fd];
+            e.held[k] = false;
+            if (!(e.*registry::queues[k]).empty())
+                FD_SET(fd, &wanted[k]);
         }
-        int maxfd = _pipe[0];
-
-        auto process = [&](stack<fn<void()>>& list, fd_set* set) -> fd_set* {
-            for (auto i = list.begin(); i != list.end(); ) {
-                int fd = i->_fd;
-                if (count && FD_ISSET(fd, set)) {
-                    FD_CLR(fd, set);
-                    pending.push(list.erase(i));
-                    --count;
-                } else {
-                    assert(!FD_ISSET(fd, set)); // <-- detects undercount
-                    FD_SET(fd, set);
-                    maxfd = std::max(maxfd, fd);
-                    ++i;
-                }
-            }
-            return list.empty() ? nullptr : set;
+        
+        stack<fn<void()>> arrivals[3] = {
+            _readers_buf.take(),
+            _writers_buf.take(),
+            _excepters_buf.take(),
         };
+        for (int k = 0; k != 3; ++k) {
+            arrivals[k].reverse(); // <-- oldest first
+            while (!arrivals[k].empty()) {
+                auto f = arrivals[k].pop();
+                int fd = f->_fd;
+                assert((fd >= 0) && (fd < FD_SETSIZE));
+                registry::entry& e = fds[fd];
+                (e.*registry::queues[k]).admit(std::move(f));
+                if (!e.held[k])
+                    FD_SET(fd, &wanted[k]);
+                maxfd = std::max(maxfd, fd);
+            }
+        }
         
-        process(readers, &readset);
-        pwriteset = process(writers, &writeset);
-        pexceptset = process(excepters, &exceptset);
+        // drop cancelled waiters, and stop watching for events that no
+        // waiter wants any more
+        for (auto s = _purges_buf.take(); !s.empty(); ) {
+            int fd = s.pop()->_fd;
+            assert((fd >= 0) && (fd < FD_SETSIZE));
+            for (int k = 0; k != 3; ++k) {
+                auto& q = fds[fd].*registry::queues[k];
+                q.purge();
+                if (q.empty())
+                    FD_CLR(fd, &wanted[k]);
+            }
+        }
         
-        assert(count == 0); // <-- detects overcount
+        if (_ring) {
+            _ring->submit(_submissions_buf.take(), pending);
+            _ring->reap(pending);
+        }
         
-        auto now = std::chrono::steady_clock::now();
+        // select overwrites the sets it is given
+        auto rearm = [&] {
+            for (int k = 0; k != 3; ++k)
+                ready[k] = wanted[k];
+            FD_SET(_pipe[0], &ready[0]);
+        };
         
-        while ((!timers.empty()) && (timers.top()->_t <= now)) {
-            pending.push(std::move(const_cast<fn<void()>&>(timers.top())));
-            timers.pop();
-        }
-        if (!timers.empty()) {
-            auto usecs = std::chrono::duration_cast<std::chrono::
-                microseconds>(timers.top()->_t - now).count();
+        auto usecs = _expire(*this, timers, _timers_buf.take(), pending);
+        if (usecs >= 0) {
             timeout.tv_usec = (int) (usecs % 1'000'000);
             timeout.tv_sec = usecs / 1'000'000;
             ptimeout = &timeout;
         } else {
             ptimeout = nullptr;
         }
-                    
+        
         if (!pending.empty())
-            pool_submit_many(std::move(pending));
+            _dispatch(*this, std::move(pending));
+        _run_inline(*this, std::move(inlined));
+        
+        _waiting waiting(*this);
+        if (!_busy_poll(*this, usecs, count, [&] {
+            rearm();
+            timeval zero{0, 0};
+            return select(maxfd + 1, &ready[0], &ready[1], &ready[2], &zero);
+        })) {
+            
+            if (!_sleep()) {
+                // notified since we last looked, so poll
+                timeout.tv_usec = 0;
+                timeout.tv_sec = 0;
+                ptimeout = &timeout;
+            }
+            
+            rearm();
+            count = select(maxfd + 1, &ready[0], &ready[1], &ready[2], ptimeout);
+            atomic_store(&_wakeups, _wakeups + 1, std::memory_order_relaxed);
+            
+        }
+        waiting.done(count);
+        
+        if (count == -1)
+            (void) perror(strerror(errno)), abort();
+        
+    }
+    
+}
 
-        count = select(maxfd + 1, &readset, pwriteset, pexceptset, ptimeout);
+void reactor::_run_epoll() const {
 
-        if (count == -1)
+#if defined(__linux__)
+    
+    // descriptors stay in the kernel interest set between waits.  the
+    // interest set is widened eagerly, when a new waiter arrives, but
+    // narrowed lazily, only when the kernel reports an event that no waiter
+    // wants; a descriptor that is re-armed after each event (the common case
+    // for a coroutine reading a stream) costs no epoll_ctl calls at all
+    //
+    // the work done per iteration is proportional to the number of ready
+    // descriptors and new waiters, not to the number registered
+    
+    registry fds;
+    std::vector<int> dirty;
+    wheel timers(_resolution);
+    
+    stack<fn<void()>> pending;
+    stack<fn<void()>> inlined; // <-- to run on this thread
+    std::vector<epoll_event> events(256);
+    
+    int count = 0; // <-- the number of events observed by epoll_wait
+    
+    // an edge-triggered registration makes the whole descriptor
+    // edge-triggered, so other waiters re-arm it when they arrive (see
+    // below)
+    auto wanted = [](registry::entry& e) -> std::uint32_t {
+        std::uint32_t mask = 0;
+        if (!e.readers.empty() && !e.held[0])
+            mask |= EPOLLIN;
+        if (!e.writers.empty() && !e.held[1])
+            mask |= EPOLLOUT;
+        if (!e.excepters.empty() && !e.held[2])
+            mask |= EPOLLPRI;
+        if (e.edge)
+            mask |= EPOLLIN | EPOLLRDHUP | EPOLLET;
+        return mask;
+    };
+    
+    auto edge = [](registry::entry& e) {
+        return static_cast<detail::edge_node*>((detail::node<void()>*) e.edge._value.ptr);
+    };
+    
+    auto enlist = [&](stack<fn<void()>> s, waiters registry::entry::* queue) {
+        s.reverse(); // <-- oldest first
+        while (!s.empty()) {
+            auto f = s.pop();
+            int fd = f->_fd;
+            registry::entry& e = fds[fd];
+            if (!e.dirty) {
+                e.dirty = true;
+                dirty.push_back(fd);
+            }
+            (e.*queue).admit(std::move(f));
+        }
+    };
+    
+    // make the kernel interest set for fd match the mask
+    auto reregister = [&](int fd, registry::entry& e, std::uint32_t mask) {
+        if (!mask) {
+            if (e.registered)
+                (void) epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr); // <-- fails harmlessly if fd was closed
+            e.registered = 0;
+            return;
+        }
+        epoll_event ev;
+        ev.events = mask;
+        ev.data.fd = fd;
+        int op = e.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(_epoll, op, fd, &ev) != 0) {
+            // the descriptor may have been closed and its number reused
+            // since we last saw it, silently removing it from the interest
+            // set; or it may have been inherited from an earlier entry we
+            // forgot
+            if ((errno == ENOENT) || (errno == EEXIST)) {
+                op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+                if (epoll_ctl(_epoll, op, fd, &ev) == 0) {
+                    e.registered = mask;
+                    return;
+                }
+            }
+            if ((errno == EPERM) || (errno == EBADF)) {
+                // regular files are not pollable (because they are always
+                // ready) and closed descriptors will never become ready;
+                // either way the waiters must run now to find out
+                e.readers.wake_all(pending, inlined);
+                e.writers.wake_all(pending, inlined);
+                e.excepters.wake_all(pending, inlined);
+                if (e.edge)
+                    edge(e)->notify(pending);
+                e.edge = fn<void()>{};
+                e.registered = 0;
+                return;
+            }
+            (void) perror(strerror(errno)), abort();
+        }
+        e.registered = mask;
+    };
+    
+    for (;;) {
+        
+        // run inline completions before we look for new arrivals, so that
+        // the waiters they register are admitted without another iteration
+        if (!pending.empty())
+            _dispatch(*this, std::move(pending));
+        _run_inline(*this, std::move(inlined));
+        
+        {
+            // establish an ordering between this read and the writes that
+            // preceeded notifications, and announce that we are awake
+            auto old = atomic_fetch_and(&_cancelled_and_notifications,
+                                        CANCELLED_BIT,
+                                        std::memory_order_acquire);
+            if (old & CANCELLED_BIT)
+                break;
+        }
+        
+        // releases go first, so that a waiter re-armed by a task that has
+        // since released is admitted (to the front) before we look again
+        for (auto s = _releases_buf.take(); !s.empty(); ) {
+            auto f = s.pop();
+            int fd = f->_fd;
+            registry::entry& e = fds[fd];
+            e.held[f->_flags] = false;
+            if (!e.dirty) {
+                e.dirty = true;
+                dirty.push_back(fd);
+            }
+        }
+        
+        enlist(_readers_buf.take(), &registry::entry::readers);
+        enlist(_writers_buf.take(), &registry::entry::writers);
+        enlist(_excepters_buf.take(), &registry::entry::excepters);
+        
+        // a stream may be destroyed before its edge is admitted, and its
+        // purge may already have come and gone, so we drop an edge that is
+        // cancelled on arrival.  likewise a cancelled edge still installed
+        // on a reused descriptor, whose purge is yet to come
+        for (auto s = _edges_buf.take(); !s.empty(); ) {
+            auto f = s.pop();
+            if (f->cancelled())
+                continue;
+            int fd = f->_fd;
+            registry::entry& e = fds[fd];
+            if (e.edge && e.edge->cancelled())
+                e.edge = fn<void()>{};
+            assert(!e.edge); // <-- one per descriptor
+            e.edge = std::move(f);
+            if (!e.dirty) {
+                e.dirty = true;
+                dirty.push_back(fd);
+            }
+        }
+        
+        // drop cancelled waiters, and narrow the interest set at once
+        // rather than wait for an event that no waiter wants
+        for (auto s = _purges_buf.take(); !s.empty(); ) {
+            int fd = s.pop()->_fd;
+            registry::entry& e = fds[fd];
+            for (auto q : registry::queues)
+                (e.*q).purge();
+            if (e.edge && e.edge->cancelled())
+                e.edge = fn<void()>{};
+            if (e.registered & ~wanted(e))
+                reregister(fd, e, wanted(e));
+        }
+        
+        for (int fd : dirty) {
+            registry::entry& e = fds[fd];
+            e.dirty = false;
+            auto mask = wanted(e);
+            // modifying an edge-triggered registration re-arms it, and the
+            // kernel reports any readiness the new waiters need to see
+            if ((mask & ~e.registered) || (mask & EPOLLET))
+                reregister(fd, e, mask | e.registered);
+        }
+        dirty.clear();
+        
+        if (_ring) {
+            _ring->submit(_submissions_buf.take(), pending);
+            _ring->reap(pending);
+        }
+        
+        int timeout = -1;
+        auto usecs = _expire(*this, timers, _timers_buf.take(), pending);
+        if (usecs >= 0) {
+            // round up so we don't wake before the timer is due
+            timeout = (int) std::min<std::int64_t>((usecs + 999) / 1'000,
+                                                   std::numeric_limits<int>::max());
+        }
+        
+        if (!pending.empty())
+            _dispatch(*this, std::move(pending));
+        _run_inline(*this, std::move(inlined));
+        
+        _waiting waiting(*this);
+        if (!_busy_poll(*this, usecs, count, [&] {
+            return epoll_wait(_epoll, events.data(), (int) events.size(), 0);
+        })) {
+        
+            if (!_sleep())
+                timeout = 0; // <-- notified since we last looked, so poll
+            
+            count = epoll_wait(_epoll, events.data(), (int) events.size(), timeout);
+            atomic_store(&_wakeups, _wakeups + 1, std::memory_order_relaxed);
+            
+        }
+        waiting.done(count);
+        
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
             (void) perror(strerror(errno)), abort();
+        }
+        
+        // wake the oldest waiter for each event; the rest stay queued, and
+        // will be woken by later events if the descriptor is still ready
+        // once the first has released the queue.  an event for a held queue
+        // is not useful, so the interest set narrows lazily, as for an empty
+        // one.  hangups and errors are permanent, so wake everyone
+        for (int j = 0; j != count; ++j) {
+            int fd = events[j].data.fd;
+            std::uint32_t r = events[j].events;
+            if (fd == _pipe[0]) {
+                _drain();
+                continue;
+            }
+            registry::entry& e = fds[fd];
+            bool useful = false;
+            auto wake = [&](int k) {
+                auto& q = e.*registry::queues[k];
+                if (q.empty())
+                    return;
+                if (r & (EPOLLHUP | EPOLLERR))
+                    q.wake_all(pending, inlined), useful = true;
+                else
+                    useful |= _wake_held(*this, fd, k, e, pending, inlined); // <-- unless held, or all were cancelled
+            };
+            if (r & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (e.edge)
+                    edge(e)->notify(pending), useful = true;
+                wake(0);
+            }
+            if (r & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                wake(1);
+            if (r & EPOLLPRI)
+                wake(2);
+            if (!useful)
+                reregister(fd, e, wanted(e)); // <-- narrow
+        }
+        
+        if (count == (int) events.size())
+            events.resize(events.size() * 2);
+        
+    }
+
+#endif
+    
+}
+
+TEST_CASE("reactor", "[reactor]") {
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b);
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        
+        std::promise<void> readable;
+        std::promise<void> writeable;
+        r.when_readable(p[0], [&] { readable.set_value(); });
+        r.when_writeable(p[1], [&] { writeable.set_value(); });
+        writeable.get_future().get();
+        
+        char c{0};
+        REQUIRE(write(p[1], &c, 1) == 1);
+        readable.get_future().get();
+        
+        // re-arming a descriptor that is still readable
+        std::promise<void> again;
+        r.when_readable(p[0], [&] { again.set_value(); });
+        again.get_future().get();
+        
+        close(p[1]);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("reactor-waiters", "[reactor]") {
+    
+    // several waiters on one descriptor each consume one byte; none may be
+    // lost or woken twice, none may find the byte taken by another, and they
+    // are woken in the order they arrived
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b);
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        REQUIRE(fcntl(p[0], F_SETFL, O_NONBLOCK) == 0);
+        
+        struct waiter {
+            reactor const* r;
+            int fd;
+            int got = 0;
+            int order = -1;
+            std::atomic<int>* remaining;
+            std::atomic<int>* woken;
+            std::promise<void>* done;
+            void arm() {
+                r->when_readable(fd, [this] {
+                    order = woken->fetch_add(1, std::memory_order_relaxed);
+                    char c;
+                    if (read(fd, &c, 1) == 1)
+                        ++got; // <-- else another waiter took it
+                    if (remaining->fetch_sub(1, std::memory_order_relaxed) == 1)
+                        done->set_value();
+                });
+            }
+        };
+        
+        int n = 8;
+        std::atomic<int> remaining{n};
+        std::atomic<int> woken{0};
+        std::promise<void> done;
+        std::vector<waiter> v(n);
+        for (auto& w : v) {
+            w.r = &r;
+            w.fd = p[0];
+            w.remaining = &remaining;
+            w.woken = &woken;
+            w.done = &done;
+            w.arm();
+        }
+        for (int i = 0; i != n; ++i) {
+            char c{0};
+            REQUIRE(write(p[1], &c, 1) == 1);
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+        done.get_future().get();
+        for (int i = 0; i != n; ++i) {
+            REQUIRE(v[i].got == 1);
+            REQUIRE(v[i].order == i);
+        }
+        
+        close(p[1]);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("reactor-completions", "[reactor]") {
+    
+    REQUIRE_FALSE(reactor(reactor::default_backend, std::chrono::milliseconds{1}, false).has_completions());
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b);
+        if (!r.has_completions()) {
+            WARN("io_uring is unavailable");
+            return;
+        }
+        
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        
+        // a read submitted before there is anything to read
+        char c{0};
+        ssize_t n_read{0};
+        std::promise<void> read;
+        r.submit_read(p[0], &c, 1, &n_read, [&] { read.set_value(); });
+        
+        char d{42};
+        ssize_t n_written{0};
+        std::promise<void> written;
+        r.submit_write(p[1], &d, 1, &n_written, [&] { written.set_value(); });
+        written.get_future().get();
+        REQUIRE(n_written == 1);
+        read.get_future().get();
+        REQUIRE(n_read == 1);
+        REQUIRE(c == 42);
+        
+        // errors are reported as -errno
+        ssize_t n_bad{0};
+        std::promise<void> bad;
+        r.submit_read(-1, &c, 1, &n_bad, [&] { bad.set_value(); });
+        bad.get_future().get();
+        REQUIRE(n_bad == -EBADF);
+        
+        // more submissions than the submission queue holds
+        int m = 1'000;
+        std::vector<ssize_t> results(m, 0);
+        std::atomic<int> remaining{m};
+        std::promise<void> done;
+        for (int i = 0; i != m; ++i)
+            r.submit_write(p[1], &d, 1, &results[i], [&] {
+                if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                    done.set_value();
+            });
+        done.get_future().get();
+        for (auto x : results)
+            REQUIRE(x == 1);
+        
+        close(p[1]);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("reactor-notify", "[reactor]") {
+    
+    // bursts of submissions from many threads, against a reactor that is
+    // alternately busy and asleep, must never be lost
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b);
+        int n = 8;
+        int m = 10'000;
+        std::atomic<int> remaining{n * m};
+        std::promise<void> done;
+        std::vector<std::thread> threads;
+        for (int i = 0; i != n; ++i) {
+            threads.emplace_back([&] {
+                for (int j = 0; j != m; ++j) {
+                    r.when(std::chrono::steady_clock::now(), [&] {
+                        if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                            done.set_value();
+                    });
+                    if (!(j & 0xFF))
+                        std::this_thread::sleep_for(std::chrono::microseconds{100});
+                }
+            });
+        }
+        done.get_future().get();
+        while (!threads.empty()) {
+            threads.back().join();
+            threads.pop_back();
+        }
+        
+    }
+    
+}
+
+TEST_CASE("reactor-timer", "[reactor]") {
+    
+    using namespace std::chrono;
+    
+    reactor r;
+    
+    {
+        // cancelled before it fires, the task is destroyed at once and
+        // never runs
+        auto captured = std::make_shared<int>(0);
+        std::atomic<bool> ran{false};
+        auto h = r.after(milliseconds{50}, [captured, &ran] {
+            ran.store(true, std::memory_order_relaxed);
+        });
+        REQUIRE(captured.use_count() == 2);
+        REQUIRE(h.cancel());
+        REQUIRE(captured.use_count() == 1);
+        REQUIRE_FALSE(h.cancel());
+        std::this_thread::sleep_for(milliseconds{100});
+        REQUIRE_FALSE(ran.load(std::memory_order_relaxed));
+    }
+    
+    {
+        // once fired, it cannot be cancelled
+        std::promise<void> p;
+        auto h = r.after(milliseconds{1}, [&p] { p.set_value(); });
+        p.get_future().get();
+        REQUIRE_FALSE(h.cancel());
+    }
+    
+}
+
+TEST_CASE("reactor-cancel", "[reactor]") {
+    
+    // a cancelled waiter frees its task at once and never swallows an
+    // event meant for a live waiter; once purged, it no longer keeps the
+    // descriptor in the interest set
+    
+    using namespace std::chrono;
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b);
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        
+        auto captured = std::make_shared<int>(0);
+        std::atomic<bool> ran{false};
+        auto h = r.when_readable_cancellable(p[0], [captured, &ran] {
+            ran.store(true, std::memory_order_relaxed);
+        });
+        std::promise<void> live;
+        r.when_readable(p[0], [&live] { live.set_value(); });
+        REQUIRE(h.cancel());
+        REQUIRE(captured.use_count() == 1);
+        
+        char c{0};
+        REQUIRE(write(p[1], &c, 1) == 1);
+        live.get_future().get();
+        REQUIRE_FALSE(ran.load(std::memory_order_relaxed));
+        REQUIRE(read(p[0], &c, 1) == 1);
+        
+        // wait for the reactor to see the purge
+        auto h2 = r.when_readable_cancellable(p[0], [] {});
+        REQUIRE(h2.cancel());
+        r.purge(p[0]);
+        for (int i = 0; i != 2; ++i) {
+            std::promise<void> synced;
+            r._when(steady_clock::now(), [&synced] { synced.set_value(); });
+            synced.get_future().get();
+        }
+        auto wakeups = atomic_load(&r._wakeups, std::memory_order_relaxed);
+        REQUIRE(write(p[1], &c, 1) == 1);
+        std::this_thread::sleep_for(milliseconds{20});
+        REQUIRE(atomic_load(&r._wakeups, std::memory_order_relaxed) == wakeups);
+        
+        close(p[1]);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("reactor-inline", "[reactor]") {
+    
+    using namespace std::chrono;
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        // inline completions run on the reactor thread
+        reactor r(b, milliseconds{1}, false, steady_clock::duration::zero(), milliseconds{1});
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        std::promise<std::thread::id> ran;
+        r.when_readable_inline(p[0], [&] { ran.set_value(std::this_thread::get_id()); });
+        char c{0};
+        REQUIRE(write(p[1], &c, 1) == 1);
+        REQUIRE(ran.get_future().get() == r._thread.get_id());
+        REQUIRE(read(p[0], &c, 1) == 1);
+        
+        if (b == reactor::backend::epoll) {
+            // a hangup wakes every waiter in the same iteration; the first
+            // exhausts the budget, so the rest go to the pool
+            int n = 10;
+            std::atomic<int> on_reactor{0};
+            std::atomic<int> remaining{n};
+            std::promise<void> done;
+            for (int i = 0; i != n; ++i)
+                r.when_readable_inline(p[0], [&] {
+                    if (std::this_thread::get_id() == r._thread.get_id())
+                        on_reactor.fetch_add(1, std::memory_order_relaxed);
+                    auto t = steady_clock::now() + milliseconds{2};
+                    while (steady_clock::now() < t)
+                        ;
+                    if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                        done.set_value();
+                });
+            std::this_thread::sleep_for(milliseconds{10});
+            close(p[1]);
+            done.get_future().get();
+            REQUIRE(on_reactor.load(std::memory_order_relaxed) == 1);
+        } else {
+            close(p[1]);
+        }
+        close(p[0]);
         
     }
     
 }
+
+TEST_CASE("reactor-stats", "[reactor]") {
+    
+    using namespace std::chrono;
+    
+    {
+        reactor_stats::histogram h;
+        for (u64 x : { 0, 1, 2, 3, 1000 })
+            h.record(x);
+        REQUIRE(h.count() == 5);
+        REQUIRE(h.quantile(0.2) == 0);
+        REQUIRE(h.quantile(0.4) == 1);
+        REQUIRE(h.quantile(0.8) == 3);
+        REQUIRE(h.quantile(1.0) == 1023);
+    }
+    
+    if constexpr (!reactor_stats::enabled)
+        return;
+    
+    reactor r;
+    auto s0 = r.stats();
+    
+    int n = 20;
+    std::atomic<int> remaining{n};
+    std::promise<void> fired;
+    for (int i = 0; i != n; ++i)
+        r._when(steady_clock::now() + milliseconds{i}, [&] {
+            if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                fired.set_value();
+        });
+    fired.get_future().get();
+    
+    int p[2];
+    REQUIRE(pipe(p) == 0);
+    std::promise<void> readable;
+    r.when_readable(p[0], [&] { readable.set_value(); });
+    char c{0};
+    REQUIRE(write(p[1], &c, 1) == 1);
+    readable.get_future().get();
+    close(p[1]);
+    close(p[0]);
+    std::this_thread::sleep_for(milliseconds{10}); // <-- for the last probe
+    
+    auto s = r.stats() - s0;
+    REQUIRE(s.iterations > 0);
+    REQUIRE(s.wait_ns.count() > 0);
+    REQUIRE(s.events.count() > 0);
+    REQUIRE(s.events.quantile(1.0) > 0);
+    REQUIRE(s.timer_lateness_ns.count() == (u64) n);
+    REQUIRE(s.timer_lateness_ns.quantile(1.0) < (u64) nanoseconds{seconds{1}}.count());
+    REQUIRE(s.dispatch_ns.count() > 0);
+    
+}
+
+TEST_CASE("reactor-group", "[reactor]") {
+    
+    reactor_group g(4);
+    REQUIRE(g.size() == 4);
+    
+    // descriptors are pinned to shards
+    int n = 16;
+    std::vector<int> p(2 * n);
+    for (int i = 0; i != n; ++i)
+        REQUIRE(pipe(p.data() + 2 * i) == 0);
+    for (int fd : p)
+        REQUIRE(&g.shard(fd) == &g.shard(fd));
+    REQUIRE(&g.shard(p[0]) != &g.shard(p[0] + 1));
+    
+    // waiters on every shard, and timers from many threads, all fire
+    std::atomic<int> remaining{n + 8 * 100};
+    std::promise<void> done;
+    auto decrement = [&] {
+        if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+            done.set_value();
+    };
+    for (int i = 0; i != n; ++i)
+        g.shard(p[2 * i]).when_readable(p[2 * i], decrement);
+    std::vector<std::thread> threads;
+    for (int i = 0; i != 8; ++i)
+        threads.emplace_back([&] {
+            for (int j = 0; j != 100; ++j)
+                g.local()._when(std::chrono::steady_clock::now(), decrement);
+        });
+    for (int i = 0; i != n; ++i) {
+        char c{0};
+        REQUIRE(write(p[2 * i + 1], &c, 1) == 1);
+    }
+    done.get_future().get();
+    for (auto& t : threads)
+        t.join();
+    for (int fd : p)
+        close(fd);
+    
+}
+
+TEST_CASE("reactor-spin", "[reactor]") {
+    
+    // a busy-polling reactor still sees readiness, timers and notifications,
+    // and blocks once its budget is spent
+    
+    using namespace std::chrono;
+    
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        
+        reactor r(b, milliseconds{1}, false, microseconds{500});
+        int p[2];
+        REQUIRE(pipe(p) == 0);
+        
+        std::promise<void> readable;
+        r.when_readable(p[0], [&] { readable.set_value(); });
+        std::this_thread::sleep_for(milliseconds{10});
+        char c{0};
+        REQUIRE(write(p[1], &c, 1) == 1);
+        readable.get_future().get();
+        
+        std::promise<void> expired;
+        r._when(steady_clock::now() + milliseconds{5}, [&] { expired.set_value(); });
+        expired.get_future().get();
+        
+        auto w0 = atomic_load(&r._wakeups, std::memory_order_relaxed);
+        std::this_thread::sleep_for(milliseconds{10});
+        REQUIRE(atomic_load(&r._wakeups, std::memory_order_relaxed) - w0 <= 1);
+        
+        close(p[1]);
+        close(p[0]);
+        
+    }
+    
+}
+
+TEST_CASE("reactor-timer-bench", "[reactor][.bench]") {
+    
+    // request timeouts where 99% of requests complete in time
+    //
+    // compare timers that always fire and check a flag with timers that are
+    // cancelled; count reactor wakeups, tasks run, and the closures (each
+    // capturing a kilobyte of request state) still held by the reactor once
+    // the requests are issued
+    
+    using namespace std::chrono;
+    
+    struct state {
+        std::atomic<std::int64_t>* _live;
+        char _payload[1024];
+        explicit state(std::atomic<std::int64_t>* live) : _live(live) { _live->fetch_add(1, std::memory_order_relaxed); }
+        state(state const& other) : _live(other._live) { _live->fetch_add(1, std::memory_order_relaxed); }
+        ~state() { _live->fetch_sub(1, std::memory_order_relaxed); }
+    };
+    
+    auto bench = [](bool cancellable) {
+        
+        reactor r;
+        int n = 20'000;
+        std::vector<std::atomic<bool>> completed(n);
+        std::vector<timer> handles(n);
+        std::atomic<int> ran{0};
+        std::atomic<std::int64_t> live{0};
+        
+        // deadlines spread over a second, one every 50us; each request
+        // completes while the next hundred are being issued
+        auto t0 = steady_clock::now() + milliseconds{20};
+        for (int i = 0; i != n; ++i) {
+            auto f = [&, i, s = state{&live}] {
+                if (!completed[i].load(std::memory_order_relaxed))
+                    (void) s; // <-- would handle the timeout
+                ran.fetch_add(1, std::memory_order_relaxed);
+            };
+            auto t = t0 + microseconds{50} * i;
+            if (cancellable)
+                handles[i] = r.when(t, std::move(f));
+            else
+                r._when(t, std::move(f));
+            if ((i >= 100) && ((i - 100) % 100)) {
+                completed[i - 100].store(true, std::memory_order_relaxed);
+                if (cancellable)
+                    handles[i - 100].cancel();
+            }
+        }
+        auto peak = live.load(std::memory_order_relaxed);
+        auto w0 = atomic_load(&r._wakeups, std::memory_order_relaxed);
+        std::this_thread::sleep_until(t0 + microseconds{50} * n + milliseconds{100});
+        
+        printf("%s: %6llu wakeups, %6d tasks run, %6lld live closures (%lld KiB)\n",
+               cancellable ? "cancel" : "flag  ",
+               (unsigned long long) (atomic_load(&r._wakeups, std::memory_order_relaxed) - w0),
+               ran.load(std::memory_order_relaxed),
+               (long long) peak, (long long) peak * (long long) sizeof(state) >> 10);
+        
+    };
+    
+    bench(false);
+    bench(true);
+    
+}
+
+TEST_CASE("reactor-bench", "[reactor][.bench]") {
+    
+    // many idle descriptors, a few hot pipes
+    
+    rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    
+    auto bench = [](reactor::backend b, int idle, int hot, int rounds) {
+        
+        reactor r(b);
+        
+        std::vector<int> idles(idle);
+        for (int i = 0; i < idle; i += 2)
+            if (pipe(idles.data() + i) != 0)
+                return (void) printf("could not open %d descriptors\n", idle);
+        std::atomic<int> idle_remaining{idle / 2};
+        std::promise<void> idle_done;
+        for (int i = 0; i < idle; i += 2)
+            r.when_readable(idles[i], [&] {
+                if (idle_remaining.fetch_sub(1, std::memory_order_relaxed) == 1)
+                    idle_done.set_value();
+            });
+        
+        struct ping {
+            reactor const* r;
+            int p[2];
+            int n;
+            std::atomic<int>* remaining;
+            std::promise<void>* done;
+            void arm() {
+                r->when_readable(p[0], [this] {
+                    char c;
+                    [[maybe_unused]] ssize_t k = read(p[0], &c, 1);
+                    if (--n) {
+                        arm();
+                        k = write(p[1], &c, 1);
+                    } else if (remaining->fetch_sub(1, std::memory_order_relaxed) == 1) {
+                        done->set_value();
+                    }
+                });
+            }
+        };
+        
+        std::vector<ping> pings(hot);
+        std::atomic<int> remaining{hot};
+        std::promise<void> done;
+        for (auto& x : pings) {
+            x.r = &r;
+            [[maybe_unused]] int k = pipe(x.p);
+            x.n = rounds;
+            x.remaining = &remaining;
+            x.done = &done;
+        }
+        
+        auto t0 = std::chrono::steady_clock::now();
+        for (auto& x : pings) {
+            char c{0};
+            x.arm();
+            [[maybe_unused]] ssize_t k = write(x.p[1], &c, 1);
+        }
+        done.get_future().get();
+        auto t1 = std::chrono::steady_clock::now();
+        
+        printf("%s: %5d idle, %d hot: %.2f us per event\n",
+               (b == reactor::backend::select) ? "select" : "epoll ",
+               idle,
+               hot,
+               std::chrono::duration<double, std::micro>(t1 - t0).count() / (hot * rounds));
+        
+        for (auto& x : pings) {
+            close(x.p[1]);
+            close(x.p[0]);
+        }
+        
+        // closing the write ends makes the idle read ends readable (EOF)
+        for (int i = 0; i < idle; i += 2)
+            close(idles[i + 1]);
+        idle_done.get_future().get();
+        for (int i = 0; i < idle; i += 2)
+            close(idles[i]);
+        
+    };
+    
+    // select is limited to descriptors less than FD_SETSIZE
+    bench(reactor::backend::select, FD_SETSIZE - 64, 4, 10'000);
+    bench(reactor::backend::epoll, FD_SETSIZE - 64, 4, 10'000);
+    bench(reactor::backend::epoll, 10'000, 4, 10'000);
+    
+}
+
+TEST_CASE("reactor-group-bench", "[reactor][.bench]") {
+    
+    // many hot pipes, each bouncing a byte through its own reactor shard;
+    // event throughput should scale with shards until the pool saturates
+    
+    struct ping {
+        reactor const* r;
+        int p[2];
+        std::atomic<bool>* stop;
+        std::atomic<std::uint64_t> n{0};
+        void arm() {
+            r->when_readable(p[0], [this] {
+                char c;
+                [[maybe_unused]] ssize_t k = read(p[0], &c, 1);
+                n.fetch_add(1, std::memory_order_relaxed);
+                if (!stop->load(std::memory_order_relaxed)) {
+                    arm();
+                    k = write(p[1], &c, 1);
+                }
+            });
+        }
+    };
+    
+    auto bench = [](std::size_t shards, int hot) {
+        
+        reactor_group g(shards);
+        std::atomic<bool> stop{false};
+        std::vector<ping> pings(hot);
+        for (auto& x : pings) {
+            [[maybe_unused]] int k = pipe(x.p);
+            x.r = &g.shard(x.p[0]);
+            x.stop = &stop;
+        }
+        
+        auto t0 = std::chrono::steady_clock::now();
+        for (auto& x : pings) {
+            char c{0};
+            x.arm();
+            [[maybe_unused]] ssize_t k = write(x.p[1], &c, 1);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds{1});
+        std::uint64_t n = 0;
+        for (auto& x : pings)
+            n += x.n.load(std::memory_order_relaxed);
+        auto t1 = std::chrono::steady_clock::now();
+        stop.store(true, std::memory_order_relaxed);
+        
+        printf("%3zu shards, %d hot: %.2f M events per second\n",
+               shards,
+               hot,
+               n / std::chrono::duration<double, std::micro>(t1 - t0).count());
+        
+        // let the in-flight events drain before the pings are destroyed
+        std::this_thread::sleep_for(std::chrono::milliseconds{100});
+        for (auto& x : pings) {
+            close(x.p[1]);
+            close(x.p[0]);
+        }
+        
+    };
+    
+    for (std::size_t shards = 1; shards <= std::thread::hardware_concurrency(); shards *= 2)
+        bench(shards, 256);
+    
+}
+
+TEST_CASE("reactor-spin-bench", "[reactor][.bench]") {
+    
+    // ping-pong latency over pipes: the client writes a byte and blocks
+    // reading the reply, which a reactor waiter sends back
+    
+    using namespace std::chrono;
+    
+    auto bench = [](reactor::backend b, steady_clock::duration spin) {
+        
+        reactor r(b, milliseconds{1}, false, spin);
+        int ping[2];
+        int pong[2];
+        [[maybe_unused]] int k = pipe(ping);
+        k = pipe(pong);
+        
+        struct echo {
+            reactor const* r;
+            int in;
+            int out;
+            void arm() {
+                r->when_readable(in, [this] {
+                    char c;
+                    if (read(in, &c, 1) != 1)
+                        return; // <-- closed
+                    arm();
+                    [[maybe_unused]] ssize_t k = write(out, &c, 1);
+                });
+            }
+        } e{&r, ping[0], pong[1]};
+        e.arm();
+        
+        int n = 20'000;
+        std::vector<double> v(n);
+        for (int i = 0; i != n; ++i) {
+            char c{0};
+            auto t0 = steady_clock::now();
+            [[maybe_unused]] ssize_t k = write(ping[1], &c, 1);
+            k = read(pong[0], &c, 1);
+            auto t1 = steady_clock::now();
+            v[i] = duration<double, std::micro>(t1 - t0).count();
+            // give the reactor time to go back to sleep
+            if (!(i % 16))
+                std::this_thread::sleep_for(microseconds{100});
+        }
+        std::sort(v.begin(), v.end());
+        
+        printf("%s, spin %4lld us: p50 %6.1f us, p99 %6.1f us, p999 %6.1f us\n",
+               (b == reactor::backend::select) ? "select" : "epoll ",
+               (long long) duration_cast<microseconds>(spin).count(),
+               v[n / 2], v[n * 99 / 100], v[n * 999 / 1000]);
+        
+        close(ping[1]); // <-- the echo sees EOF and stops
+        std::this_thread::sleep_for(milliseconds{10});
+        close(ping[0]);
+        close(pong[1]);
+        close(pong[0]);
+        
+    };
+    
+    // spinning only helps when the reactor has a core to itself
+    printf("%u hardware threads\n", std::thread::hardware_concurrency());
+    for (auto b : { reactor::backend::select, reactor::backend::epoll }) {
+        bench(b, steady_clock::duration::zero());
+        bench(b, microseconds{200});
+        bench(b, milliseconds{2});
+    }
+    
+}
@@ -11,94 +11,701 @@
 
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <stack>
 #include <thread>
+#include <vector>
 
+#include "buffer.hpp"
 #include "stack.hpp"
 #include "pool.hpp"
+#include "wheel.hpp"
+
+// instrumentation is compiled in unless AARC_REACTOR_STATS is defined to 0
+#ifndef AARC_REACTOR_STATS
+#define AARC_REACTOR_STATS 1
+#endif
+
+namespace detail {
+    
+    // a timer, or a waitfor readiness, that may be cancelled
+    //
+    // the node is shared by the reactor and a handle; whichever of expiry
+    // and cancellation first moves _state away from ARMED owns the task.
+    // cancellation destroys the task at once, so captured state is freed
+    // promptly, but the node itself stays in the timer wheel (or waiter
+    // queue) until the reactor next looks at its slot (or is asked to purge
+    // the descriptor)
+    //
+    // timer nodes never enter the pool (which claims _count for its own
+    // counting) so we use _count for the two references
+    
+    struct timer_node final : node<void()> {
+        
+        enum : u64 {
+            ARMED,
+            FIRED,
+            CANCELLED,
+        };
+        
+        mutable u64 _state;
+        fn<void()> _task;
+        
+        explicit timer_node(fn<void()> f)
+        : _state{ARMED}
+        , _task{std::move(f)} {
+            _count = 2;
+        }
+        
+        // the winner's use of _task is ordered before the destructor by
+        // release, so the race for _state can be relaxed
+        bool _claim(u64 desired) {
+            u64 expected = ARMED;
+            return atomic_compare_exchange_strong(&_state,
+                                                  &expected,
+                                                  desired,
+                                                  std::memory_order_relaxed,
+                                                  std::memory_order_relaxed);
+        }
+        
+        bool cancel() {
+            if (!_claim(CANCELLED))
+                return false;
+            _task = fn<void()>{};
+            return true;
+        }
+        
+        virtual bool cancelled() const override {
+            return atomic_load(&_state, std::memory_order_relaxed) == CANCELLED;
+        }
+        
+        virtual node* expire() override {
+            node* p = nullptr;
+            if (_claim(FIRED))
+                p = std::exchange(_task._value, nullptr).ptr;
+            release(1);
+            return p;
+        }
+        
+        virtual void erase_and_delete() const noexcept override {
+            release(1);
+        }
+        
+        virtual void mut_call_and_erase_and_delete() override {
+            if (node* p = expire())
+                p->mut_call_and_erase_and_delete();
+        }
+        
+        virtual u64 try_clone() const override {
+            return 0;
+        }
+        
+    }; // timer_node
+    
+    // a read, write, recv, send, readv or writev for the completion engine;
+    // for the vectored operations _buf and _count are the iovec array
+    //
+    // the reactor stores the result, or -errno, and then schedules the
+    // continuation; the node itself is never called
+    
+    struct io_node final : node<void()> {
+        
+        enum : u64 {
+            READ,
+            WRITE,
+            RECV,
+            SEND,
+            READV,
+            WRITEV,
+        };
+        
+        u64 _opcode;
+        void* _buf;
+        std::size_t _count;
+        ssize_t* _result;
+        fn<void()> _continuation;
+        
+        io_node(u64 opcode, int fd, void* buf, std::size_t count, int flags, ssize_t* result, fn<void()> f)
+        : _opcode{opcode}
+        , _buf{buf}
+        , _count{count}
+        , _result{result}
+        , _continuation{std::move(f)} {
+            _fd = fd;
+            _flags = flags; // <-- for recv and send
+        }
+        
+        virtual u64 try_clone() const override {
+            return 0;
+        }
+        
+    }; // io_node
+    
+    // a persistent, edge-triggered registration for readability
+    //
+    // the reactor keeps the node while the descriptor is registered, and on
+    // each edge marks it NOTIFIED and schedules the task parked on it, if
+    // any.  a consumer resets it, reads until the descriptor would block,
+    // and then parks; if an edge arrived in between, parking fails and the
+    // consumer must read again.  so each message costs no allocation,
+    // buffer push or notification, unless the consumer actually has to
+    // wait
+    //
+    // like timer nodes these are shared by the reactor and an owner, and
+    // never enter the pool
+    
+    struct edge_node final : node<void()> {
+        
+        enum : u64 {
+            IDLE,
+            NOTIFIED,
+            // otherwise the parked task
+        };
+        
+        mutable u64 _state;
+        mutable bool _cancelled;
+        
+        explicit edge_node(int fd)
+        : _state{IDLE}
+        , _cancelled{false} {
+            _fd = fd;
+            _count = 2;
+        }
+        
+        virtual ~edge_node() noexcept override {
+            if (_state > NOTIFIED)
+                fn<void()>{CountedPtr<node>{(node*) _state}}; // <-- abandoned
+        }
+        
+        void reset() {
+            atomic_store(&_state, (u64) IDLE, std::memory_order_relaxed);
+        }
+        
+        // true if the task was parked; false, leaving it untouched, if the
+        // descriptor has been notified since the last reset
+        bool park(fn<void()>& f) {
+            u64 expected = IDLE;
+            if (atomic_compare_exchange_strong(&_state,
+                                               &expected,
+                                               (u64) (node*) f._value.ptr,
+                                               std::memory_order_release,
+                                               std::memory_order_acquire)) {
+                f._value = nullptr;
+                return true;
+            }
+            assert(expected == NOTIFIED);
+            return false;
+        }
+        
+        // reactor side
+        void notify(stack<fn<void()>>& pending) {
+            auto old = atomic_exchange(&_state, (u64) NOTIFIED, std::memory_order_acq_rel);
+            if (old > NOTIFIED)
+                pending.push(fn<void()>{CountedPtr<node>{(node*) old}});
+        }
+        
+        void cancel() {
+            atomic_store(&_cancelled, true, std::memory_order_relaxed);
+        }
+        
+        virtual bool cancelled() const override {
+            return atomic_load(&_cancelled, std::memory_order_relaxed);
+        }
+        
+        virtual void erase_and_delete() const noexcept override {
+            release(1);
+        }
+        
+        virtual u64 try_clone() const override {
+            return 0;
+        }
+        
+    }; // edge_node
+    
+} // namespace detail
+
+// handle to a timer, or to a wait for readiness
+//
+// cancel() prevents the timer from firing, if it has not already, and
+// destroys its task.  dropping the handle does not cancel the timer
+//
+// a handle may be made from a task before it is scheduled, so that two
+// tasks can each hold the other's handle; it must then be scheduled
+// exactly once
+
+struct timer {
+    
+    detail::timer_node* _node;
+    
+    timer() : _node{nullptr} {}
+    explicit timer(detail::timer_node* p) : _node{p} {}
+    explicit timer(fn<void()> f) : _node{new detail::timer_node(std::move(f))} {}
+    timer(timer const&) = delete;
+    timer(timer&& other) : _node{std::exchange(other._node, nullptr)} {}
+    
+    ~timer() {
+        if (_node)
+            _node->release(1);
+    }
+    
+    void swap(timer& other) {
+        using std::swap;
+        swap(_node, other._node);
+    }
+    
+    timer& operator=(timer const&) = delete;
+    timer& operator=(timer&& other) {
+        timer(std::move(other)).swap(*this);
+        return *this;
+    }
+    
+    // true if the timer was cancelled before it fired
+    bool cancel() {
+        return _node && _node->cancel();
+    }
+    
+    explicit operator bool() const {
+        return _node;
+    }
+    
+    // the reactor's reference
+    fn<void()> _schedule() const {
+        assert(_node);
+        return fn<void()>{CountedPtr<detail::node<void()>>{_node}};
+    }
+    
+};
+
+// reactor instrumentation
+//
+// a counter of loop iterations, and log2 histograms of the time spent
+// waiting in the kernel, the number of events each wait returns, how late
+// timers fire (from their deadline to the reactor handing them to the
+// pool), and the delay from the reactor handing a batch of tasks to the
+// pool until the pool starts running them (sampled once per batch by a
+// probe task)
+//
+// the reactor thread updates these with relaxed atomics, and snapshot()
+// copies them the same way, so a snapshot is not a consistent cut but each
+// value in it is one the reactor actually stored.  compare two snapshots
+// to see what happened between them.  when compiled out the loop does not
+// even read the clock, and every snapshot is empty
+
+struct reactor_stats {
+    
+    static constexpr bool enabled = AARC_REACTOR_STATS;
+    
+    // bucket 0 counts zeros, and bucket k counts samples in [2^(k-1), 2^k)
+    struct histogram {
+        
+        mutable u64 _buckets[65] = {};
+        
+        void record(u64 x) {
+            int k = x ? 64 - __builtin_clzll(x) : 0;
+            atomic_fetch_add(&_buckets[k], (u64) 1, std::memory_order_relaxed);
+        }
+        
+        void record(std::chrono::steady_clock::duration d) {
+            record((u64) std::max<std::chrono::nanoseconds::rep>(0, std::chrono::nanoseconds{d}.count()));
+        }
+        
+        u64 count() const {
+            u64 n = 0;
+            for (u64 b : _buckets)
+                n += b;
+            return n;
+        }
+        
+        // an upper bound on the q-th quantile, or zero if empty
+        u64 quantile(double q) const {
+            u64 n = count();
+            u64 m = 0;
+            for (int k = 0; k != 65; ++k) {
+                m += _buckets[k];
+                if (n && (m >= q * n))
+                    return k ? (k == 64 ? ~(u64) 0 : ((u64) 1 << k) - 1) : 0;
+            }
+            return 0;
+        }
+        
+        histogram snapshot() const {
+            histogram h;
+            for (int k = 0; k != 65; ++k)
+                h._buckets[k] = atomic_load(&_buckets[k], std::memory_order_relaxed);
+            return h;
+        }
+        
+        histogram operator-(histogram const& other) const {
+            histogram h;
+            for (int k = 0; k != 65; ++k)
+                h._buckets[k] = _buckets[k] - other._buckets[k];
+            return h;
+        }
+        
+    };
+    
+    mutable u64 iterations = 0;
+    histogram wait_ns;
+    histogram events;
+    histogram timer_lateness_ns;
+    histogram dispatch_ns;
+    
+    reactor_stats snapshot() const {
+        reactor_stats s;
+        s.iterations = atomic_load(&iterations, std::memory_order_relaxed);
+        s.wait_ns = wait_ns.snapshot();
+        s.events = events.snapshot();
+        s.timer_lateness_ns = timer_lateness_ns.snapshot();
+        s.dispatch_ns = dispatch_ns.snapshot();
+        return s;
+    }
+    
+    reactor_stats operator-(reactor_stats const& other) const {
+        reactor_stats s;
+        s.iterations = iterations - other.iterations;
+        s.wait_ns = wait_ns - other.wait_ns;
+        s.events = events - other.events;
+        s.timer_lateness_ns = timer_lateness_ns - other.timer_lateness_ns;
+        s.dispatch_ns = dispatch_ns - other.dispatch_ns;
+        return s;
+    }
+    
+};
 
 struct reactor {
     
-    // portable(?) lock-free reactor using select
+    // portable(?)lock-free reactor using select, or epoll where available
+    //
+    // select rebuilds its interest sets on every iteration and is limited to
+    // FD_SETSIZE descriptors; epoll keeps a persistent interest set in the
+    // kernel and reports only the descriptors that are ready
+    
+    enum class backend {
+        select,
+        epoll,
+    };
+    
+#if defined(__linux__)
+    static constexpr backend default_backend = backend::epoll;
+#else
+    static constexpr backend default_backend = backend::select;
+#endif
         
-    // todo: there is some threshold at which batch submission to the
-    // priority_queue and rebuilding the heap (3N) beats individually adding
-    // M elements (M ln(N))
+    // timers are kept in a hierarchical timing wheel, so insertion and
+    // expiry are O(1) at the cost of firing up to one tick late
     
-    // undefined behaviour when two waiters on the same fd event (served in
-    // reverse order but the first task will race to e.g. read all the data
-    // before the second task sees it)
+    // waiters on the same descriptor and event are queued, and each event
+    // wakes only the oldest.  the woken waiter holds its queue until its task
+    // has run: meanwhile the reactor stops watching for that event on that
+    // descriptor, so the next waiter is not woken into a race for the same
+    // data.  if the task re-arms, its new waiter goes to the front of the
+    // queue, so a waiter that finds nothing to read keeps its place.  the
+    // rest are woken by later events if the descriptor stays ready
             
     // buffers for recently-added waiters and timers
     alignas(64) stack<fn<void()>> _readers_buf;
     alignas(64) stack<fn<void()>> _writers_buf;
     alignas(64) stack<fn<void()>> _excepters_buf;
     alignas(64) stack<fn<void()>> _timers_buf;
+    alignas(64) stack<fn<void()>> _submissions_buf;
+    alignas(64) stack<fn<void()>> _purges_buf;
+    alignas(64) stack<fn<void()>> _edges_buf;
+    alignas(64) stack<fn<void()>> _releases_buf;
     alignas(64) mutable std::uint64_t _cancelled_and_notifications;
 
-    // single thread that waits on select
+    // single thread that waits on select or epoll_wait
     std::thread _thread;
+    
+    // number of times the thread has returned from blocking in select or
+    // epoll_wait
+    mutable std::uint64_t _wakeups;
 
-    // notification pipe
+    // notification channel; read and write ends are the same eventfd on
+    // Linux, or a non-blocking pipe elsewhere
     int _pipe[2];
+    
+    // notifications only need a syscall when the reactor is blocked in the
+    // kernel; a busy reactor will see the NOTIFIED_BIT before it next sleeps
+    // and poll instead
+    static constexpr std::uint64_t NOTIFIED_BIT = 0x0000'0000'0000'0001;
+    static constexpr std::uint64_t SLEEPING_BIT = 0x0000'0000'0000'0002;
     static constexpr std::uint64_t CANCELLED_BIT = 0x8000'0000'0000'0000;
+    
+    backend _backend;
+    int _epoll; // <-- epoll instance, or -1
 
-    reactor();    
+    // io_uring instance, or nullptr where it is unavailable or was not
+    // requested (see reactor.cpp)
+    struct ring;
+    ring* _ring;
+    
+    // timer wheel tick
+    std::chrono::steady_clock::duration _resolution;
+    
+    // busy-poll budget; before blocking in the kernel the reactor polls with
+    // a zero timeout for up to this long, trading a core for wakeup latency
+    std::chrono::steady_clock::duration _spin;
+    
+    // shared with the dispatch probes, which may run after we are gone
+    std::shared_ptr<reactor_stats> _stats;
+    
+    // time per loop iteration for running inline completions on the reactor
+    // thread; the rest are handed to the pool
+    std::chrono::steady_clock::duration _inline_budget;
+    
+    // buffers for readers that take one only once their descriptor is
+    // readable (see async_read_buffer); must outlive the buffers in flight
+    std::unique_ptr<buffer_pool> _buffers;
+    
+    explicit reactor(backend b = default_backend,
+                     std::chrono::steady_clock::duration resolution = std::chrono::milliseconds{1},
+                     bool completions = true,
+                     std::chrono::steady_clock::duration spin = std::chrono::steady_clock::duration::zero(),
+                     std::chrono::steady_clock::duration inline_budget = std::chrono::microseconds{50});
     ~reactor();
     
     void _notify() const {
-        auto old = atomic_fetch_or(&_cancelled_and_notifications, 1, std::memory_order_release);
-        if (!(old & 1)) {
-            unsigned char c{0};
-            if (write(_pipe[1], &c, 1) != 1) // <-- multiple writers are possible
-                (void) perror(nullptr), abort();
+        // only the first notifier after the reactor announces it is sleeping
+        // makes a syscall
+        auto old = atomic_fetch_or(&_cancelled_and_notifications,
+                                   NOTIFIED_BIT,
+                                   std::memory_order_release);
+        if ((old & (SLEEPING_BIT | NOTIFIED_BIT)) == SLEEPING_BIT)
+            _wake();
+    }
+    
+    void _wake() const;
+    void _drain() const;
+    
+    // announce that the reactor is about to block in the kernel; if a
+    // notification has already arrived the reactor must only poll
+    bool _sleep() const {
+        auto old = atomic_fetch_or(&_cancelled_and_notifications,
+                                   SLEEPING_BIT,
+                                   std::memory_order_acquire);
+        return !(old & (NOTIFIED_BIT | CANCELLED_BIT));
+    }
+    
+    // select cannot watch descriptors at or above FD_SETSIZE, and to try
+    // would write past the end of its sets, so such a registration is
+    // refused (fatally, as the reactor treats its other unrecoverable
+    // errors) on the registering thread, before it reaches the loop
+    void _check_descriptor(int fd) const {
+        if ((_backend == backend::select) && ((fd < 0) || (fd >= FD_SETSIZE)))
+            errno = EMFILE, (void) perror("reactor: descriptor out of range for select"), abort();
+    }
+    
+    // by kind of event, as the loop indexes its queues
+    static constexpr stack<fn<void()>> reactor::* _waiters_bufs[3] = {
+        &reactor::_readers_buf,
+        &reactor::_writers_buf,
+        &reactor::_excepters_buf,
+    };
+    
+    static constexpr int REARM = 2; // <-- in a waiter's _flags
+    
+    // the queue held by the task running on this thread, if any
+    struct _held {
+        reactor const* r;
+        int fd;
+        int k;
+    };
+    inline thread_local static _held _holding{nullptr, -1, -1};
+    
+    void _when_able(int fd, fn<void()> f, int k) const {
+        _check_descriptor(fd);
+        f->_fd = fd;
+        if ((_holding.r == this) && (_holding.fd == fd) && (_holding.k == k)) {
+            f->_flags |= REARM;
+            _holding.r = nullptr; // <-- once
         }
+        (this->*_waiters_bufs[k]).push(std::move(f));
+        _notify();
     }
     
-    void _when_able(int fd, fn<void()> f, stack<fn<void()>> const& target) const {
+    // run the task of a woken waiter, then release the queue it holds
+    void _run_held(int fd, int k, fn<void()> task) const {
+        auto old = std::exchange(_holding, _held{this, fd, k});
+        task();
+        _holding = old;
+        fn<void()> f{[] {}}; // <-- never called
         f->_fd = fd;
-        target.push(std::move(f));
+        f->_flags = k;
+        _releases_buf.push(std::move(f));
         _notify();
     }
     
     void when_readable(int fd, fn<void()> f) const {
-        _when_able(fd, std::move(f), _readers_buf);
+        _when_able(fd, std::move(f), 0);
     }
 
     void when_writeable(int fd, fn<void()> f) const {
-        _when_able(fd, std::move(f), _writers_buf);
+        _when_able(fd, std::move(f), 1);
     }
     
     void when_exceptional(int fd, fn<void()> f) const {
-        _when_able(fd, std::move(f), _excepters_buf);
+        _when_able(fd, std::move(f), 2);
+    }
+    
+    // inline completions run on the reactor thread as soon as their event
+    // arrives, saving the handoff to a pool thread.  they must be short and
+    // must not block; each iteration runs them for up to _inline_budget and
+    // then hands any left over to the pool, so a flood of them cannot
+    // starve the loop
+    
+    static constexpr int INLINE = 1; // <-- in a waiter's _flags
+    
+    void when_readable_inline(int fd, fn<void()> f) const {
+        f->_flags = INLINE;
+        _when_able(fd, std::move(f), 0);
+    }
+    
+    void when_writeable_inline(int fd, fn<void()> f) const {
+        f->_flags = INLINE;
+        _when_able(fd, std::move(f), 1);
+    }
+    
+    // a waiter may be a handle's node (see timer), and so be cancelled.
+    // each event wakes the oldest live waiter, so a cancelled waiter never
+    // swallows an event, but it holds its place (and keeps the descriptor in
+    // the interest set) until the descriptor is next ready, or until purge
+    // drops it
+    
+    timer when_readable_cancellable(int fd, fn<void()> f) const {
+        timer h{std::move(f)};
+        when_readable(fd, h._schedule());
+        return h;
+    }
+    
+    timer when_writeable_cancellable(int fd, fn<void()> f) const {
+        timer h{std::move(f)};
+        when_writeable(fd, h._schedule());
+        return h;
+    }
+    
+    // edge-triggered registrations (see detail::edge_node) need the epoll
+    // backend; the caller owns one reference to the node, and to detach it
+    // cancels the node and purges the descriptor
+    
+    bool has_edges() const {
+        return _backend == backend::epoll;
+    }
+    
+    detail::edge_node* when_readable_edges(int fd) const {
+        assert(has_edges());
+        auto p = new detail::edge_node(fd);
+        _edges_buf.push(fn<void()>{CountedPtr<detail::node<void()>>{p}});
+        _notify();
+        return p;
+    }
+    
+    void purge(int fd) const {
+        _check_descriptor(fd);
+        fn<void()> f{[] {}}; // <-- never called
+        f->_fd = fd;
+        _purges_buf.push(std::move(f));
+        _notify();
+    }
+    
+    // where the completion engine is available, reads and writes (and
+    // socket receives and sends) are
+    // submitted directly, in one batch per loop iteration, and their
+    // continuations are scheduled when they complete.  otherwise callers
+    // must wait for readiness and perform the operation themselves
+    
+    bool has_completions() const {
+        return _ring;
+    }
+    
+    void _submit(u64 opcode, int fd, void* buf, std::size_t count, int flags, ssize_t* result, fn<void()> f) const {
+        assert(_ring);
+        auto p = new detail::io_node(opcode, fd, buf, count, flags, result, std::move(f));
+        _submissions_buf.push(fn<void()>{CountedPtr<detail::node<void()>>{p}});
+        _notify();
+    }
+    
+    void submit_read(int fd, void* buf, std::size_t count, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::READ, fd, buf, count, 0, result, std::move(f));
+    }
+    
+    void submit_write(int fd, void const* buf, std::size_t count, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::WRITE, fd, const_cast<void*>(buf), count, 0, result, std::move(f));
+    }
+    
+    void submit_recv(int fd, void* buf, std::size_t count, int flags, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::RECV, fd, buf, count, flags, result, std::move(f));
+    }
+    
+    void submit_send(int fd, void const* buf, std::size_t count, int flags, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::SEND, fd, const_cast<void*>(buf), count, flags, result, std::move(f));
     }
         
+    void submit_readv(int fd, iovec const* iov, int iovcnt, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::READV, fd, const_cast<iovec*>(iov), iovcnt, 0, result, std::move(f));
+    }
+    
+    void submit_writev(int fd, iovec const* iov, int iovcnt, ssize_t* result, fn<void()> f) const {
+        _submit(detail::io_node::WRITEV, fd, const_cast<iovec*>(iov), iovcnt, 0, result, std::move(f));
+    }
+    
+    // a timer that cannot be cancelled costs no extra allocation
     template<typename TimePoint>
-    void when(TimePoint&& t, fn<void()> f) const {
+    void _when(TimePoint&& t, fn<void()> f) const {
         f->_t = t;
         _timers_buf.push(std::move(f));
         _notify();
     }
     
+    template<typename TimePoint>
+    void when(TimePoint&& t, timer const& h) const {
+        _when(std::forward<TimePoint>(t), h._schedule());
+    }
+    
+    template<typename TimePoint>
+    timer when(TimePoint&& t, fn<void()> f) const {
+        timer h{std::move(f)};
+        when(std::forward<TimePoint>(t), h);
+        return h;
+    }
+    
     template<typename Duration>
-    void after(Duration&& t, std::function<void()> f) const {
-        when(std::chrono::steady_clock::now() + std::forward<Duration>(t),
-             std::move(f));
+    timer after(Duration&& t, fn<void()> f) const {
+        return when(std::chrono::steady_clock::now() + std::forward<Duration>(t),
+                    std::move(f));
     }
 
-    void _run() const;
+    reactor_stats stats() const {
+        return _stats->snapshot();
+    }
     
-    static reactor const& get() {
-        static reactor r;
-        return r;
+    buffer_pool& buffers() const {
+        return *_buffers;
     }
     
+    void _run() const;
+    void _run_select() const;
+    void _run_epoll() const;
+    
+    // the home shard of the calling thread, for timers, and the shard that
+    // owns a descriptor (see reactor_group)
+    static reactor const& get();
+    static reactor const& get(int fd);
+    
     void _cancel() const {
         atomic_fetch_or(&_cancelled_and_notifications,
                         CANCELLED_BIT,
@@ -108,4 +715,69 @@ struct reactor {
         
 };
 
+// sharded reactors
+//
+// a single reactor thread caps the rate at which events can be dispatched,
+// so a group runs one reactor per shard.  each descriptor must be pinned to
+// one shard, so that all its waiters meet in the same interest set; by
+// default the descriptor number picks the shard, which spreads the dense
+// small integers the kernel hands out evenly, but callers may name a shard
+// explicitly instead
+//
+// timers have no owner, so they go to the home shard of the submitting
+// thread, chosen round-robin on first use.  submission to any shard is the
+// same lock-free push, and costs a syscall only if that shard is asleep
+
+struct reactor_group {
+    
+    std::vector<std::unique_ptr<reactor>> _shards;
+    
+    // one shard for every few cores; each reactor thread spends most of
+    // its time in the kernel, and hands the tasks it wakes to the pool
+    static std::size_t default_shards() {
+        return std::max<std::size_t>(1, std::thread::hardware_concurrency() / 4);
+    }
+    
+    explicit reactor_group(std::size_t n = default_shards(),
+                           reactor::backend b = reactor::default_backend,
+                           std::chrono::steady_clock::duration resolution = std::chrono::milliseconds{1});
+    
+    reactor_group(reactor_group const&) = delete;
+    reactor_group& operator=(reactor_group const&) = delete;
+    
+    std::size_t size() const {
+        return _shards.size();
+    }
+    
+    reactor const& operator[](std::size_t i) const {
+        assert(i < _shards.size());
+        return *_shards[i];
+    }
+    
+    reactor const& shard(int fd) const {
+        assert(fd >= 0);
+        return *_shards[(std::size_t) fd % _shards.size()];
+    }
+    
+    reactor const& local() const {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t home = next.fetch_add(1, std::memory_order_relaxed);
+        return *_shards[home % _shards.size()];
+    }
+    
+    static reactor_group const& get() {
+        static reactor_group g;
+        return g;
+    }
+    
+};
+
+inline reactor const& reactor::get() {
+    return reactor_group::get().local();
+}
+
+inline reactor const& reactor::get(int fd) {
+    return reactor_group::get().shard(fd);
+}
+
 #endif /* reactor_hpp */
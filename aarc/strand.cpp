@@ -0,0 +1,79 @@
+//
+//  strand.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#include <thread>
+#include <vector>
+
+#include "strand.hpp"
+
+#include <catch2/catch.hpp>
+
+TEST_CASE("strand", "[strand]") {
+    
+    pool_dual p(4);
+    
+    {
+        // tasks from many threads run one at a time, each thread's in order
+        strand s(p);
+        int n = 0; // <-- guarded by the strand alone
+        std::atomic<bool> inside{false};
+        std::atomic<bool> overlapped{false};
+        std::vector<int> last(4, -1);
+        bool reordered = false;
+        std::vector<std::thread> threads;
+        for (int i = 0; i != 4; ++i)
+            threads.emplace_back([&, i] {
+                for (int j = 0; j != 10'000; ++j)
+                    s.submit([&, i, j] {
+                        if (inside.exchange(true, std::memory_order_acquire))
+                            overlapped = true;
+                        ++n;
+                        if (last[i] + 1 != j)
+                            reordered = true;
+                        last[i] = j;
+                        inside.store(false, std::memory_order_release);
+                    });
+            });
+        for (auto& t : threads)
+            t.join();
+        p.quiesce();
+        REQUIRE(!overlapped);
+        REQUIRE(!reordered);
+        REQUIRE(n == 40'000);
+    }
+    
+    {
+        // tasks submitted by a task run after it, and strands run in
+        // parallel with each other
+        std::vector<std::unique_ptr<strand>> strands;
+        std::vector<std::vector<int>> orders(16);
+        for (int i = 0; i != 16; ++i)
+            strands.emplace_back(new strand(p));
+        for (int i = 0; i != 16; ++i)
+            for (int j = 0; j != 100; ++j)
+                strands[i]->submit([&, i, j] {
+                    orders[i].push_back(2 * j);
+                    strands[i]->submit([&, i, j] { orders[i].push_back(2 * j + 1); });
+                });
+        p.quiesce();
+        for (auto& v : orders) {
+            REQUIRE(v.size() == 200);
+            std::vector<int> seen(200, -1);
+            for (int k = 0; k != 200; ++k)
+                seen[v[k]] = k;
+            for (int j = 0; j != 100; ++j) {
+                REQUIRE(seen[2 * j] < seen[2 * j + 1]);
+                if (j) {
+                    REQUIRE(seen[2 * j - 2] < seen[2 * j]);
+                    REQUIRE(seen[2 * j - 1] < seen[2 * j + 1]);
+                }
+            }
+        }
+    }
+    
+}
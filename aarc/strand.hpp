@@ -0,0 +1,87 @@
+//
+//  strand.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef strand_hpp
+#define strand_hpp
+
+#include "atomic.hpp"
+#include "dual.hpp"
+#include "fn.hpp"
+#include "pool.hpp"
+#include "stack.hpp"
+
+// strand
+//
+// a serial executor: tasks submitted to a strand run one at a time, in the
+// order they were submitted (per submitting thread), on the pool's workers,
+// without blocking a worker and without a thread of its own.  use one per
+// connection or account instead of a mutex around its state
+//
+// tasks are pushed onto a lock-free stack.  the push that finds the stack
+// empty schedules a drain on the pool; while the drain runs, the stack holds
+// a sentinel at the bottom, so that pushes meanwhile see it nonempty and do
+// not schedule another.  the drain swaps the sentinel in, runs the batch it
+// took off oldest first, and then either swings the sentinel out, leaving
+// the stack empty, or, if more tasks have arrived, schedules itself again,
+// so that a busy strand yields its worker between batches.  at most one
+// drain is ever scheduled or running
+//
+// a strand must outlive its tasks
+
+struct strand {
+    
+    using P = CountedPtr<detail::node<void()>>;
+    
+    stack<fn<void()>> _stack;
+    mutable detail::node<void()> _sentinel; // <-- marks the strand as running
+    pool_dual const* _pool;
+    lane _lane;
+    
+    explicit strand(pool_dual const& pool = pool_dual::_get(), lane l = lane::normal)
+    : _pool(&pool)
+    , _lane(l) {
+    }
+    
+    strand(strand const&) = delete;
+    strand& operator=(strand const&) = delete;
+    
+    ~strand() {
+        assert(_stack._head.ptr != &_sentinel);
+    }
+    
+    void submit(fn<void()> f) const {
+        if (_stack.push(std::move(f)))
+            _schedule();
+    }
+    
+    void _schedule() const {
+        _pool->submit([this] { _drain(); }, _lane);
+    }
+    
+    void _drain() const {
+        P sentinel{&_sentinel};
+        P head = atomic_exchange(&_stack._head, sentinel, std::memory_order_acquire);
+        // the tasks above the sentinel (or, the first time, all of them)
+        // are newest first
+        stack<fn<void()>> batch;
+        while (head.ptr && (head.ptr != &_sentinel)) {
+            P next = head->_next;
+            head->_next = batch._head;
+            batch._head = head;
+            head = next;
+        }
+        while (!batch.empty())
+            batch.pop()();
+        P expected = sentinel;
+        if (!atomic_compare_exchange_strong(&_stack._head, &expected, P{nullptr}, std::memory_order_release, std::memory_order_relaxed))
+            _schedule(); // <-- more arrived; stay running, but let others go first
+    }
+    
+};
+
+#endif /* strand_hpp */
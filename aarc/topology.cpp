@@ -0,0 +1,121 @@
+//
+//  topology.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "topology.hpp"
+
+#include <catch2/catch.hpp>
+
+std::vector<unsigned> topology::parse_cpulist(std::string const& s) {
+    std::vector<unsigned> v;
+    std::istringstream in(s);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        unsigned a, b;
+        char dash;
+        std::istringstream r(range);
+        if (!(r >> a))
+            continue;
+        b = a;
+        if ((r >> dash) && (dash == '-'))
+            r >> b;
+        for (unsigned c = a; c <= b; ++c)
+            v.push_back(c);
+    }
+    return v;
+}
+
+topology topology::discover() {
+    topology t;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool restricted = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    // node numbers may be sparse (offline or hot-pluggable nodes), so we
+    // take them from the list of those online rather than count up
+    std::string online;
+    std::getline(std::ifstream("/sys/devices/system/node/online"), online);
+    for (unsigned i : parse_cpulist(online)) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(i) + "/cpulist");
+        if (!f)
+            continue;
+        std::string s;
+        std::getline(f, s);
+        std::vector<unsigned> cpus;
+        for (unsigned c : parse_cpulist(s))
+            if ((c < CPU_SETSIZE) && (!restricted || CPU_ISSET(c, &allowed))) // <-- we could not pin it
+                cpus.push_back(c);
+        if (!cpus.empty()) // <-- memory-only nodes have no CPUs
+            t._nodes.push_back(std::move(cpus));
+    }
+#endif
+    if (t._nodes.empty()) {
+        t._nodes.emplace_back();
+        for (unsigned c = 0; c != std::thread::hardware_concurrency(); ++c)
+            t._nodes.back().push_back(c);
+    }
+    return t;
+}
+
+int topology::current_cpu() {
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+bool topology::pin(unsigned cpu) {
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t s;
+    CPU_ZERO(&s);
+    CPU_SET(cpu, &s);
+    return pthread_setaffinity_np(pthread_self(), sizeof(s), &s) == 0;
+#else
+    (void) cpu;
+    return false; // <-- macOS offers only affinity hints
+#endif
+}
+
+TEST_CASE("topology", "[topology]") {
+    
+    using v = std::vector<unsigned>;
+    REQUIRE(topology::parse_cpulist("0") == v{0});
+    REQUIRE(topology::parse_cpulist("0-3,8-9\n") == v{0, 1, 2, 3, 8, 9});
+    REQUIRE(topology::parse_cpulist("2,4,6") == v{2, 4, 6});
+    REQUIRE(topology::parse_cpulist("").empty());
+    REQUIRE(topology::parse_cpulist("0,2-3,7\n") == v{0, 2, 3, 7}); // <-- sparse node numbers
+    
+    auto t = topology::discover();
+    REQUIRE(t.nodes() >= 1);
+    REQUIRE(t.cpus() >= 1);
+    REQUIRE(t.node_of(t._nodes.back().back()) == t.nodes() - 1);
+
+#if defined(__linux__)
+    unsigned c = t._nodes.back().back();
+    bool pinned = false;
+    int cpu = -1;
+    std::thread([&] {
+        pinned = topology::pin(c);
+        cpu = topology::current_cpu();
+    }).join();
+    REQUIRE(pinned);
+    REQUIRE(cpu == (int) c);
+#endif
+    
+}
@@ -0,0 +1,60 @@
+//
+//  topology.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef topology_hpp
+#define topology_hpp
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// machine topology
+//
+// the CPUs of each NUMA node, as listed under /sys/devices/system/node and
+// restricted to the CPUs this process may run on.  where there is no such
+// listing (or on other systems) the machine is one node of
+// hardware_concurrency CPUs
+
+struct topology {
+    
+    std::vector<std::vector<unsigned>> _nodes; // <-- the CPUs of each node
+    
+    // parse a kernel cpulist such as "0-3,8-11" (the same format lists nodes)
+    static std::vector<unsigned> parse_cpulist(std::string const& s);
+    
+    static topology discover();
+    
+    std::size_t nodes() const {
+        return _nodes.size();
+    }
+    
+    std::size_t cpus() const {
+        std::size_t n = 0;
+        for (auto& v : _nodes)
+            n += v.size();
+        return n;
+    }
+    
+    // the node of a CPU, or zero if unknown
+    unsigned node_of(unsigned cpu) const {
+        for (std::size_t i = 0; i != _nodes.size(); ++i)
+            for (unsigned c : _nodes[i])
+                if (c == cpu)
+                    return (unsigned) i;
+        return 0;
+    }
+    
+    // the CPU the calling thread is running on, or -1 if unknown
+    static int current_cpu();
+    
+    // pin the calling thread to a CPU; false if that is unsupported
+    static bool pin(unsigned cpu);
+    
+};
+
+#endif /* topology_hpp */
@@ -0,0 +1,140 @@
+//
+//  wheel.cpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "wheel.hpp"
+
+#include <catch2/catch.hpp>
+
+TEST_CASE("wheel", "[wheel]") {
+    
+    using namespace std::chrono;
+    
+    auto t0 = steady_clock::now();
+    auto resolution = microseconds{100};
+    wheel w(resolution, t0);
+    
+    std::mt19937_64 g;
+    int n = 100'000;
+    int fired = 0;
+    
+    // deadlines from the past to well beyond the top level
+    std::uniform_int_distribution<int> u(0, 26);
+    for (int i = 0; i != n; ++i) {
+        fn<void()> f{[&fired] { ++fired; }};
+        f->_t = t0 + nanoseconds{(std::int64_t) (g() >> u(g) >> 26)} - milliseconds{1};
+        w.insert(std::move(f));
+    }
+    
+    auto t = t0;
+    auto previous = t0 - milliseconds{1}; // <-- the earliest deadline
+    while (fired != n) {
+        stack<fn<void()>> pending;
+        auto next = w.expire(t, pending);
+        REQUIRE(next > t);
+        for (auto& x : pending) {
+            REQUIRE(x._t <= t); // <-- never early
+            REQUIRE(x._t > previous - resolution); // <-- at most one tick late
+        }
+        while (!pending.empty())
+            pending.pop()();
+        previous = t;
+        // sometimes jump to the next event, sometimes stop short of it
+        t = (g() & 1) ? next : t + (next - t) / 2;
+    }
+    
+    stack<fn<void()>> pending;
+    REQUIRE(w.expire(t, pending) == steady_clock::time_point::max());
+    REQUIRE(pending.empty());
+    
+}
+
+TEST_CASE("wheel-bench", "[wheel][.bench]") {
+    
+    // insert N timers with deadlines drawn from a distribution, then expire
+    // them all, waking at each next event as the reactor would
+    
+    using namespace std::chrono;
+    
+    struct earliest_first {
+        bool operator()(const fn<void()>& a,
+                        const fn<void()>& b) {
+            return a->_t > b->_t;
+        }
+    };
+    
+    auto make = [](int n, auto&& distribution, steady_clock::time_point t0) {
+        std::mt19937_64 g;
+        std::vector<fn<void()>> v;
+        v.reserve(n);
+        for (int i = 0; i != n; ++i) {
+            v.emplace_back([] {});
+            v.back()->_t = t0 + distribution(g);
+        }
+        return v;
+    };
+    
+    auto bench_heap = [](std::vector<fn<void()>> v) {
+        stack<fn<void()>> expired;
+        auto a = steady_clock::now();
+        std::priority_queue<fn<void()>, std::vector<fn<void()>>, earliest_first> q;
+        for (auto& f : v)
+            q.push(std::move(f));
+        while (!q.empty()) {
+            auto t = q.top()->_t;
+            while ((!q.empty()) && (q.top()->_t <= t)) {
+                expired.push(std::move(const_cast<fn<void()>&>(q.top())));
+                q.pop();
+            }
+        }
+        auto b = steady_clock::now();
+        return duration<double, std::nano>(b - a).count() / v.size();
+    };
+    
+    auto bench_wheel = [](std::vector<fn<void()>> v, steady_clock::time_point t0) {
+        stack<fn<void()>> expired;
+        auto a = steady_clock::now();
+        wheel w(milliseconds{1}, t0);
+        for (auto& f : v)
+            w.insert(std::move(f));
+        for (auto t = t0; t != steady_clock::time_point::max(); )
+            t = w.expire(t, expired);
+        auto b = steady_clock::now();
+        return duration<double, std::nano>(b - a).count() / v.size();
+    };
+    
+    auto uniform = [](milliseconds a, milliseconds b) {
+        return [=](std::mt19937_64& g) {
+            return milliseconds{std::uniform_int_distribution<std::int64_t>(a.count(), b.count())(g)};
+        };
+    };
+    
+    auto bimodal = [](std::mt19937_64& g) {
+        // mostly short request timeouts, a few long idle timeouts
+        if (g() % 100)
+            return milliseconds{std::uniform_int_distribution<std::int64_t>(1, 100)(g)};
+        return milliseconds{std::uniform_int_distribution<std::int64_t>(60'000, 86'400'000)(g)};
+    };
+    
+    auto t0 = steady_clock::now();
+    for (int n : { 1'000, 10'000, 100'000, 1'000'000 }) {
+        auto sweep = [&](char const* name, auto&& distribution) {
+            double h = bench_heap(make(n, distribution, t0));
+            double w = bench_wheel(make(n, distribution, t0), t0);
+            printf("%8d timers, %-16s heap %7.1f ns, wheel %7.1f ns per timer\n", n, name, h, w);
+        };
+        sweep("1-10ms", uniform(milliseconds{1}, milliseconds{10}));
+        sweep("1ms-1s", uniform(milliseconds{1}, milliseconds{1'000}));
+        sweep("1ms-1h", uniform(milliseconds{1}, milliseconds{3'600'000}));
+        sweep("bimodal", bimodal);
+    }
+    
+}
@@ -0,0 +1,219 @@
+//
+//  wheel.hpp
+//  aarc
+//
+//  Created by Antony Searle on 16/10/26.
+//  Copyright © 2026 Antony Searle. All rights reserved.
+//
+
+#ifndef wheel_hpp
+#define wheel_hpp
+
+#include <algorithm>
+#include <chrono>
+
+#include "fn.hpp"
+#include "stack.hpp"
+
+// hierarchical timing wheel
+//
+// timers are fn<void()> nodes whose _t is the deadline.  time is divided
+// into ticks of configurable resolution, and a timer is filed by the highest
+// bit in which its tick differs from the current tick, so level 0 holds the
+// timers due in the current rotation of 64 ticks, level 1 the timers due in
+// the current rotation of 64 * 64 ticks, and so on.  when the current tick
+// enters an occupied higher-level slot, that slot is cascaded down to the
+// lower levels.  timers beyond the top level wait in an overflow list that
+// is refiled whenever the top level rolls over
+//
+// insertion and expiry are O(1); each timer is refiled at most once per
+// level.  occupancy bitmaps let us skip directly to the next nonempty slot
+//
+// timers never fire early, and fire at most one tick late
+//
+// cancelled timers are dropped when their slot is cascaded or expired, and
+// are purged from the front of the next slot to be visited so that the
+// reactor does not wake up for them
+
+struct wheel {
+    
+    using clock = std::chrono::steady_clock;
+    
+    static constexpr u64 BITS = 6;
+    static constexpr u64 SLOTS = 1 << BITS;
+    static constexpr u64 MASK = SLOTS - 1;
+    static constexpr u64 LEVELS = 4;
+    static constexpr u64 NEVER = ~(u64) 0;
+    
+    clock::duration _resolution;
+    clock::time_point _origin; // <-- the time of tick zero
+    u64 _now; // <-- all timers due at or before this tick have expired
+    u64 _occupied[LEVELS]; // <-- bitmaps of nonempty slots
+    stack<fn<void()>> _slots[LEVELS][SLOTS];
+    stack<fn<void()>> _overflow;
+    stack<fn<void()>> _due;
+    
+    explicit wheel(clock::duration resolution = std::chrono::milliseconds{1},
+                   clock::time_point origin = clock::now())
+    : _resolution(resolution)
+    , _origin(origin)
+    , _now(0)
+    , _occupied{} {
+        assert(_resolution > clock::duration::zero());
+    }
+    
+    wheel(wheel const&) = delete;
+    wheel& operator=(wheel const&) = delete;
+    
+    // the first tick at or after t
+    u64 _ceil(clock::time_point t) const {
+        if (t <= _origin)
+            return 0;
+        auto d = t - _origin;
+        return (u64) (d / _resolution) + (d % _resolution != clock::duration::zero());
+    }
+    
+    // the last tick at or before t
+    u64 _floor(clock::time_point t) const {
+        if (t <= _origin)
+            return 0;
+        return (u64) ((t - _origin) / _resolution);
+    }
+    
+    void insert(fn<void()> f) {
+        u64 k = _ceil(f->_t);
+        if (k <= _now) {
+            _due.push(std::move(f));
+            return;
+        }
+        u64 l = (63 - __builtin_clzll(k ^ _now)) / BITS;
+        if (l >= LEVELS) {
+            _overflow.push(std::move(f));
+            return;
+        }
+        u64 s = (k >> (BITS * l)) & MASK;
+        _slots[l][s].push(std::move(f));
+        _occupied[l] |= (u64) 1 << s;
+    }
+    
+    // the tick at which the first occupied slot of a level must be expired
+    // or cascaded
+    u64 _first(u64 l) const {
+        assert(_occupied[l]);
+        // occupied slots always lie ahead of the current position in their
+        // level
+        u64 s = __builtin_ctzll(_occupied[l]);
+        u64 k = ((_now >> (BITS * (l + 1))) << (BITS * (l + 1))) | (s << (BITS * l));
+        assert(k > _now);
+        return k;
+    }
+    
+    u64 _rollover() const {
+        return ((_now >> (BITS * LEVELS)) + 1) << (BITS * LEVELS);
+    }
+    
+    // the first tick after _now at which a slot must be expired or
+    // cascaded, or NEVER
+    u64 _next() {
+        u64 e = NEVER;
+        for (u64 l = 0; l != LEVELS; ++l)
+            if (_occupied[l])
+                e = std::min(e, _first(l));
+        if (!_overflow.empty())
+            e = std::min(e, _rollover());
+        return e;
+    }
+    
+    // as _next, but first drop cancelled timers from the front of the slots
+    // that would be visited, until one is found that holds a live timer
+    u64 _next_live() {
+        for (;;) {
+            u64 e = _next();
+            bool live = (e == NEVER) || (!_overflow.empty() && (e == _rollover()));
+            for (u64 l = 0; !live && (l != LEVELS); ++l) {
+                if (_occupied[l] && (_first(l) == e)) {
+                    u64 s = (e >> (BITS * l)) & MASK;
+                    auto& slot = _slots[l][s];
+                    while (!slot.empty() && slot._head.ptr->cancelled())
+                        slot.pop(); // <-- discard
+                    if (slot.empty())
+                        _occupied[l] &= ~((u64) 1 << s);
+                    else
+                        live = true;
+                }
+            }
+            if (live)
+                return e;
+        }
+    }
+    
+    void _refile(stack<fn<void()>> s) {
+        while (!s.empty()) {
+            auto f = s.pop();
+            if (!f->cancelled())
+                insert(std::move(f));
+        }
+    }
+    
+    // ordinary timers yield themselves; cancellable timers yield their task,
+    // or nothing if they were cancelled.  fired is told the deadline of each
+    // timer that fires
+    template<typename F>
+    static void _fire(stack<fn<void()>> s, stack<fn<void()>>& pending, F& fired) {
+        while (!s.empty()) {
+            auto f = s.pop();
+            auto t = f->_t;
+            if (auto p = std::exchange(f._value, nullptr).ptr->expire()) {
+                fired(t);
+                pending.push(fn<void()>{CountedPtr<detail::node<void()>>{p}});
+            }
+        }
+    }
+    
+    template<typename F>
+    void _visit(u64 e, stack<fn<void()>>& pending, F& fired) {
+        assert(e > _now);
+        _now = e;
+        if (!(e & (((u64) 1 << (BITS * LEVELS)) - 1)))
+            _refile(std::move(_overflow));
+        // cascade from the top down, so timers can fall through several
+        // levels in one visit
+        for (u64 l = LEVELS; --l; ) {
+            if (!(e & (((u64) 1 << (BITS * l)) - 1))) {
+                u64 s = (e >> (BITS * l)) & MASK;
+                if (_occupied[l] & ((u64) 1 << s)) {
+                    _occupied[l] &= ~((u64) 1 << s);
+                    _refile(std::move(_slots[l][s]));
+                }
+            }
+        }
+        u64 s = e & MASK;
+        if (_occupied[0] & ((u64) 1 << s)) {
+            _occupied[0] &= ~((u64) 1 << s);
+            _fire(std::move(_slots[0][s]), pending, fired);
+        }
+    }
+    
+    // move the timers due at or before t to pending, and return the time of
+    // the next event (which may be a cascade rather than an expiry), or
+    // time_point::max() if the wheel is empty
+    template<typename F>
+    clock::time_point expire(clock::time_point t, stack<fn<void()>>& pending, F&& fired) {
+        u64 target = _floor(t);
+        for (u64 e; (e = _next()) <= target; )
+            _visit(e, pending, fired);
+        _now = std::max(_now, target);
+        _fire(std::move(_due), pending, fired);
+        u64 e = _next_live();
+        if (e == NEVER)
+            return clock::time_point::max();
+        return _origin + (clock::rep) e * _resolution;
+    }
+    
+    clock::time_point expire(clock::time_point t, stack<fn<void()>>& pending) {
+        return expire(t, pending, [](clock::time_point) {});
+    }
+    
+};
+
+#endif /* wheel_hpp */